@@ -0,0 +1,154 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#pragma once
+
+#include "Vec2.h"
+#include "Rect.h"
+
+namespace sb {
+	//Min/max box used by the acceleration structures. Rect keeps center/size, which is the
+	//wrong layout for overlap tests done millions of times per frame.
+	struct AABB {
+	public:
+		//Members
+		float minx, miny, maxx, maxy;
+		//Constructors
+		inline AABB() {
+			minx = miny = maxx = maxy = 0;
+		}
+		inline AABB(float minx, float miny, float maxx, float maxy) {
+			assert(minx <= maxx && miny <= maxy);
+			this->minx = minx;
+			this->miny = miny;
+			this->maxx = maxx;
+			this->maxy = maxy;
+		}
+		inline explicit AABB(const Rect& r) {
+			minx = r.left();
+			miny = r.bottom();
+			maxx = r.right();
+			maxy = r.top();
+		}
+		//Box that contains nothing. Merging a box into it gives that box back.
+		static inline AABB inverted() {
+			AABB r;
+			r.minx = r.miny = std::numeric_limits<float>::max();
+			r.maxx = r.maxy = -std::numeric_limits<float>::max();
+			return r;
+		}
+		//Accessors
+		inline float width() const {
+			return maxx - minx;
+		}
+		inline float height() const {
+			return maxy - miny;
+		}
+		inline Vec2 center() const {
+			return Vec2((minx + maxx) * 0.5f, (miny + maxy) * 0.5f);
+		}
+		inline float perimeter() const {
+			return 2 * (maxx - minx) + 2 * (maxy - miny);
+		}
+		inline float area() const {
+			return (maxx - minx) * (maxy - miny);
+		}
+		//Tests
+		inline bool overlaps(const AABB& another) const {
+			return minx <= another.maxx && another.minx <= maxx &&
+				miny <= another.maxy && another.miny <= maxy;
+		}
+		inline bool containsPoint(const Vec2& pt) const {
+			return pt.x >= minx && pt.x <= maxx && pt.y >= miny && pt.y <= maxy;
+		}
+		inline bool containsAABB(const AABB& another) const {
+			return another.minx >= minx && another.maxx <= maxx &&
+				another.miny >= miny && another.maxy <= maxy;
+		}
+		//Operations
+		inline AABB fattened(float margin) const {
+			return AABB(minx - margin, miny - margin, maxx + margin, maxy + margin);
+		}
+		inline void merge(const AABB& another) {
+			//values instead of std::min/max references, so this compiles to min/max instructions instead of branches
+			const float x0 = another.minx, y0 = another.miny, x1 = another.maxx, y1 = another.maxy;
+			minx = x0 < minx ? x0 : minx;
+			miny = y0 < miny ? y0 : miny;
+			maxx = x1 > maxx ? x1 : maxx;
+			maxy = y1 > maxy ? y1 : maxy;
+		}
+		//Conversions
+		inline Rect toRect() const {
+			Rect r;
+			r.setBounds(minx, maxx, miny, maxy);
+			return r;
+		}
+		//Description
+		inline std::string toString() const {
+			return "{" + Vec2(minx, miny).toString() + ", " + Vec2(maxx, maxy).toString() + "}";
+		}
+	};
+
+	inline AABB getUnion(const AABB& a, const AABB& b) {
+		AABB r = a;
+		r.merge(b);
+		return r;
+	}
+	inline bool operator ==(const AABB& a, const AABB& b) {
+		return a.minx == b.minx && a.miny == b.miny && a.maxx == b.maxx && a.maxy == b.maxy;
+	}
+	inline bool operator !=(const AABB& a, const AABB& b) {
+		return !(a == b);
+	}
+
+	//Distance from pt to the closest point of the box, 0 when pt is inside
+	inline float pointDistance(const AABB& b, const Vec2& pt) {
+		const auto dx = std::max(std::max(b.minx - pt.x, pt.x - b.maxx), 0.0f);
+		const auto dy = std::max(std::max(b.miny - pt.y, pt.y - b.maxy), 0.0f);
+		return sqrtf(dx * dx + dy * dy);
+	}
+
+	//Slab test against a ray that starts at origin and walks along a normalized direction. Returns
+	//false if the ray misses the box or only reaches it after maxT. The ray may start inside the box,
+	//in which case tEnter is 0.
+	inline bool raySlab(const AABB& b, const Vec2& origin, const Vec2& direction, float maxT, float* tEnter) {
+		float tmin = 0;
+		float tmax = maxT;
+		if (direction.x == 0) {
+			if (origin.x < b.minx || origin.x > b.maxx)
+				return false;
+		}
+		else {
+			const auto inv = 1.0f / direction.x;
+			auto t1 = (b.minx - origin.x) * inv;
+			auto t2 = (b.maxx - origin.x) * inv;
+			if (t1 > t2)
+				std::swap(t1, t2);
+			tmin = std::max(tmin, t1);
+			tmax = std::min(tmax, t2);
+			if (tmin > tmax)
+				return false;
+		}
+		if (direction.y == 0) {
+			if (origin.y < b.miny || origin.y > b.maxy)
+				return false;
+		}
+		else {
+			const auto inv = 1.0f / direction.y;
+			auto t1 = (b.miny - origin.y) * inv;
+			auto t2 = (b.maxy - origin.y) * inv;
+			if (t1 > t2)
+				std::swap(t1, t2);
+			tmin = std::max(tmin, t1);
+			tmax = std::min(tmax, t2);
+			if (tmin > tmax)
+				return false;
+		}
+		if (tEnter)
+			*tEnter = tmin;
+		return true;
+	}
+}
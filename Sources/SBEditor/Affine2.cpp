@@ -0,0 +1,12 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#include "pch.h"
+#include "Affine2.h"
+
+using namespace sb;
+
+const Affine2 Affine2::identity = Affine2(1, 0, 0, 0, 1, 0);
@@ -0,0 +1,255 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#pragma once
+
+#include "Utils.h"
+#include "Vec2.h"
+#include "Polygon.h"
+#include "Rect.h"
+#include "Matrix3x3.h"
+
+namespace sb {
+	//Affine transform, kept as the top two rows of a Matrix3x3 whose bottom row is 0 0 1. Composing,
+	//inverting and transforming skip the projective row.
+	struct Affine2 {
+	public:
+		//Elements
+		union {
+			struct {
+				float e00;
+				float e10;
+				float e01;
+				float e11;
+				float e02;
+				float e12;
+			};
+			float elements[6];
+		};
+		//Constants
+		static const Affine2 identity;
+		//Constructors
+		inline Affine2() {
+			elements[0] = elements[1] = elements[2] = 0;
+			elements[3] = elements[4] = elements[5] = 0;
+		}
+		inline Affine2(float e00, float e01, float e02,
+					   float e10, float e11, float e12) {
+			this->e00 = e00;
+			this->e01 = e01;
+			this->e02 = e02;
+			this->e10 = e10;
+			this->e11 = e11;
+			this->e12 = e12;
+		}
+		inline explicit Affine2(const Matrix3x3& m) {
+			assert(m.isAffine());
+			e00 = m.e00;
+			e10 = m.e10;
+			e01 = m.e01;
+			e11 = m.e11;
+			e02 = m.e02;
+			e12 = m.e12;
+		}
+		//Pseudo-constructors
+		inline static Affine2 fromTranslation(const Vec2& translation) {
+			return Affine2(1, 0, translation.x, 0, 1, translation.y);
+		}
+		inline static Affine2 fromTranslation(float tx, float ty) {
+			return Affine2(1, 0, tx, 0, 1, ty);
+		}
+		inline static Affine2 fromScale(const Vec2& scale) {
+			return Affine2(scale.x, 0, 0, 0, scale.y, 0);
+		}
+		inline static Affine2 fromScale(float sx, float sy) {
+			return Affine2(sx, 0, 0, 0, sy, 0);
+		}
+		inline static Affine2 fromRotation(float angle) {
+			auto cos0 = cosf(angle);
+			auto sin0 = sinf(angle);
+			return Affine2(cos0, -sin0, 0, sin0, cos0, 0);
+		}
+		inline static Affine2 fromSkew(const Vec2& skew) {
+			return Affine2(1, skew.x, 0, skew.y, 1, 0);
+		}
+		inline static Affine2 fromSkew(float kx, float ky) {
+			return Affine2(1, kx, 0, ky, 1, 0);
+		}
+		//Conversions
+		inline Matrix3x3 toMatrix3x3() const {
+			return Matrix3x3(e00, e01, e02,
+							 e10, e11, e12,
+							 0, 0, 1);
+		}
+		//Information
+		inline Vec2 xVector() const {
+			return Vec2(e00, e10);
+		}
+		inline void setXVector(const Vec2& value) {
+			e00 = value.x;
+			e10 = value.y;
+		}
+		inline Vec2 yVector() const {
+			return Vec2(e01, e11);
+		}
+		inline void setYVector(const Vec2& value) {
+			e01 = value.x;
+			e11 = value.y;
+		}
+		inline Vec2 translation() const {
+			return Vec2(e02, e12);
+		}
+		inline void setTranslation(const Vec2& value) {
+			e02 = value.x;
+			e12 = value.y;
+		}
+		inline void setTranslation(float tx, float ty) {
+			e02 = tx;
+			e12 = ty;
+		}
+		//Operations
+		inline float determinant() const {
+			return e00 * e11 - e01 * e10;
+		}
+		inline Affine2 inverse() const {
+			auto determinant = this->determinant();
+			assert(determinant != 0);
+			determinant = 1.0f / determinant;
+			Affine2 result;
+			result.e00 = e11 * determinant;
+			result.e01 = -e01 * determinant;
+			result.e10 = -e10 * determinant;
+			result.e11 = e00 * determinant;
+			//The inverse moves the translated origin back to zero
+			result.e02 = -(result.e00 * e02 + result.e01 * e12);
+			result.e12 = -(result.e10 * e02 + result.e11 * e12);
+			return result;
+		}
+		inline void invert() {
+			Affine2 inv = this->inverse();
+			*this = inv;
+		}
+		//Test
+		inline bool isIdentity(bool almost = false) const {
+			for (size_t i = 0; i < 6; i++) {
+				const float expected = (i == 0 || i == 3) ? 1.0f : 0.0f;
+				if (almost ? !aeq(elements[i], expected) : elements[i] != expected)
+					return false;
+			}
+			return true;
+		}
+		inline bool isInvertible(bool almost = false) const {
+			return almost ? !aeq(determinant(), 0) : determinant() != 0;
+		}
+		//Transformations
+		inline void transformVector(Vec2* v) const {
+			const auto vc = *v;
+			v->x = e00 * vc.x + e01 * vc.y;
+			v->y = e10 * vc.x + e11 * vc.y;
+		}
+		inline Vec2 transformedVector(const Vec2& v) const {
+			Vec2 vc;
+			vc.x = e00 * v.x + e01 * v.y;
+			vc.y = e10 * v.x + e11 * v.y;
+			return vc;
+		}
+		inline void transformPoint(Vec2* v) const {
+			const auto vc = *v;
+			v->x = e00 * vc.x + e01 * vc.y + e02;
+			v->y = e10 * vc.x + e11 * vc.y + e12;
+		}
+		inline Vec2 transformedPoint(const Vec2& v) const {
+			Vec2 vc;
+			vc.x = e00 * v.x + e01 * v.y + e02;
+			vc.y = e10 * v.x + e11 * v.y + e12;
+			return vc;
+		}
+		//Same kernels as Matrix3x3, which only read the top two rows
+		inline void transformPoints(const Vec2* in, Vec2* out, size_t count) const {
+			toMatrix3x3().transformPoints(in, out, count);
+		}
+		inline void transformPoints(const float* in, size_t inStride, float* out, size_t outStride, size_t count) const {
+			toMatrix3x3().transformPoints(in, inStride, out, outStride, count);
+		}
+		inline Polygon transformedPolygon(const Polygon& p) const {
+			return toMatrix3x3().transformedPolygon(p);
+		}
+		inline Rect transformedRect(const Rect& r) const {
+			Vec2 pts[4] = { r.topLeft(), r.topRight(), r.bottomLeft(), r.bottomRight() };
+			for (size_t i = 0; i < 4; i++)
+				transformPoint(&pts[i]);
+			return Rect(pts, 4);
+		}
+		//Description
+		inline std::string toString() const {
+			std::string d = "{";
+
+			d += "{";
+			d += std::to_string(e00); d += ", "; d += std::to_string(e01); d += ", "; d += std::to_string(e02); d += ", ";
+			d += "}";
+
+			d += "{";
+			d += std::to_string(e10); d += ", "; d += std::to_string(e11); d += ", "; d += std::to_string(e12); d += ", ";
+			d += "}";
+
+			d += "}";
+			return d;
+		}
+		//Operations
+		inline void operator*=(const Affine2& m2) {
+			Affine2 m1 = *this;
+
+			e00 = m1.e00 * m2.e00 + m1.e01 * m2.e10;
+			e01 = m1.e00 * m2.e01 + m1.e01 * m2.e11;
+			e02 = m1.e00 * m2.e02 + m1.e01 * m2.e12 + m1.e02;
+
+			e10 = m1.e10 * m2.e00 + m1.e11 * m2.e10;
+			e11 = m1.e10 * m2.e01 + m1.e11 * m2.e11;
+			e12 = m1.e10 * m2.e02 + m1.e11 * m2.e12 + m1.e12;
+		}
+	};
+	static_assert(sizeof(Affine2) == 6 * sizeof(float), "Affine2 should hold only its six elements.");
+
+	inline Affine2 operator *(const Affine2& m1, const Affine2& m2) {
+		auto result = Affine2();
+
+		result.e00 = m1.e00 * m2.e00 + m1.e01 * m2.e10;
+		result.e01 = m1.e00 * m2.e01 + m1.e01 * m2.e11;
+		result.e02 = m1.e00 * m2.e02 + m1.e01 * m2.e12 + m1.e02;
+
+		result.e10 = m1.e10 * m2.e00 + m1.e11 * m2.e10;
+		result.e11 = m1.e10 * m2.e01 + m1.e11 * m2.e11;
+		result.e12 = m1.e10 * m2.e02 + m1.e11 * m2.e12 + m1.e12;
+
+		return result;
+	}
+	inline bool operator ==(const Affine2& m1, const Affine2& m2) {
+		for (size_t i = 0; i < 6; i++) {
+			if (m1.elements[i] != m2.elements[i])
+				return false;
+		}
+		return true;
+	}
+	inline bool operator !=(const Affine2& m1, const Affine2& m2) {
+		return !(m1 == m2);
+	}
+	inline bool aeq(const Affine2& m1, const Affine2& m2) {
+		for (size_t i = 0; i < 6; i++) {
+			if (!aeq(m1.elements[i], m2.elements[i]))
+				return false;
+		}
+		return true;
+	}
+}
+namespace std {
+	template<>
+	class hash < sb::Affine2 > {
+	public:
+		size_t operator()(const sb::Affine2& m) const {
+			return sb::bitwiseHash((const unsigned char*)&m, sizeof(sb::Affine2));
+		}
+	};
+}
@@ -229,7 +229,7 @@ BaseMesh& BaseMesh::operator=(const BaseMesh& other) {
 		m_indexBufferCount = 0;
 	}
 	else if (m_indexBufferCapacity >= other.m_indexBufferCapacity) {
-		memcpy(m_indexBuffer, other.m_indexBuffer, sizeof(uint32) * other.m_indexBufferCapacity);
+		memcpy(m_indexBuffer, other.m_indexBuffer, sizeof(uint32_t) * other.m_indexBufferCapacity);
 		m_indexBufferCount = other.m_indexBufferCount;
 	}
 	else {
@@ -237,7 +237,7 @@ BaseMesh& BaseMesh::operator=(const BaseMesh& other) {
 			delete[] m_indexBuffer;
 
 		m_indexBuffer = new uint32_t[other.m_indexBufferCapacity];
-		memcpy(m_indexBuffer, other.m_indexBuffer, sizeof(uint32) * other.m_indexBufferCapacity);
+		memcpy(m_indexBuffer, other.m_indexBuffer, sizeof(uint32_t) * other.m_indexBufferCapacity);
 		m_indexBufferCapacity = other.m_indexBufferCapacity;
 		m_indexBufferCount = other.m_indexBufferCount;
 	}
@@ -0,0 +1,351 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#include "pch.h"
+#include "DynamicAABBTree.h"
+
+using namespace sb;
+
+sb::DynamicAABBTree::DynamicAABBTree() {
+	m_root = SbNullProxy;
+	m_freeList = SbNullProxy;
+	m_proxyCount = 0;
+}
+
+sb::DynamicAABBTree::~DynamicAABBTree() {
+}
+
+uint32_t sb::DynamicAABBTree::allocateNode() {
+	if (m_freeList == SbNullProxy) {
+		m_nodes.push_back(Node());
+		m_freeList = (uint32_t)(m_nodes.size() - 1);
+		m_nodes[m_freeList].next = SbNullProxy;
+	}
+	auto id = m_freeList;
+	auto& node = m_nodes[id];
+	m_freeList = node.next;
+	node.parent = SbNullProxy;
+	node.child1 = SbNullProxy;
+	node.child2 = SbNullProxy;
+	node.height = 0;
+	node.userData = nullptr;
+	return id;
+}
+
+void sb::DynamicAABBTree::freeNode(uint32_t node) {
+	assert(node < m_nodes.size());
+	m_nodes[node].next = m_freeList;
+	m_nodes[node].height = -1;
+	m_freeList = node;
+}
+
+uint32_t sb::DynamicAABBTree::createProxy(const AABB& aabb, void* userData) {
+	auto proxy = allocateNode();
+	m_nodes[proxy].bounds = aabb.fattened(SbAABBTreeMargin);
+	m_nodes[proxy].userData = userData;
+	insertLeaf(proxy);
+	m_proxyCount++;
+	return proxy;
+}
+
+void sb::DynamicAABBTree::destroyProxy(uint32_t proxy) {
+	assert(proxy < m_nodes.size());
+	assert(m_nodes[proxy].isLeaf());
+	removeLeaf(proxy);
+	freeNode(proxy);
+	m_proxyCount--;
+}
+
+bool sb::DynamicAABBTree::moveProxy(uint32_t proxy, const AABB& aabb, const Vec2& displacement) {
+	assert(proxy < m_nodes.size());
+	assert(m_nodes[proxy].isLeaf());
+	if (m_nodes[proxy].bounds.containsAABB(aabb))
+		return false;
+
+	removeLeaf(proxy);
+
+	//we stretch the fat box towards where the shape is going
+	auto b = aabb.fattened(SbAABBTreeMargin);
+	const auto d = displacement * SbAABBTreeDisplacementMultiplier;
+	if (d.x < 0)
+		b.minx += d.x;
+	else
+		b.maxx += d.x;
+	if (d.y < 0)
+		b.miny += d.y;
+	else
+		b.maxy += d.y;
+	m_nodes[proxy].bounds = b;
+
+	insertLeaf(proxy);
+	return true;
+}
+
+void sb::DynamicAABBTree::insertLeaf(uint32_t leaf) {
+	if (m_root == SbNullProxy) {
+		m_root = leaf;
+		m_nodes[leaf].parent = SbNullProxy;
+		return;
+	}
+
+	//we look for the best sibling: the one whose union with the leaf costs the least (surface area heuristic)
+	const auto leafBounds = m_nodes[leaf].bounds;
+	auto index = m_root;
+	while (!m_nodes[index].isLeaf()) {
+		const auto& node = m_nodes[index];
+		const auto area = node.bounds.perimeter();
+		const auto combinedArea = getUnion(node.bounds, leafBounds).perimeter();
+		//cost of creating a new parent for this node and the leaf
+		const auto cost = 2.0f * combinedArea;
+		//minimum cost of pushing the leaf further down the tree
+		const auto inheritanceCost = 2.0f * (combinedArea - area);
+
+		float cost1, cost2;
+		const auto& c1 = m_nodes[node.child1];
+		const auto& c2 = m_nodes[node.child2];
+		if (c1.isLeaf())
+			cost1 = getUnion(leafBounds, c1.bounds).perimeter() + inheritanceCost;
+		else
+			cost1 = (getUnion(leafBounds, c1.bounds).perimeter() - c1.bounds.perimeter()) + inheritanceCost;
+		if (c2.isLeaf())
+			cost2 = getUnion(leafBounds, c2.bounds).perimeter() + inheritanceCost;
+		else
+			cost2 = (getUnion(leafBounds, c2.bounds).perimeter() - c2.bounds.perimeter()) + inheritanceCost;
+
+		if (cost < cost1 && cost < cost2)
+			break;
+		index = cost1 < cost2 ? node.child1 : node.child2;
+	}
+	const auto sibling = index;
+
+	//we create a new parent
+	const auto oldParent = m_nodes[sibling].parent;
+	const auto newParent = allocateNode();
+	m_nodes[newParent].parent = oldParent;
+	m_nodes[newParent].userData = nullptr;
+	m_nodes[newParent].bounds = getUnion(leafBounds, m_nodes[sibling].bounds);
+	m_nodes[newParent].height = m_nodes[sibling].height + 1;
+	m_nodes[newParent].child1 = sibling;
+	m_nodes[newParent].child2 = leaf;
+	m_nodes[sibling].parent = newParent;
+	m_nodes[leaf].parent = newParent;
+
+	if (oldParent != SbNullProxy) {
+		if (m_nodes[oldParent].child1 == sibling)
+			m_nodes[oldParent].child1 = newParent;
+		else
+			m_nodes[oldParent].child2 = newParent;
+	}
+	else
+		m_root = newParent;
+
+	//we walk back up fixing heights and bounds
+	index = m_nodes[leaf].parent;
+	while (index != SbNullProxy) {
+		index = balance(index);
+		const auto child1 = m_nodes[index].child1;
+		const auto child2 = m_nodes[index].child2;
+		assert(child1 != SbNullProxy);
+		assert(child2 != SbNullProxy);
+		m_nodes[index].height = 1 + std::max(m_nodes[child1].height, m_nodes[child2].height);
+		m_nodes[index].bounds = getUnion(m_nodes[child1].bounds, m_nodes[child2].bounds);
+		index = m_nodes[index].parent;
+	}
+}
+
+void sb::DynamicAABBTree::removeLeaf(uint32_t leaf) {
+	if (leaf == m_root) {
+		m_root = SbNullProxy;
+		return;
+	}
+
+	const auto parent = m_nodes[leaf].parent;
+	const auto grandParent = m_nodes[parent].parent;
+	const auto sibling = m_nodes[parent].child1 == leaf ? m_nodes[parent].child2 : m_nodes[parent].child1;
+
+	if (grandParent != SbNullProxy) {
+		//we destroy the parent and connect the sibling to the grand parent
+		if (m_nodes[grandParent].child1 == parent)
+			m_nodes[grandParent].child1 = sibling;
+		else
+			m_nodes[grandParent].child2 = sibling;
+		m_nodes[sibling].parent = grandParent;
+		freeNode(parent);
+
+		auto index = grandParent;
+		while (index != SbNullProxy) {
+			index = balance(index);
+			const auto child1 = m_nodes[index].child1;
+			const auto child2 = m_nodes[index].child2;
+			m_nodes[index].bounds = getUnion(m_nodes[child1].bounds, m_nodes[child2].bounds);
+			m_nodes[index].height = 1 + std::max(m_nodes[child1].height, m_nodes[child2].height);
+			index = m_nodes[index].parent;
+		}
+	}
+	else {
+		m_root = sibling;
+		m_nodes[sibling].parent = SbNullProxy;
+		freeNode(parent);
+	}
+}
+
+//Performs a left or right rotation if node A is imbalanced. Returns the new root of the subtree.
+uint32_t sb::DynamicAABBTree::balance(uint32_t iA) {
+	assert(iA != SbNullProxy);
+	auto& A = m_nodes[iA];
+	if (A.isLeaf() || A.height < 2)
+		return iA;
+
+	const auto iB = A.child1;
+	const auto iC = A.child2;
+	auto& B = m_nodes[iB];
+	auto& C = m_nodes[iC];
+	const auto balance = C.height - B.height;
+
+	//rotate C up
+	if (balance > 1) {
+		const auto iF = C.child1;
+		const auto iG = C.child2;
+		auto& F = m_nodes[iF];
+		auto& G = m_nodes[iG];
+
+		//swap A and C
+		C.child1 = iA;
+		C.parent = A.parent;
+		A.parent = iC;
+
+		//A's old parent should point to C
+		if (C.parent != SbNullProxy) {
+			if (m_nodes[C.parent].child1 == iA)
+				m_nodes[C.parent].child1 = iC;
+			else
+				m_nodes[C.parent].child2 = iC;
+		}
+		else
+			m_root = iC;
+
+		//rotate
+		if (F.height > G.height) {
+			C.child2 = iF;
+			A.child2 = iG;
+			G.parent = iA;
+			A.bounds = getUnion(B.bounds, G.bounds);
+			C.bounds = getUnion(A.bounds, F.bounds);
+			A.height = 1 + std::max(B.height, G.height);
+			C.height = 1 + std::max(A.height, F.height);
+		}
+		else {
+			C.child2 = iG;
+			A.child2 = iF;
+			F.parent = iA;
+			A.bounds = getUnion(B.bounds, F.bounds);
+			C.bounds = getUnion(A.bounds, G.bounds);
+			A.height = 1 + std::max(B.height, F.height);
+			C.height = 1 + std::max(A.height, G.height);
+		}
+		return iC;
+	}
+
+	//rotate B up
+	if (balance < -1) {
+		const auto iD = B.child1;
+		const auto iE = B.child2;
+		auto& D = m_nodes[iD];
+		auto& E = m_nodes[iE];
+
+		//swap A and B
+		B.child1 = iA;
+		B.parent = A.parent;
+		A.parent = iB;
+
+		//A's old parent should point to B
+		if (B.parent != SbNullProxy) {
+			if (m_nodes[B.parent].child1 == iA)
+				m_nodes[B.parent].child1 = iB;
+			else
+				m_nodes[B.parent].child2 = iB;
+		}
+		else
+			m_root = iB;
+
+		//rotate
+		if (D.height > E.height) {
+			B.child2 = iD;
+			A.child1 = iE;
+			E.parent = iA;
+			A.bounds = getUnion(C.bounds, E.bounds);
+			B.bounds = getUnion(A.bounds, D.bounds);
+			A.height = 1 + std::max(C.height, E.height);
+			B.height = 1 + std::max(A.height, D.height);
+		}
+		else {
+			B.child2 = iE;
+			A.child1 = iD;
+			D.parent = iA;
+			A.bounds = getUnion(C.bounds, D.bounds);
+			B.bounds = getUnion(A.bounds, E.bounds);
+			A.height = 1 + std::max(C.height, D.height);
+			B.height = 1 + std::max(A.height, E.height);
+		}
+		return iB;
+	}
+
+	return iA;
+}
+
+int32_t sb::DynamicAABBTree::height() const {
+	if (m_root == SbNullProxy)
+		return 0;
+	return m_nodes[m_root].height;
+}
+
+AABB sb::DynamicAABBTree::bounds() const {
+	if (m_root == SbNullProxy)
+		return AABB();
+	return m_nodes[m_root].bounds;
+}
+
+int32_t sb::DynamicAABBTree::computeHeight(uint32_t node) const {
+	const auto& n = m_nodes[node];
+	if (n.isLeaf())
+		return 0;
+	return 1 + std::max(computeHeight(n.child1), computeHeight(n.child2));
+}
+
+void sb::DynamicAABBTree::validateStructure(uint32_t node) const {
+	if (node == SbNullProxy)
+		return;
+	const auto& n = m_nodes[node];
+	if (node == m_root)
+		assert(n.parent == SbNullProxy);
+	if (n.isLeaf()) {
+		assert(n.child2 == SbNullProxy);
+		assert(n.height == 0);
+		return;
+	}
+	assert(m_nodes[n.child1].parent == node);
+	assert(m_nodes[n.child2].parent == node);
+	assert(n.height == 1 + std::max(m_nodes[n.child1].height, m_nodes[n.child2].height));
+	assert(n.bounds.containsAABB(m_nodes[n.child1].bounds));
+	assert(n.bounds.containsAABB(m_nodes[n.child2].bounds));
+	validateStructure(n.child1);
+	validateStructure(n.child2);
+}
+
+void sb::DynamicAABBTree::validate() const {
+	validateStructure(m_root);
+	if (m_root != SbNullProxy)
+		assert(computeHeight(m_root) == height());
+	size_t freeCount = 0;
+	auto freeIndex = m_freeList;
+	while (freeIndex != SbNullProxy) {
+		assert(freeIndex < m_nodes.size());
+		freeIndex = m_nodes[freeIndex].next;
+		freeCount++;
+	}
+	//n leaves need n - 1 internal nodes
+	assert(m_proxyCount == 0 || m_nodes.size() - freeCount == 2 * m_proxyCount - 1);
+}
@@ -0,0 +1,219 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#pragma once
+
+#include "AABB.h"
+#include "SmallVector.h"
+#include "SpatialStats.h"
+
+//Margin added around every leaf, so small moves don't touch the tree
+#define SbAABBTreeMargin 0.5f
+//How much of the last displacement is used to predict where a leaf is going
+#define SbAABBTreeDisplacementMultiplier 2.0f
+#define SbNullProxy ((uint32_t)-1)
+
+namespace sb {
+	//Incremental bounding volume tree. Every leaf keeps a fattened box around its shape; leaves are
+	//inserted next to the sibling that grows the tree the least and the tree is kept balanced with
+	//rotations, so queries stay at O(log n) while moving leaves are cheap.
+	class DynamicAABBTree {
+	public:
+		//Constructors
+		DynamicAABBTree();
+		//Destructor
+		~DynamicAABBTree();
+		//Proxies
+		uint32_t createProxy(const AABB& aabb, void* userData);
+		void destroyProxy(uint32_t proxy);
+		//Returns false (and does nothing) when the fat box of the proxy still contains aabb.
+		bool moveProxy(uint32_t proxy, const AABB& aabb, const Vec2& displacement);
+		inline void* userData(uint32_t proxy) const {
+			assert(proxy < m_nodes.size());
+			return m_nodes[proxy].userData;
+		}
+		inline const AABB& fatBounds(uint32_t proxy) const {
+			assert(proxy < m_nodes.size());
+			return m_nodes[proxy].bounds;
+		}
+		//Info
+		inline size_t proxyCount() const {
+			return m_proxyCount;
+		}
+		inline bool isEmpty() const {
+			return m_root == SbNullProxy;
+		}
+		int32_t height() const;
+		AABB bounds() const;
+		void validate() const;
+		//Queries
+		//callback(proxy) is called for each leaf whose fat box overlaps aabb. Return false to stop.
+		template<class F>
+		void query(const AABB& aabb, F& callback) const {
+			if (m_root == SbNullProxy)
+				return;
+			SmallVector<uint32_t, 64> stack;
+			stack.push_back(m_root);
+			while (!stack.empty()) {
+				const auto id = stack.back();
+				stack.pop_back();
+				SbCountStat(nodesVisited, 1);
+				const auto& node = m_nodes[id];
+				if (!node.bounds.overlaps(aabb))
+					continue;
+				if (node.isLeaf()) {
+					if (!callback(id))
+						return;
+				}
+				else {
+					stack.push_back(node.child1);
+					stack.push_back(node.child2);
+				}
+			}
+		}
+		//callback(proxy) is called for each leaf whose fat box contains pt. Return false to stop.
+		template<class F>
+		void query(const Vec2& pt, F& callback) const {
+			if (m_root == SbNullProxy)
+				return;
+			SmallVector<uint32_t, 64> stack;
+			stack.push_back(m_root);
+			while (!stack.empty()) {
+				const auto id = stack.back();
+				stack.pop_back();
+				SbCountStat(nodesVisited, 1);
+				const auto& node = m_nodes[id];
+				if (!node.bounds.containsPoint(pt))
+					continue;
+				if (node.isLeaf()) {
+					if (!callback(id))
+						return;
+				}
+				else {
+					stack.push_back(node.child1);
+					stack.push_back(node.child2);
+				}
+			}
+		}
+		//Walks the leaves hit by the ray before maxT, nearest subtree first. callback(proxy, maxT) returns
+		//the new maxT: the distance to the hit it found, or maxT itself to keep going. Returning 0 stops.
+		//direction must be normalized.
+		template<class F>
+		void rayCast(const Vec2& origin, const Vec2& direction, float maxT, F& callback) const {
+			if (m_root == SbNullProxy)
+				return;
+			SmallVector<uint32_t, 64> stack;
+			float t;
+			if (!raySlab(m_nodes[m_root].bounds, origin, direction, maxT, &t))
+				return;
+			stack.push_back(m_root);
+			while (!stack.empty()) {
+				const auto id = stack.back();
+				stack.pop_back();
+				SbCountStat(nodesVisited, 1);
+				const auto& node = m_nodes[id];
+				if (!raySlab(node.bounds, origin, direction, maxT, &t))
+					continue;
+				if (node.isLeaf()) {
+					maxT = callback(id, maxT);
+					if (maxT <= 0)
+						return;
+					continue;
+				}
+				float t1, t2;
+				const auto hit1 = raySlab(m_nodes[node.child1].bounds, origin, direction, maxT, &t1);
+				const auto hit2 = raySlab(m_nodes[node.child2].bounds, origin, direction, maxT, &t2);
+				//the nearest child goes last, so it's popped first
+				if (hit1 && hit2) {
+					if (t1 <= t2) {
+						stack.push_back(node.child2);
+						stack.push_back(node.child1);
+					}
+					else {
+						stack.push_back(node.child1);
+						stack.push_back(node.child2);
+					}
+				}
+				else if (hit1)
+					stack.push_back(node.child1);
+				else if (hit2)
+					stack.push_back(node.child2);
+			}
+		}
+		//Walks the leaves nearest first, skipping the ones whose fat box is farther than maxDistance from pt.
+		//callback(proxy, maxDistance) returns the new maxDistance. A negative one stops.
+		template<class F>
+		void nearest(const Vec2& pt, float maxDistance, F& callback) const {
+			if (m_root == SbNullProxy)
+				return;
+			struct Entry {
+				float distance;
+				uint32_t node;
+			};
+			auto farther = [](const Entry& a, const Entry& b) {
+				return a.distance > b.distance;
+			};
+			SmallVector<Entry, 64> heap;
+			heap.push_back({ pointDistance(m_nodes[m_root].bounds, pt), m_root });
+			while (!heap.empty()) {
+				std::pop_heap(heap.begin(), heap.end(), farther);
+				const auto entry = heap.back();
+				heap.pop_back();
+				SbCountStat(nodesVisited, 1);
+				//everything left in the heap is farther still
+				if (entry.distance > maxDistance)
+					return;
+				const auto& node = m_nodes[entry.node];
+				if (node.isLeaf()) {
+					maxDistance = callback(entry.node, maxDistance);
+					if (maxDistance < 0)
+						return;
+					continue;
+				}
+				const uint32_t children[2] = { node.child1, node.child2 };
+				for (auto child : children) {
+					const auto d = pointDistance(m_nodes[child].bounds, pt);
+					if (d <= maxDistance) {
+						heap.push_back({ d, child });
+						std::push_heap(heap.begin(), heap.end(), farther);
+					}
+				}
+			}
+		}
+	private:
+		struct Node {
+			AABB bounds;
+			void* userData;
+			union {
+				uint32_t parent;
+				uint32_t next;
+			};
+			uint32_t child1;
+			uint32_t child2;
+			//leaf = 0, free node = -1
+			int32_t height;
+			inline bool isLeaf() const {
+				return child1 == SbNullProxy;
+			}
+		};
+		//Copying
+		DynamicAABBTree(const DynamicAABBTree&);
+		DynamicAABBTree& operator=(const DynamicAABBTree&);
+		//Methods
+		uint32_t allocateNode();
+		void freeNode(uint32_t node);
+		void insertLeaf(uint32_t leaf);
+		void removeLeaf(uint32_t leaf);
+		uint32_t balance(uint32_t node);
+		int32_t computeHeight(uint32_t node) const;
+		void validateStructure(uint32_t node) const;
+		//Fields
+		std::vector<Node> m_nodes;
+		uint32_t m_root;
+		uint32_t m_freeList;
+		size_t m_proxyCount;
+	};
+}
@@ -8,6 +8,7 @@ You can't use, distribute or modify this code without my permission.
 #include "DXContext.h"
 #include "LayoutBuilder.h"
 #include "StaticBatch.h"
+#include "Matrix3x3.h"
 
 using namespace sb;
 
@@ -184,7 +185,7 @@ void sb::DynamicBatcher::_beginMeshes(PrimitiveTopology topology) {
 	m_drawCalls.push_back(dc);
 }
 
-void sb::DynamicBatcher::_batchMesh(const BaseMesh * mesh) {
+void sb::DynamicBatcher::_batchMesh(const BaseMesh * mesh, const Matrix3x3* transform) {
 	assert(m_started);
 	assert(m_drawCalls.size() != 0 && !m_drawCalls.back().ended && !m_drawCalls.back().isInstanced);
 	assert(mesh);
@@ -219,7 +220,13 @@ void sb::DynamicBatcher::_batchMesh(const BaseMesh * mesh) {
 
 	//Update VB
 	ensureBufferSize(&m_modelBuffer, &m_modelBufferSize, m_modelBufferOffset + mesh->VBCount() * m_modelVertexByteStride, m_modelVertexByteStride);
-	memcpy(reinterpret_cast<char*>(m_modelBuffer) + m_modelBufferOffset, mesh->rawVB(), mesh->VBCount() * m_modelVertexByteStride);
+	auto vbStart = reinterpret_cast<char*>(m_modelBuffer) + m_modelBufferOffset;
+	memcpy(vbStart, mesh->rawVB(), mesh->VBCount() * m_modelVertexByteStride);
+	if (transform) {
+		assert(m_modelVertexByteStride >= 2 * sizeof(float));
+		auto positions = reinterpret_cast<float*>(vbStart);
+		transform->transformPoints(positions, m_modelVertexByteStride, positions, m_modelVertexByteStride, mesh->VBCount());
+	}
 	m_modelBufferOffset += mesh->VBCount() * m_modelVertexByteStride;
 }
 
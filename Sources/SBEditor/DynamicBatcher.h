@@ -14,6 +14,7 @@ namespace sb {
 	class LayoutBuilder;
 	class VertexItemDescription;
 	class StaticBatch;
+	struct Matrix3x3;
 
 	enum class DrawFrequency {
 		Dynamic,
@@ -53,6 +54,10 @@ namespace sb {
 		inline void batchMesh(const BaseMesh* mesh) {
 			_batchMesh(mesh);
 		}
+		//Batches the mesh moved by transform. Its vertices must start with their x and y position, like BasicVertex.
+		inline void batchMesh(const BaseMesh* mesh, const Matrix3x3& transform) {
+			_batchMesh(mesh, &transform);
+		}
 		inline void batchMeshes(const BaseMesh* const* meshes, size_t count) {
 			_batchMeshes(meshes, count);
 		}
@@ -115,7 +120,7 @@ namespace sb {
 					size_t instanceVertexByteStride);
 		void _end();
 		void _beginMeshes(PrimitiveTopology topology);
-		void _batchMesh(const BaseMesh* mesh);
+		void _batchMesh(const BaseMesh* mesh, const Matrix3x3* transform = nullptr);
 		void _batchMeshes(const BaseMesh* const* meshes, size_t count);
 		void _batchMeshes(const std::vector<const BaseMesh*>& meshes);
 		void _endMeshes();
@@ -0,0 +1,257 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#include "pch.h"
+#include "HashGrid.h"
+
+using namespace sb;
+
+#define SbHashGridInitialSlots 64
+//Grow when more than 7/10 of the slots are taken
+#define SbHashGridMaxLoadNum 7
+#define SbHashGridMaxLoadDen 10
+
+sb::HashGrid::HashGrid() {
+	m_cellCount = 0;
+	m_entryCount = 0;
+	m_boundsDirty = false;
+	for (size_t i = 0; i < 4; i++)
+		m_boundCounters[i] = 0;
+}
+
+void sb::HashGrid::clear() {
+	m_slots.clear();
+	m_cells.clear();
+	m_freeCells.clear();
+	m_cellCount = 0;
+	m_entryCount = 0;
+	m_boundsDirty = false;
+	for (size_t i = 0; i < 4; i++)
+		m_boundCounters[i] = 0;
+}
+
+void sb::HashGrid::grow() {
+	auto oldSlots = std::move(m_slots);
+	m_slots.clear();
+	m_slots.resize(oldSlots.size() == 0 ? SbHashGridInitialSlots : oldSlots.size() * 2);
+	for (auto& s : m_slots)
+		s.cell = SbNullCell;
+
+	const auto mask = m_slots.size() - 1;
+	for (auto& s : oldSlots) {
+		if (s.cell == SbNullCell)
+			continue;
+		auto i = hashKey(s.key) & mask;
+		while (m_slots[i].cell != SbNullCell)
+			i = (i + 1) & mask;
+		m_slots[i] = s;
+	}
+}
+
+uint32_t sb::HashGrid::findOrCreateCell(int32_t x, int32_t y) {
+	const auto key = packKey(x, y);
+	if ((m_cellCount + 1) * SbHashGridMaxLoadDen > m_slots.size() * SbHashGridMaxLoadNum)
+		grow();
+
+	const auto mask = m_slots.size() - 1;
+	auto i = hashKey(key) & mask;
+	while (m_slots[i].cell != SbNullCell) {
+		if (m_slots[i].key == key)
+			return m_slots[i].cell;
+		i = (i + 1) & mask;
+	}
+
+	uint32_t cell;
+	if (m_freeCells.size() != 0) {
+		cell = m_freeCells.back();
+		m_freeCells.pop_back();
+	}
+	else {
+		m_cells.push_back(Cell());
+		cell = (uint32_t)(m_cells.size() - 1);
+	}
+	m_cells[cell].mask = 0;
+	m_slots[i].key = key;
+	m_slots[i].cell = cell;
+	m_cellCount++;
+	return cell;
+}
+
+//Backward shift deletion: we pull the following entries of the probe sequence into the hole,
+//so the table never needs tombstones.
+void sb::HashGrid::eraseSlot(size_t slot) {
+	const auto mask = m_slots.size() - 1;
+	auto hole = slot;
+	auto i = slot;
+	while (true) {
+		i = (i + 1) & mask;
+		if (m_slots[i].cell == SbNullCell)
+			break;
+		const auto home = hashKey(m_slots[i].key) & mask;
+		//can the entry at i be moved into the hole? only if its home isn't cyclically in (hole, i]
+		const auto inRange = hole <= i ? (home > hole && home <= i) : (home > hole || home <= i);
+		if (!inRange) {
+			m_slots[hole] = m_slots[i];
+			hole = i;
+		}
+	}
+	m_slots[hole].cell = SbNullCell;
+	m_cellCount--;
+}
+
+void sb::HashGrid::insert(const CellRange& range, uint32_t item, size_t mask) {
+	for (int32_t i = range.minx; i <= range.maxx; i++) {
+		for (int32_t j = range.miny; j <= range.maxy; j++) {
+			const auto cell = findOrCreateCell(i, j);
+			m_cells[cell].items.push_back(item);
+			m_cells[cell].mask |= mask;
+		}
+	}
+	includeInBounds(range);
+	m_entryCount += range.cellCount();
+}
+
+void sb::HashGrid::remove(const CellRange& range, uint32_t item) {
+	for (int32_t i = range.minx; i <= range.maxx; i++) {
+		for (int32_t j = range.miny; j <= range.maxy; j++) {
+			const auto slot = findSlot(packKey(i, j));
+			assert(slot != SbNullCell);
+			const auto cell = m_slots[slot].cell;
+			auto& items = m_cells[cell].items;
+			auto found = items.swapEraseItem(item);
+			assert(found);
+			(void)found;
+			if (items.empty()) {
+				eraseSlot(slot);
+				m_freeCells.push_back(cell);
+			}
+		}
+	}
+	assert(m_entryCount >= range.cellCount());
+	m_entryCount -= range.cellCount();
+	excludeFromBounds(range);
+}
+
+void sb::HashGrid::addMask(const CellRange& range, size_t mask) {
+	for (int32_t i = range.minx; i <= range.maxx; i++) {
+		for (int32_t j = range.miny; j <= range.maxy; j++) {
+			const auto slot = findSlot(packKey(i, j));
+			assert(slot != SbNullCell);
+			m_cells[m_slots[slot].cell].mask |= mask;
+		}
+	}
+}
+
+void sb::HashGrid::includeInBounds(const CellRange& range) {
+	if (m_boundsDirty)
+		return;
+	const auto w = (size_t)((int64_t)range.maxx - range.minx + 1);
+	const auto h = (size_t)((int64_t)range.maxy - range.miny + 1);
+	if (m_entryCount == 0) {
+		m_bounds = range;
+		m_boundCounters[0] = m_boundCounters[2] = h;
+		m_boundCounters[1] = m_boundCounters[3] = w;
+		return;
+	}
+	if (range.minx < m_bounds.minx) {
+		m_bounds.minx = range.minx;
+		m_boundCounters[0] = h;
+	}
+	else if (range.minx == m_bounds.minx)
+		m_boundCounters[0] += h;
+	if (range.miny < m_bounds.miny) {
+		m_bounds.miny = range.miny;
+		m_boundCounters[1] = w;
+	}
+	else if (range.miny == m_bounds.miny)
+		m_boundCounters[1] += w;
+	if (range.maxx > m_bounds.maxx) {
+		m_bounds.maxx = range.maxx;
+		m_boundCounters[2] = h;
+	}
+	else if (range.maxx == m_bounds.maxx)
+		m_boundCounters[2] += h;
+	if (range.maxy > m_bounds.maxy) {
+		m_bounds.maxy = range.maxy;
+		m_boundCounters[3] = w;
+	}
+	else if (range.maxy == m_bounds.maxy)
+		m_boundCounters[3] += w;
+}
+
+void sb::HashGrid::excludeFromBounds(const CellRange& range) {
+	if (m_entryCount == 0) {
+		for (size_t i = 0; i < 4; i++)
+			m_boundCounters[i] = 0;
+		m_boundsDirty = false;
+		return;
+	}
+	if (m_boundsDirty)
+		return;
+	const auto w = (size_t)((int64_t)range.maxx - range.minx + 1);
+	const auto h = (size_t)((int64_t)range.maxy - range.miny + 1);
+	//when a side loses its last entry we don't know where the new side is, so we look it up lazily
+	if (range.minx == m_bounds.minx && (m_boundCounters[0] -= h) == 0)
+		m_boundsDirty = true;
+	if (range.miny == m_bounds.miny && (m_boundCounters[1] -= w) == 0)
+		m_boundsDirty = true;
+	if (range.maxx == m_bounds.maxx && (m_boundCounters[2] -= h) == 0)
+		m_boundsDirty = true;
+	if (range.maxy == m_bounds.maxy && (m_boundCounters[3] -= w) == 0)
+		m_boundsDirty = true;
+}
+
+void sb::HashGrid::recomputeBounds() const {
+	bool first = true;
+	for (size_t i = 0; i < 4; i++)
+		m_boundCounters[i] = 0;
+	for (auto& s : m_slots) {
+		if (s.cell == SbNullCell)
+			continue;
+		const auto x = keyX(s.key);
+		const auto y = keyY(s.key);
+		const auto n = m_cells[s.cell].items.size();
+		if (first) {
+			m_bounds = CellRange(x, y, x, y);
+			first = false;
+		}
+		if (x < m_bounds.minx) {
+			m_bounds.minx = x;
+			m_boundCounters[0] = 0;
+		}
+		if (y < m_bounds.miny) {
+			m_bounds.miny = y;
+			m_boundCounters[1] = 0;
+		}
+		if (x > m_bounds.maxx) {
+			m_bounds.maxx = x;
+			m_boundCounters[2] = 0;
+		}
+		if (y > m_bounds.maxy) {
+			m_bounds.maxy = y;
+			m_boundCounters[3] = 0;
+		}
+		if (x == m_bounds.minx)
+			m_boundCounters[0] += n;
+		if (y == m_bounds.miny)
+			m_boundCounters[1] += n;
+		if (x == m_bounds.maxx)
+			m_boundCounters[2] += n;
+		if (y == m_bounds.maxy)
+			m_boundCounters[3] += n;
+	}
+	m_boundsDirty = false;
+}
+
+CellRange sb::HashGrid::bounds() const {
+	assert(!isEmpty());
+	if (m_boundsDirty) {
+		std::lock_guard<std::mutex> lock(m_boundsMutex);
+		if (m_boundsDirty)
+			recomputeBounds();
+	}
+	return m_bounds;
+}
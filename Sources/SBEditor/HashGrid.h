@@ -0,0 +1,169 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#pragma once
+
+#include "SmallVector.h"
+#include "SpatialStats.h"
+#include <atomic>
+#include <mutex>
+
+#define SbNullCell ((uint32_t)-1)
+
+namespace sb {
+	//Inclusive range of integer cell coordinates
+	struct CellRange {
+	public:
+		int32_t minx, miny, maxx, maxy;
+		//Constructors
+		inline CellRange() {
+			minx = miny = maxx = maxy = 0;
+		}
+		inline CellRange(int32_t minx, int32_t miny, int32_t maxx, int32_t maxy) {
+			assert(minx <= maxx && miny <= maxy);
+			this->minx = minx;
+			this->miny = miny;
+			this->maxx = maxx;
+			this->maxy = maxy;
+		}
+		//Info
+		inline size_t cellCount() const {
+			return (size_t)((int64_t)maxx - minx + 1) * (size_t)((int64_t)maxy - miny + 1);
+		}
+		//Tests
+		inline bool containsCell(int32_t x, int32_t y) const {
+			return x >= minx && x <= maxx && y >= miny && y <= maxy;
+		}
+		inline bool overlaps(const CellRange& another) const {
+			return minx <= another.maxx && another.minx <= maxx &&
+				miny <= another.maxy && another.miny <= maxy;
+		}
+	};
+	inline bool operator ==(const CellRange& r1, const CellRange& r2) {
+		return r1.minx == r2.minx && r1.miny == r2.miny && r1.maxx == r2.maxx && r1.maxy == r2.maxy;
+	}
+	inline bool operator !=(const CellRange& r1, const CellRange& r2) {
+		return !(r1 == r2);
+	}
+
+	//Sparse uniform grid. Cells are found through an open addressing (linear probing) table keyed by the
+	//packed cell coordinates, and each cell owns a small vector of item indexes and the OR of their masks.
+	//A cell keeps the mask bits of items that left it until it empties out.
+	//Any number of threads may read the grid at once, as long as nobody modifies it meanwhile.
+	class HashGrid {
+	public:
+		//Typedefs
+		typedef SmallVector<uint32_t, 4> ItemList;
+		//Constructors
+		HashGrid();
+		//Modifying
+		void insert(const CellRange& range, uint32_t item, size_t mask = std::numeric_limits<size_t>::max());
+		void remove(const CellRange& range, uint32_t item);
+		//Adds mask to the cells of an item already in range, for when its mask gets more bits
+		void addMask(const CellRange& range, size_t mask);
+		void clear();
+		//Access
+		inline const ItemList* cell(int32_t x, int32_t y) const {
+			SbCountStat(cellsVisited, 1);
+			const auto slot = findSlot(packKey(x, y));
+			return slot == SbNullCell ? nullptr : &m_cells[m_slots[slot].cell].items;
+		}
+		//Same, but cells with no item in mask are left out as well
+		inline const ItemList* cell(int32_t x, int32_t y, size_t mask) const {
+			SbCountStat(cellsVisited, 1);
+			const auto slot = findSlot(packKey(x, y));
+			if (slot == SbNullCell)
+				return nullptr;
+			const auto& c = m_cells[m_slots[slot].cell];
+			return (c.mask & mask) ? &c.items : nullptr;
+		}
+		//Info
+		inline bool isEmpty() const {
+			return m_entryCount == 0;
+		}
+		inline size_t cellCount() const {
+			return m_cellCount;
+		}
+		inline size_t entryCount() const {
+			return m_entryCount;
+		}
+		inline size_t slotCount() const {
+			return m_slots.size();
+		}
+		inline float loadFactor() const {
+			return m_slots.size() == 0 ? 0 : (float)m_cellCount / (float)m_slots.size();
+		}
+		//Range of the occupied cells. The grid must not be empty.
+		CellRange bounds() const;
+		//callback(x, y, items) for every occupied cell, in no particular order
+		template<class F>
+		void forEachCell(F& callback) const {
+			for (const auto& slot : m_slots) {
+				if (slot.cell != SbNullCell)
+					callback(keyX(slot.key), keyY(slot.key), m_cells[slot.cell].items);
+			}
+		}
+	private:
+		struct Slot {
+			uint64_t key;
+			uint32_t cell;
+		};
+		struct Cell {
+			ItemList items;
+			size_t mask;
+		};
+		//Keys
+		static inline uint64_t packKey(int32_t x, int32_t y) {
+			return ((uint64_t)(uint32_t)x << 32) | (uint64_t)(uint32_t)y;
+		}
+		static inline int32_t keyX(uint64_t key) {
+			return (int32_t)(uint32_t)(key >> 32);
+		}
+		static inline int32_t keyY(uint64_t key) {
+			return (int32_t)(uint32_t)key;
+		}
+		static inline size_t hashKey(uint64_t key) {
+			key ^= key >> 33;
+			key *= 0xff51afd7ed558ccdULL;
+			key ^= key >> 33;
+			key *= 0xc4ceb9fe1a85ec53ULL;
+			key ^= key >> 33;
+			return (size_t)key;
+		}
+		//Slots
+		inline uint32_t findSlot(uint64_t key) const {
+			if (m_slots.size() == 0)
+				return SbNullCell;
+			const auto mask = m_slots.size() - 1;
+			auto i = hashKey(key) & mask;
+			while (m_slots[i].cell != SbNullCell) {
+				if (m_slots[i].key == key)
+					return (uint32_t)i;
+				i = (i + 1) & mask;
+			}
+			return SbNullCell;
+		}
+		uint32_t findOrCreateCell(int32_t x, int32_t y);
+		void eraseSlot(size_t slot);
+		void grow();
+		//Bounds
+		void includeInBounds(const CellRange& range);
+		void excludeFromBounds(const CellRange& range);
+		void recomputeBounds() const;
+		//Fields
+		std::vector<Slot> m_slots;
+		std::vector<Cell> m_cells;
+		std::vector<uint32_t> m_freeCells;
+		size_t m_cellCount;
+		size_t m_entryCount;
+		//Number of entries lying on each side of the bounds: left, bottom, right, top
+		mutable CellRange m_bounds;
+		mutable size_t m_boundCounters[4];
+		mutable std::atomic<bool> m_boundsDirty;
+		//Concurrent readers that find the bounds dirty take turns to look them up
+		mutable std::mutex m_boundsMutex;
+	};
+}
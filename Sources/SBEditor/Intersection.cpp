@@ -15,6 +15,8 @@ You can't use, distribute or modify this code without my permission.
 #include "Rect.h"
 #include "Circle.h"
 #include "Polygon.h"
+#include "SmallVector.h"
+#include <atomic>
 
 using namespace sb;
 
@@ -159,14 +161,14 @@ Option<Vec2> Intersection::get(const Ray& a, const Rect& b) {
 			if (!inside.hasValue())
 				inside = test(b, a.m_point);
 
-			if (!inside.value() && !(-a.direction()).isBetween(b.normal(i), b.normal(i - 1)))
+			if (!inside.value() && !(-a.direction()).isBetween(b.normal(i), b.normal(i - 1, true)))
 				continue;
 		}
 		else if (aeq(r.value(), ed.pointB())) {
 			if (!inside.hasValue())
 				inside = test(b, a.m_point);
 
-			if (!inside.value() && !(-a.direction()).isBetween(b.normal(i), b.normal(i + 1)))
+			if (!inside.value() && !(-a.direction()).isBetween(b.normal(i), b.normal(i + 1, true)))
 				continue;
 		}
 		auto u = a.computeT(r.value());
@@ -297,7 +299,7 @@ bool Intersection::test(const Rect& a, const Rect& b) {
 }
 
 bool Intersection::test(const Circle& a, const Circle& b) {
-	float d = distance(a.center(), b.center());
+	float d = sb::distance(a.center(), b.center());
 	float maxlen = a.radius() + b.radius();
 	return d <= maxlen;
 }
@@ -377,14 +379,14 @@ Option<Vec2> sb::Intersection::get(const Ray& a, const Polygon& b) {
 			if (!inside.hasValue())
 				inside = test(b, a.m_point);
 
-			if (!inside.value() && !(-a.direction()).isBetween(b.normal(i), b.normal(i - 1)))
+			if (!inside.value() && !(-a.direction()).isBetween(b.normal(i), b.normal(i - 1, true)))
 				continue;
 		}
 		else if (aeq(r.value(), ed.pointB())) {
 			if (!inside.hasValue())
 				inside = test(b, a.m_point);
 
-			if (!inside.value() && !(-a.direction()).isBetween(b.normal(i), b.normal(i + 1)))
+			if (!inside.value() && !(-a.direction()).isBetween(b.normal(i), b.normal(i + 1, true)))
 				continue;
 		}
 		auto u = a.computeT(r.value());
@@ -396,132 +398,323 @@ Option<Vec2> sb::Intersection::get(const Ray& a, const Polygon& b) {
 	return pt;
 }
 
-sb::IntersectionInfo sb::Intersection::get(const Polygon& a, const Polygon& b) {
+//How far b reaches behind edge i of a, negative when the edge separates them
+static inline float edgeDepth(const Polygon& a, ptrdiff_t i, const Polygon& b) {
+	const auto n = a.normal(i);
+	return dot(n, a.point(i)) - dot(n, b.supportPoint(-n));
+}
+
+static IntersectionInfo satIntersection(const Polygon& a, const Polygon& b) {
 	assert(a.isSimple());
 	assert(b.isSimple());
 	assert(a.isConvex());
 	assert(b.isConvex());
 	assert(a.area() != 0);
 	assert(b.area() != 0);
-	float t = std::numeric_limits<float>::max();
-	Vec2 normal;
 	auto aeCount = a.edgeCount();
 	auto beCount = b.edgeCount();
+	//The edge that separated the polygons last time usually still does
+	if (a.separatingEdgeHint() < aeCount && edgeDepth(a, a.separatingEdgeHint(), b) < 0)
+		return IntersectionInfo();
+	if (b.separatingEdgeHint() < beCount && edgeDepth(b, b.separatingEdgeHint(), a) < 0)
+		return IntersectionInfo();
+	float t = std::numeric_limits<float>::max();
+	Vec2 normal;
 	for (ptrdiff_t i = 0; i < aeCount; i++) {
-		bool foundNegative = false;
-		float tEdge = std::numeric_limits<float>::lowest();
-		Vec2 eNormal;
-		for (ptrdiff_t j = 0; j < b.pointCount(); j++) {
-			auto v = b.point(j) - a.edge(i).pointA();
-			auto dt = dot(a.normal(i), v);
-			if (dt <= 0) {
-				foundNegative = true;
-				auto currentT = a.edge(i).containingLine().squaredDistanceFrom(b.point(j));
-				if (currentT > tEdge) {
-					tEdge = currentT;
-					eNormal = -a.normal(i);
-				}
-			}
-		}
-
-		if (!foundNegative)
+		auto tEdge = edgeDepth(a, i, b);
+		if (tEdge < 0) {
+			a.setSeparatingEdgeHint(i);
 			return IntersectionInfo();
-
+		}
 		if (tEdge < t) {
 			t = tEdge;
-			normal = eNormal;
+			normal = -a.normal(i);
 		}
 	}
 
 	for (ptrdiff_t i = 0; i < beCount; i++) {
-		bool foundNegative = false;
-		float tEdge = std::numeric_limits<float>::lowest();
-		Vec2 eNormal;
-		for (ptrdiff_t j = 0; j < a.pointCount(); j++) {
-			auto v = a.point(j) - b.edge(i).pointA();
-			auto dt = dot(b.normal(i), v);
-			if (dt <= 0) {
-				foundNegative = true;
-				auto currentT = b.edge(i).containingLine().squaredDistanceFrom(a.point(j));
-				if (currentT > tEdge) {
-					tEdge = currentT;
-					eNormal = b.normal(i);
-				}
-			}
-		}
-
-		if (!foundNegative)
+		auto tEdge = edgeDepth(b, i, a);
+		if (tEdge < 0) {
+			b.setSeparatingEdgeHint(i);
 			return IntersectionInfo();
-
+		}
 		if (tEdge < t) {
 			t = tEdge;
-			normal = eNormal;
+			normal = b.normal(i);
 		}
 	}
 
-	return IntersectionInfo(normal, sqrtf(t));
+	return IntersectionInfo(normal, t);
+}
+
+//GJK and EPA
+#define SbGJKMaxIterations 32
+#define SbGJKTolerance 0.0001f
+#define SbEPAMaxIterations 128
+#define SbEPATolerance 0.0001f
+#define SbEPAInlinePoints 64
+
+static std::atomic<PolygonAlgorithm> s_polygonAlgorithm(PolygonAlgorithm::sat);
+
+//Point of the Minkowski difference a - b farthest along a direction
+static inline Vec2 support(const Polygon& a, const Polygon& b, const Vec2& direction) {
+	return a.supportPoint(direction) - b.supportPoint(-direction);
+}
+
+//Points of the Minkowski difference GJK keeps closest to the origin
+struct Simplex {
+	Vec2 points[3];
+	int count;
+};
+
+//Closest point of a segment to the origin, keeping in the simplex only the ends it depends on
+static Vec2 closestOnSegment(const Vec2& a, const Vec2& b, Simplex& simplex) {
+	const auto ab = b - a;
+	const auto lengthSq = dot(ab, ab);
+	const auto t = lengthSq > 0 ? -dot(a, ab) / lengthSq : 0.0f;
+	if (t <= 0) {
+		simplex.points[0] = a;
+		simplex.count = 1;
+		return a;
+	}
+	if (t >= 1) {
+		simplex.points[0] = b;
+		simplex.count = 1;
+		return b;
+	}
+	simplex.points[0] = a;
+	simplex.points[1] = b;
+	simplex.count = 2;
+	return a + ab * t;
+}
+//Closest point of the simplex to the origin. A triangle is kept whole only when it contains the origin.
+static Vec2 closestToOrigin(Simplex& simplex) {
+	if (simplex.count == 1)
+		return simplex.points[0];
+	if (simplex.count == 2) {
+		const auto a = simplex.points[0];
+		const auto b = simplex.points[1];
+		return closestOnSegment(a, b, simplex);
+	}
+	const auto a = simplex.points[0];
+	const auto b = simplex.points[1];
+	const auto c = simplex.points[2];
+	const auto area = cross(b - a, c - a);
+	//The origin is inside when the triangles it makes with each edge wind like the simplex
+	const auto u = cross(b, c);
+	const auto v = cross(c, a);
+	const auto w = cross(a, b);
+	if ((area > 0 && u >= 0 && v >= 0 && w >= 0) || (area < 0 && u <= 0 && v <= 0 && w <= 0))
+		return Vec2::zero;
+	Simplex best;
+	auto closest = closestOnSegment(a, b, best);
+	Simplex edge;
+	auto pt = closestOnSegment(b, c, edge);
+	if (pt.squaredLength() < closest.squaredLength()) {
+		closest = pt;
+		best = edge;
+	}
+	pt = closestOnSegment(c, a, edge);
+	if (pt.squaredLength() < closest.squaredLength()) {
+		closest = pt;
+		best = edge;
+	}
+	simplex = best;
+	return closest;
+}
+//Whether the origin is within SbGJKTolerance of a - b. Leaves the last simplex and the distance to it.
+static bool gjk(const Polygon& a, const Polygon& b, Simplex& simplex, float* distance) {
+	assert(a.pointCount() != 0);
+	assert(b.pointCount() != 0);
+	//EPA needs every simplex point on the boundary of a - b, so it starts from a support point too
+	auto direction = a.point(0) - b.point(0);
+	if (direction == Vec2::zero)
+		direction = Vec2::right;
+	auto v = support(a, b, direction);
+	simplex.points[0] = v;
+	simplex.count = 1;
+	for (int i = 0; i < SbGJKMaxIterations; i++) {
+		const auto vv = dot(v, v);
+		if (vv <= SbGJKTolerance * SbGJKTolerance) {
+			*distance = 0;
+			return true;
+		}
+		//Stop once the next support point can't bring the simplex closer than the tolerance
+		const auto w = support(a, b, -v);
+		if (vv - dot(v, w) <= SbGJKTolerance * sqrtf(vv)) {
+			*distance = sqrtf(vv);
+			return false;
+		}
+		simplex.points[simplex.count++] = w;
+		v = closestToOrigin(simplex);
+		if (simplex.count == 3) {
+			*distance = 0;
+			return true;
+		}
+	}
+	*distance = v.length();
+	return *distance <= SbGJKTolerance;
+}
+//Penetration of a - b from the simplex GJK stopped with
+static IntersectionInfo epa(const Polygon& a, const Polygon& b, Simplex& simplex) {
+	//Touching shapes can leave GJK on a point or a segment through the origin, which EPA needs as a triangle
+	if (simplex.count == 1) {
+		const Vec2 axes[] = { Vec2::right, Vec2::up, Vec2::left, Vec2::down };
+		for (const auto& axis : axes) {
+			const auto pt = support(a, b, axis);
+			if (pt != simplex.points[0]) {
+				simplex.points[1] = pt;
+				simplex.count = 2;
+				break;
+			}
+		}
+	}
+	if (simplex.count == 2) {
+		const auto edge = simplex.points[1] - simplex.points[0];
+		auto side = Vec2(-edge.y, edge.x);
+		if (dot(side, simplex.points[0]) > 0)
+			side = -side;
+		auto pt = support(a, b, side);
+		if (fabsf(cross(edge, pt - simplex.points[0])) <= SbGJKTolerance * edge.length())
+			pt = support(a, b, -side);
+		simplex.points[2] = pt;
+		simplex.count = 3;
+	}
+	SmallVector<Vec2, SbEPAInlinePoints> polytope;
+	polytope.push_back(simplex.points[0]);
+	if (cross(simplex.points[1] - simplex.points[0], simplex.points[2] - simplex.points[0]) >= 0) {
+		polytope.push_back(simplex.points[1]);
+		polytope.push_back(simplex.points[2]);
+	}
+	else {
+		polytope.push_back(simplex.points[2]);
+		polytope.push_back(simplex.points[1]);
+	}
+	Vec2 normal;
+	float depth = 0;
+	for (int iteration = 0; iteration < SbEPAMaxIterations; iteration++) {
+		//Edge of the polytope closest to the origin, with its outward normal
+		size_t closest = 0;
+		depth = std::numeric_limits<float>::max();
+		for (size_t i = 0; i < polytope.size(); i++) {
+			const auto& p = polytope[i];
+			const auto& q = polytope[i + 1 == polytope.size() ? 0 : i + 1];
+			const auto edge = q - p;
+			const auto length = edge.length();
+			if (length == 0)
+				continue;
+			const auto n = Vec2(edge.y, -edge.x) / length;
+			const auto d = dot(n, p);
+			if (d < depth) {
+				depth = d;
+				normal = n;
+				closest = i;
+			}
+		}
+		//Done when the edge is on the boundary of a - b, otherwise grow the polytope through it
+		const auto pt = support(a, b, normal);
+		if (dot(pt, normal) - depth <= SbEPATolerance)
+			break;
+		polytope.push_back(pt);
+		for (size_t i = polytope.size() - 1; i > closest + 1; i--)
+			polytope[i] = polytope[i - 1];
+		polytope[closest + 1] = pt;
+	}
+	//a leaves b moving against the normal of the face
+	return IntersectionInfo(-normal, std::max(depth, 0.0f));
+}
+
+static IntersectionInfo gjkIntersection(const Polygon& a, const Polygon& b) {
+	assert(a.isConvex());
+	assert(b.isConvex());
+	assert(a.area() != 0);
+	assert(b.area() != 0);
+	Simplex simplex;
+	float distance;
+	if (!gjk(a, b, simplex, &distance))
+		return IntersectionInfo();
+	return epa(a, b, simplex);
+}
+
+sb::IntersectionInfo sb::Intersection::get(const Polygon& a, const Polygon& b) {
+	return get(a, b, s_polygonAlgorithm.load(std::memory_order_relaxed));
+}
+
+sb::IntersectionInfo sb::Intersection::get(const Polygon& a, const Polygon& b, PolygonAlgorithm algorithm) {
+	if (algorithm == PolygonAlgorithm::gjk)
+		return gjkIntersection(a, b);
+	return satIntersection(a, b);
+}
+
+bool sb::Intersection::test(const Polygon& a, const Polygon& b) {
+	return test(a, b, s_polygonAlgorithm.load(std::memory_order_relaxed));
+}
+
+bool sb::Intersection::test(const Polygon& a, const Polygon& b, PolygonAlgorithm algorithm) {
+	if (algorithm == PolygonAlgorithm::sat)
+		return !satIntersection(a, b).empty;
+	assert(a.isConvex());
+	assert(b.isConvex());
+	Simplex simplex;
+	float distance;
+	return gjk(a, b, simplex, &distance);
+}
+
+float sb::Intersection::distance(const Polygon& a, const Polygon& b) {
+	assert(a.isConvex());
+	assert(b.isConvex());
+	Simplex simplex;
+	float distance;
+	gjk(a, b, simplex, &distance);
+	return distance;
+}
+
+sb::PolygonAlgorithm sb::Intersection::polygonAlgorithm() {
+	return s_polygonAlgorithm.load(std::memory_order_relaxed);
+}
+
+void sb::Intersection::setPolygonAlgorithm(PolygonAlgorithm algorithm) {
+	s_polygonAlgorithm.store(algorithm, std::memory_order_relaxed);
 }
 
 sb::IntersectionInfo sb::Intersection::get(const Polygon& a, const Rect& b) {
 	assert(a.isSimple());
 	assert(a.isConvex());
 	assert(a.area() != 0);
+	auto aeCount = a.edgeCount();
+	//The rect's support point along -n is the corner that reaches lowest
+	auto rectDepth = [&](ptrdiff_t i) {
+		const auto n = a.normal(i);
+		return dot(n, a.point(i)) - dot(n, b.center()) + (fabsf(n.x) * b.width() + fabsf(n.y) * b.height()) / 2;
+	};
+	if (a.separatingEdgeHint() < aeCount && rectDepth(a.separatingEdgeHint()) < 0)
+		return IntersectionInfo();
 	float t = std::numeric_limits<float>::max();
 	Vec2 normal;
-	auto aeCount = a.edgeCount();
 	for (ptrdiff_t i = 0; i < aeCount; i++) {
-		bool foundNegative = false;
-		float tEdge = std::numeric_limits<float>::lowest();
-		Vec2 eNormal;
-		for (size_t j = 0; j < 4; j++) {
-			auto v = b.point(j) - a.edge(i).pointA();
-			auto dt = dot(a.normal(i), v);
-			if (dt <= 0) {
-				foundNegative = true;
-				auto currentT = a.edge(i).containingLine().squaredDistanceFrom(b.point(j));
-				if (currentT > tEdge) {
-					tEdge = currentT;
-					eNormal = -a.normal(i);
-				}
-			}
-		}
-
-		if (!foundNegative)
+		auto tEdge = rectDepth(i);
+		if (tEdge < 0) {
+			a.setSeparatingEdgeHint(i);
 			return IntersectionInfo();
-
+		}
 		if (tEdge < t) {
 			t = tEdge;
-			normal = eNormal;
+			normal = -a.normal(i);
 		}
 	}
 
 	for (size_t i = 0; i < 4; i++) {
-		bool foundNegative = false;
-		float tEdge = std::numeric_limits<float>::lowest();
-		Vec2 eNormal;
-		for (ptrdiff_t j = 0; j < a.pointCount(); j++) {
-			auto v = a.point(j) - b.edge(i).pointA();
-			auto dt = dot(b.normal(i), v);
-			if (dt <= 0) {
-				foundNegative = true;
-				auto currentT = b.edge(i).containingLine().squaredDistanceFrom(a.point(j));
-				if (currentT > tEdge) {
-					tEdge = currentT;
-					eNormal = b.normal(i);
-				}
-			}
-		}
-
-		if (!foundNegative)
+		auto n = b.normal(i);
+		auto tEdge = dot(n, b.point(i)) - dot(n, a.supportPoint(-n));
+		if (tEdge < 0)
 			return IntersectionInfo();
-
 		if (tEdge < t) {
 			t = tEdge;
-			normal = eNormal;
+			normal = n;
 		}
 	}
 
-	return IntersectionInfo(normal, sqrtf(t));
+	return IntersectionInfo(normal, t);
 }
 
 sb::IntersectionInfo sb::Intersection::get(const Polygon& a, const Circle& b) {
@@ -530,11 +723,14 @@ sb::IntersectionInfo sb::Intersection::get(const Polygon& a, const Circle& b) {
 	assert(a.area() != 0);
 	float t = std::numeric_limits<float>::max();
 	auto aeCount = a.edgeCount();
+	auto hint = a.separatingEdgeHint();
+	if (hint < aeCount && dot(a.normal(hint), b.center() - a.point(hint)) > b.radius())
+		return IntersectionInfo();
 	Vec2 normal;
 	for (ptrdiff_t i = 0; i < aeCount; i++) {
-		auto v = b.center() - a.edge(i).pointA();
+		auto v = b.center() - a.point(i);
 		auto dt1 = dot(a.normal(i), v);
-		auto dt2 = a.edge(i).containingLine().distanceFrom(b.center());
+		auto dt2 = fabsf(dt1);
 		if (dt1 <= 0 || dt2 <= b.radius()) {
 			if (dt1 >= 0) {
 				auto currentT = b.radius() - dt2;
@@ -551,34 +747,21 @@ sb::IntersectionInfo sb::Intersection::get(const Polygon& a, const Circle& b) {
 				}
 			}
 		}
-		else
+		else {
+			a.setSeparatingEdgeHint(i);
 			return IntersectionInfo(); //found separating axis
+		}
 
 		auto n = a.point(i) - b.center();
 		n.normalize();
 		auto pt = b.center() + n * b.radius();
-		bool foundNegative = false;
-		float tEdge = std::numeric_limits<float>::lowest();
-		Vec2 eNormal;
-		for (ptrdiff_t j = 0; j < a.pointCount(); j++) {
-			auto v = a.point(j) - pt;
-			auto dt = dot(n, v);
-			if (dt <= 0) {
-				foundNegative = true;
-				auto ln = Line(pt, pt + n.rotated90());
-				auto currentT = ln.squaredDistanceFrom(a.point(j));
-				if (currentT > tEdge) {
-					tEdge = currentT;
-					eNormal = n;
-				}
-			}
-		}
-
-		if (!foundNegative) //found separating axis
+		auto depth = dot(n, pt) - dot(n, a.supportPoint(-n));
+		if (depth < 0) //found separating axis
 			return IntersectionInfo();
+		auto tEdge = depth * depth;
 		if (tEdge < t) {
 			t = tEdge;
-			normal = eNormal;
+			normal = n;
 		}
 	}
 
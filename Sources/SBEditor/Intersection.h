@@ -36,6 +36,13 @@ namespace sb {
 			this->penetration = penetration;
 		}
 	};
+	//Narrowphase used for polygon pairs
+	enum class PolygonAlgorithm {
+		//Separating axis test over the edges of both polygons
+		sat,
+		//GJK over the Minkowski difference, with EPA for the penetration
+		gjk
+	};
 	//Intersection Classes
 	class Intersection {
 	public:
@@ -51,6 +58,7 @@ namespace sb {
 		static IntersectionInfo get(const Circle& a, const Circle& b);
 		static IntersectionInfo get(const Rect& a, const Circle& b);
 		static IntersectionInfo get(const Polygon& a, const Polygon& b);
+		static IntersectionInfo get(const Polygon& a, const Polygon& b, PolygonAlgorithm algorithm);
 		static IntersectionInfo get(const Polygon& a, const Rect& b);
 		static IntersectionInfo get(const Polygon& a, const Circle& b);
 		static bool test(const Ray& a, const Vec2& b);
@@ -61,5 +69,12 @@ namespace sb {
 		static bool test(const Circle& a, const Circle& b);
 		static bool test(const Circle& a, const Vec2& b);
 		static bool test(const Polygon& a, const Vec2& b);
+		static bool test(const Polygon& a, const Polygon& b);
+		static bool test(const Polygon& a, const Polygon& b, PolygonAlgorithm algorithm);
+		//Distance between convex polygons, 0 when they touch or overlap
+		static float distance(const Polygon& a, const Polygon& b);
+		//Algorithm of the polygon pair functions that don't take one, sat by default
+		static PolygonAlgorithm polygonAlgorithm();
+		static void setPolygonAlgorithm(PolygonAlgorithm algorithm);
 	};
 }
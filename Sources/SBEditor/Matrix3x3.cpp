@@ -7,6 +7,121 @@ You can't use, distribute or modify this code without my permission.
 #include "pch.h"
 #include "Matrix3x3.h"
 
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define SbMatrixSIMD
+#endif
+
 using namespace sb;
 
 const Matrix3x3 Matrix3x3::identity = Matrix3x3(1, 0, 0, 0, 1, 0, 0, 0, 1);
+
+#ifdef SbMatrixSIMD
+static_assert(sizeof(Vec2) == 2 * sizeof(float), "The kernels read Vec2 arrays as packed floats.");
+
+namespace {
+	enum class SIMDLevel {
+		sse2,
+		avx
+	};
+	//AVX needs the CPU flag and the OS saving the ymm registers
+	SIMDLevel detectSIMDLevel() {
+		int info[4];
+		__cpuid(info, 1);
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		const bool avx = (info[2] & (1 << 28)) != 0;
+		if (osxsave && avx && (_xgetbv(0) & 6) == 6)
+			return SIMDLevel::avx;
+		return SIMDLevel::sse2;
+	}
+	const SIMDLevel simdLevel = detectSIMDLevel();
+
+	//Each lane computes e00 * x + e01 * y + e02 (or its y row) in the order transformedPoint does, so the
+	//results are bit exact
+	void transformPointsSSE(const Matrix3x3& m, const Vec2* in, Vec2* out, size_t count) {
+		const auto columnX = _mm_setr_ps(m.e00, m.e10, m.e00, m.e10);
+		const auto columnY = _mm_setr_ps(m.e01, m.e11, m.e01, m.e11);
+		const auto translation = _mm_setr_ps(m.e02, m.e12, m.e02, m.e12);
+		size_t i = 0;
+		for (; i + 2 <= count; i += 2) {
+			const auto v = _mm_loadu_ps(&in[i].x);
+			const auto xs = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 0, 0));
+			const auto ys = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 1, 1));
+			_mm_storeu_ps(&out[i].x, _mm_add_ps(_mm_add_ps(_mm_mul_ps(columnX, xs), _mm_mul_ps(columnY, ys)), translation));
+		}
+		for (; i < count; i++)
+			out[i] = m.transformedPoint(in[i]);
+	}
+	void transformPointsAVX(const Matrix3x3& m, const Vec2* in, Vec2* out, size_t count) {
+		const auto columnX = _mm256_setr_ps(m.e00, m.e10, m.e00, m.e10, m.e00, m.e10, m.e00, m.e10);
+		const auto columnY = _mm256_setr_ps(m.e01, m.e11, m.e01, m.e11, m.e01, m.e11, m.e01, m.e11);
+		const auto translation = _mm256_setr_ps(m.e02, m.e12, m.e02, m.e12, m.e02, m.e12, m.e02, m.e12);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			const auto v = _mm256_loadu_ps(&in[i].x);
+			const auto xs = _mm256_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 0, 0));
+			const auto ys = _mm256_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 1, 1));
+			_mm256_storeu_ps(&out[i].x, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(columnX, xs), _mm256_mul_ps(columnY, ys)), translation));
+		}
+		//Avoids the penalty of the SSE code that runs next
+		_mm256_zeroupper();
+		transformPointsSSE(m, in + i, out + i, count - i);
+	}
+	//Interleaved points are loaded and stored two floats at a time, so the wider registers wouldn't help
+	void transformPointsSSE(const Matrix3x3& m, const char* in, size_t inStride, char* out, size_t outStride, size_t count) {
+		const auto columnX = _mm_setr_ps(m.e00, m.e10, m.e00, m.e10);
+		const auto columnY = _mm_setr_ps(m.e01, m.e11, m.e01, m.e11);
+		const auto translation = _mm_setr_ps(m.e02, m.e12, m.e02, m.e12);
+		size_t i = 0;
+		for (; i + 2 <= count; i += 2) {
+			auto v = _mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(in));
+			v = _mm_loadh_pi(v, reinterpret_cast<const __m64*>(in + inStride));
+			const auto xs = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 0, 0));
+			const auto ys = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 1, 1));
+			const auto r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(columnX, xs), _mm_mul_ps(columnY, ys)), translation);
+			_mm_storel_pi(reinterpret_cast<__m64*>(out), r);
+			_mm_storeh_pi(reinterpret_cast<__m64*>(out + outStride), r);
+			in += 2 * inStride;
+			out += 2 * outStride;
+		}
+		if (i < count) {
+			auto pt = Vec2(reinterpret_cast<const float*>(in)[0], reinterpret_cast<const float*>(in)[1]);
+			pt = m.transformedPoint(pt);
+			reinterpret_cast<float*>(out)[0] = pt.x;
+			reinterpret_cast<float*>(out)[1] = pt.y;
+		}
+	}
+}
+#endif
+
+void sb::Matrix3x3::transformPoints(const Vec2* in, Vec2* out, size_t count) const {
+	assert(count == 0 || (in && out));
+#ifdef SbMatrixSIMD
+	if (simdLevel == SIMDLevel::avx)
+		transformPointsAVX(*this, in, out, count);
+	else
+		transformPointsSSE(*this, in, out, count);
+#else
+	for (size_t i = 0; i < count; i++)
+		out[i] = transformedPoint(in[i]);
+#endif
+}
+
+void sb::Matrix3x3::transformPoints(const float* in, size_t inStride, float* out, size_t outStride, size_t count) const {
+	assert(count == 0 || (in && out));
+	assert(inStride >= 2 * sizeof(float) && outStride >= 2 * sizeof(float));
+#ifdef SbMatrixSIMD
+	transformPointsSSE(*this, reinterpret_cast<const char*>(in), inStride, reinterpret_cast<char*>(out), outStride, count);
+#else
+	auto src = reinterpret_cast<const char*>(in);
+	auto dst = reinterpret_cast<char*>(out);
+	for (size_t i = 0; i < count; i++) {
+		const auto pt = transformedPoint(Vec2(reinterpret_cast<const float*>(src)[0], reinterpret_cast<const float*>(src)[1]));
+		reinterpret_cast<float*>(dst)[0] = pt.x;
+		reinterpret_cast<float*>(dst)[1] = pt.y;
+		src += inStride;
+		dst += outStride;
+	}
+#endif
+}
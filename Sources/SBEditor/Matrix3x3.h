@@ -335,6 +335,10 @@ namespace sb {
 		inline bool isInvertible(bool almost = false) const {
 			return almost ? !aeq(determinant(), 0) : determinant() != 0;
 		}
+		//Whether the bottom row is 0 0 1, so the matrix fits in an Affine2
+		inline bool isAffine() const {
+			return e20 == 0 && e21 == 0 && e22 == 1;
+		}
 		//Transformations
 		inline void transformVector(Vec2* v) const {
 			const auto vc = *v;
@@ -358,8 +362,19 @@ namespace sb {
 			vc.y = e10 * v.x + e11 * v.y + e12;
 			return vc;
 		}
+		//Batch transforms, with the same results as transformedPoint. They run on SSE2 or AVX when the CPU has them.
+		//out may be in, but mustn't overlap it otherwise.
+		void transformPoints(const Vec2* in, Vec2* out, size_t count) const;
+		//Points interleaved with other data, like the positions of vertices. Strides are in bytes.
+		void transformPoints(const float* in, size_t inStride, float* out, size_t outStride, size_t count) const;
+		//Vertices whose position is in their x and y members, like BasicVertex
+		template<typename Vertex>
+		inline void transformVertices(Vertex* vertices, size_t count) const {
+			if (count != 0)
+				transformPoints(&vertices->x, sizeof(Vertex), &vertices->x, sizeof(Vertex), count);
+		}
 		inline Polygon transformedPolygon(const Polygon& p) const {
-			return p.map([&](const Vec2& v) { return this->transformedPoint(v); }, true);
+			return p.mapAll([&](Vec2* points, size_t count) { this->transformPoints(points, points, count); }, true);
 		}
 		inline void transformCircle(Circle* c) const {
 			auto p1 = c->center();
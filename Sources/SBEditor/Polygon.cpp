@@ -177,6 +177,43 @@ sb::Vec2 sb::Polygon::normal(ptrdiff_t index, bool wrap) const {
 	return m_normals[index];
 }
 
+ptrdiff_t sb::Polygon::supportIndex(const Vec2& direction) const {
+	const auto count = pointCount();
+	assert(count != 0);
+	auto i = m_supportHint < count ? m_supportHint : 0;
+	auto best = dot(m_points[i], direction);
+	//Along a convex polygon the projection rises to a single peak, so climbing until no neighbor is farther finds it
+	while (true) {
+		const auto next = i + 1 == count ? 0 : i + 1;
+		const auto previous = i == 0 ? count - 1 : i - 1;
+		const auto dNext = dot(m_points[next], direction);
+		const auto dPrevious = dot(m_points[previous], direction);
+		if (dNext > best && dNext >= dPrevious) {
+			i = next;
+			best = dNext;
+		}
+		else if (dPrevious > best) {
+			i = previous;
+			best = dPrevious;
+		}
+		else if (dNext == best && dPrevious == best) {
+			//Collinear points leave no slope to follow
+			for (ptrdiff_t j = 0; j < count; j++) {
+				const auto d = dot(m_points[j], direction);
+				if (d > best) {
+					i = j;
+					best = d;
+				}
+			}
+			break;
+		}
+		else
+			break;
+	}
+	m_supportHint = i;
+	return i;
+}
+
 sb::Rect sb::Polygon::bounds() const {
 	if (m_bounds.hasValue())
 		return m_bounds.value();
@@ -184,7 +221,7 @@ sb::Rect sb::Polygon::bounds() const {
 	float minx, miny;
 	float maxx, maxy;
 	minx = miny = std::numeric_limits<float>::max();
-	maxx = maxy = std::numeric_limits<float>::min();
+	maxx = maxy = std::numeric_limits<float>::lowest();
 	for (size_t i = 0; i < m_points.size(); i++) {
 		const auto& p = m_points[i];
 		if (p.x < minx)
@@ -347,6 +384,9 @@ sb::Polygon sb::Polygon::toConvex() const {
 	inputPoints = convexHull.outer();
 	for (auto& p : inputPoints)
 		outputPoints.push_back(Vec2(p.x(), p.y()));
+	//boost closes the ring by repeating the first point, which would leave a zero length last edge
+	if (outputPoints.size() > 1 && outputPoints.front() == outputPoints.back())
+		outputPoints.pop_back();
 
 	return Polygon(std::move(outputPoints));
 }
@@ -21,6 +21,8 @@ namespace sb {
 		//Constructors
 		Polygon() {
 			m_closed = false;
+			m_supportHint = 0;
+			m_separatingEdgeHint = 0;
 		}
 		Polygon(const Polygon& other)
 			: m_points(other.m_points), m_normals(other.m_normals) {
@@ -31,6 +33,8 @@ namespace sb {
 			m_isConvex = other.m_isConvex;
 			m_isSimple = other.m_isSimple;
 			m_centroid = other.m_centroid;
+			m_supportHint = other.m_supportHint;
+			m_separatingEdgeHint = other.m_separatingEdgeHint;
 		}
 		Polygon(Polygon&& other)
 			: m_points(std::move(other.m_points)), m_normals(std::move(other.m_normals)) {
@@ -41,18 +45,26 @@ namespace sb {
 			m_isConvex = other.m_isConvex;
 			m_isSimple = other.m_isSimple;
 			m_centroid = other.m_centroid;
+			m_supportHint = other.m_supportHint;
+			m_separatingEdgeHint = other.m_separatingEdgeHint;
 		}
 		Polygon(const std::vector<Vec2>& points, bool closed = true) {
 			m_points = points;
 			m_closed = closed;
+			m_supportHint = 0;
+			m_separatingEdgeHint = 0;
 		}
 		Polygon(std::vector<Vec2>&& points, bool closed = true)
 			: m_points(points) {
 			m_closed = closed;
+			m_supportHint = 0;
+			m_separatingEdgeHint = 0;
 		}
 		Polygon(const std::initializer_list<Vec2>& points, bool closed = true)
 			: m_points(points) {
 			m_closed = closed;
+			m_supportHint = 0;
+			m_separatingEdgeHint = 0;
 		}
 		Polygon(const Vec2* points, size_t count, bool closed = true) {
 			assert(count >= 0);
@@ -61,6 +73,8 @@ namespace sb {
 			for (size_t i = 0; i < count; i++)
 				m_points.push_back(points[i]);
 			m_closed = closed;
+			m_supportHint = 0;
+			m_separatingEdgeHint = 0;
 		}
 		//Assignment operator
 		Polygon& operator=(const Polygon& other) {
@@ -73,6 +87,8 @@ namespace sb {
 			m_isConvex = other.m_isConvex;
 			m_isSimple = other.m_isSimple;
 			m_centroid = other.m_centroid;
+			m_supportHint = other.m_supportHint;
+			m_separatingEdgeHint = other.m_separatingEdgeHint;
 			return *this;
 		}
 		Polygon& operator=(Polygon&& other) {
@@ -85,6 +101,8 @@ namespace sb {
 			m_isConvex = other.m_isConvex;
 			m_isSimple = other.m_isSimple;
 			m_centroid = other.m_centroid;
+			m_supportHint = other.m_supportHint;
+			m_separatingEdgeHint = other.m_separatingEdgeHint;
 			return *this;
 		}
 		//Accessors
@@ -115,6 +133,18 @@ namespace sb {
 		inline const std::vector<Vec2>& allPoints() const {
 			return m_points;
 		}
+		//Support points, for convex polygons. The search hill-climbs from the support point found last time.
+		ptrdiff_t supportIndex(const Vec2& direction) const;
+		inline const Vec2& supportPoint(const Vec2& direction) const {
+			return m_points[supportIndex(direction)];
+		}
+		//Edge that last separated this polygon from another in a SAT test, tried first the next time
+		inline ptrdiff_t separatingEdgeHint() const {
+			return m_separatingEdgeHint;
+		}
+		inline void setSeparatingEdgeHint(ptrdiff_t index) const {
+			m_separatingEdgeHint = index;
+		}
 		//Edges
 		ptrdiff_t edgeCount() const;
 		LineSegment edge(ptrdiff_t index, bool wrap = false) const;
@@ -149,6 +179,22 @@ namespace sb {
 			}
 			return p;
 		}
+		//Like map, but mapFunction(Vec2* points, size_t count) changes all the points in one call
+		template<typename F>
+		Polygon mapAll(const F& mapFunction, bool linearTransformation = false) const {
+			Polygon p = *this;
+			p.m_bounds = nullptr;
+			p.m_centroid = nullptr;
+			p.m_normals.clear();
+			p.m_perimeter = nullptr;
+			p.m_signedArea = nullptr;
+			mapFunction(p.m_points.data(), p.m_points.size());
+			if (!linearTransformation) {
+				p.m_isConvex = nullptr;
+				p.m_isSimple = nullptr;
+			}
+			return p;
+		}
 		Polygon optimize() const;
 		Polygon asClosed() const {
 			if (m_closed)
@@ -186,6 +232,8 @@ namespace sb {
 		mutable Option<bool> m_isSimple;
 		std::vector<Vec2> m_points;
 		mutable std::vector<Vec2> m_normals;
+		mutable ptrdiff_t m_supportHint;
+		mutable ptrdiff_t m_separatingEdgeHint;
 		bool m_closed;
 	};
 
@@ -35,8 +35,8 @@ namespace sb {
 			assert(points.size() != 0);
 			float minx = std::numeric_limits<float>::max();
 			float miny = std::numeric_limits<float>::max();
-			float maxx = std::numeric_limits<float>::min();
-			float maxy = std::numeric_limits<float>::min();
+			float maxx = std::numeric_limits<float>::lowest();
+			float maxy = std::numeric_limits<float>::lowest();
 			for (const auto& v : points) {
 				if (v.x < minx)
 					minx = v.x;
@@ -55,8 +55,8 @@ namespace sb {
 			assert(count > 0);
 			float minx = std::numeric_limits<float>::max();
 			float miny = std::numeric_limits<float>::max();
-			float maxx = std::numeric_limits<float>::min();
-			float maxy = std::numeric_limits<float>::min();
+			float maxx = std::numeric_limits<float>::lowest();
+			float maxy = std::numeric_limits<float>::lowest();
 			for (size_t i = 0; i < count; i++) {
 				const auto& v = points[i];
 				if (v.x < minx)
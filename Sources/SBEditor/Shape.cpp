@@ -15,25 +15,75 @@ You can't use, distribute or modify this code without my permission.
 
 using namespace sb;
 
+//Slots a pool chunk holds
+#define SbShapePoolChunkSize 256
+//End of a free list
+#define SbNullSlot 0xffffffffu
+
 class shape_implementation {
 public:
+	//Back to the state of a new shape
+	void reset() {
+		m_dynamic = false;
+		m_typeMask = std::numeric_limits<size_t>::max();
+		m_collisionMask = std::numeric_limits<size_t>::max();
+		m_parent = nullptr;
+		m_proxy = std::numeric_limits<size_t>::max();
+		m_moveCount = 0;
+	}
 	ShapeType m_type;
 	size_t m_typeMask;
 	size_t m_collisionMask;
 	bool m_dynamic;
+	bool m_pooled;
 	SpatialTree* m_parent;
+	size_t m_proxy;
+	uint32_t m_moveCount;
 	Circle m_circle;
 	Rect m_rect;
 	Polygon m_polygon;
 };
 
+//A pool slot holds its shape and implementation side by side. Both live as long as the pool, from one
+//generation of shapes to the next.
+struct ShapeSlot {
+	shape_implementation impl;
+	typename std::aligned_storage<sizeof(Shape), alignof(Shape)>::type shape;
+	uint32_t generation;
+	uint32_t nextFree;
+	bool alive;
+	inline Shape* get() {
+		return reinterpret_cast<Shape*>(&shape);
+	}
+};
+
+//The slots of one shape type
+struct ShapeSlots {
+	std::vector<std::unique_ptr<ShapeSlot[]>> chunks;
+	uint32_t slotCount = 0;
+	uint32_t freeHead = SbNullSlot;
+	inline ShapeSlot& operator[](uint32_t index) const {
+		return chunks[index / SbShapePoolChunkSize][index % SbShapePoolChunkSize];
+	}
+};
+
+class shape_pool_implementation {
+public:
+	ShapeSlots m_slots[3];
+	size_t m_size = 0;
+};
+
 
 sb::Shape::Shape() {
 	m_impl = new shape_implementation();
-	m_impl->m_dynamic = false;
-	m_impl->m_typeMask = std::numeric_limits<size_t>::max();
-	m_impl->m_collisionMask = std::numeric_limits<size_t>::max();
-	m_impl->m_parent = nullptr;
+	m_impl->m_pooled = false;
+	m_impl->reset();
+}
+
+sb::Shape::Shape(shape_implementation* impl) {
+	m_impl = impl;
+	m_impl->m_pooled = true;
+	m_impl->reset();
 }
 
 sb::Shape* sb::Shape::fromCircle(const sb::Circle& c) {
@@ -44,7 +94,9 @@ sb::Shape* sb::Shape::fromCircle(const sb::Circle& c) {
 }
 
 sb::Shape::~Shape() {
-	delete m_impl;
+	//a pooled implementation belongs to its slot
+	if (!m_impl->m_pooled)
+		delete m_impl;
 }
 
 sb::Shape* sb::Shape::fromRect(const sb::Rect& r) {
@@ -87,6 +139,7 @@ void sb::Shape::applyTransform(const Matrix3x3& m) {
 		m.transformRect(&m_impl->m_rect);
 	else
 		m_impl->m_polygon = m.transformedPolygon(m_impl->m_polygon);
+	m_impl->m_moveCount++;
 }
 
 const size_t sb::Shape::typeMask() const {
@@ -95,6 +148,8 @@ const size_t sb::Shape::typeMask() const {
 
 void sb::Shape::setTypeMask(size_t value) {
 	m_impl->m_typeMask = value;
+	if (m_impl->m_parent)
+		m_impl->m_parent->typeMaskChanged(this);
 }
 
 const size_t sb::Shape::collisionMask() const {
@@ -130,3 +185,109 @@ void sb::Shape::setParent(SpatialTree* value) {
 	m_impl->m_parent = value;
 }
 
+size_t sb::Shape::proxy() const {
+	return m_impl->m_proxy;
+}
+
+void sb::Shape::setProxy(size_t value) {
+	m_impl->m_proxy = value;
+}
+
+uint32_t sb::Shape::moveCount() const {
+	return m_impl->m_moveCount;
+}
+
+sb::ShapePool::ShapePool() {
+	m_impl = new shape_pool_implementation();
+}
+
+sb::ShapePool::~ShapePool() {
+	for (auto& slots : m_impl->m_slots) {
+		for (uint32_t i = 0; i < slots.slotCount; i++)
+			slots[i].get()->~Shape();
+	}
+	delete m_impl;
+}
+
+sb::ShapeHandle sb::ShapePool::createCircle(const Circle& c) {
+	Shape* s;
+	auto h = allocate(ShapeType::circle, &s);
+	s->m_impl->m_circle = c;
+	return h;
+}
+
+sb::ShapeHandle sb::ShapePool::createRect(const struct Rect& r) {
+	Shape* s;
+	auto h = allocate(ShapeType::Rect, &s);
+	s->m_impl->m_rect = r;
+	return h;
+}
+
+sb::ShapeHandle sb::ShapePool::createPolygon(const struct Polygon& p) {
+	Shape* s;
+	auto h = allocate(ShapeType::Polygon, &s);
+	//copying into the slot's polygon reuses the point storage of the shape that had it before
+	const auto convex = p.toConvex();
+	s->m_impl->m_polygon = convex;
+	return h;
+}
+
+sb::ShapeHandle sb::ShapePool::allocate(ShapeType type, Shape** shape) {
+	auto& slots = m_impl->m_slots[(size_t)type];
+	uint32_t index;
+	if (slots.freeHead != SbNullSlot) {
+		index = slots.freeHead;
+		slots.freeHead = slots[index].nextFree;
+		slots[index].impl.reset();
+	}
+	else {
+		if (slots.slotCount % SbShapePoolChunkSize == 0)
+			slots.chunks.push_back(std::unique_ptr<ShapeSlot[]>(new ShapeSlot[SbShapePoolChunkSize]));
+		index = slots.slotCount++;
+		auto& slot = slots[index];
+		slot.generation = 0;
+		new (&slot.shape) Shape(&slot.impl);
+	}
+	auto& slot = slots[index];
+	//0 is the null handle's
+	if (++slot.generation == 0)
+		slot.generation = 1;
+	slot.alive = true;
+	slot.impl.m_type = type;
+	m_impl->m_size++;
+	ShapeHandle h;
+	h.index = index;
+	h.generation = slot.generation;
+	h.type = type;
+	*shape = slot.get();
+	return h;
+}
+
+void sb::ShapePool::destroy(ShapeHandle h) {
+	auto s = get(h);
+	assert(s);
+	assert(!s->parent());
+	(void)s;
+	auto& slots = m_impl->m_slots[(size_t)h.type];
+	auto& slot = slots[h.index];
+	slot.alive = false;
+	slot.nextFree = slots.freeHead;
+	slots.freeHead = h.index;
+	m_impl->m_size--;
+}
+
+sb::Shape* sb::ShapePool::get(ShapeHandle h) const {
+	if (h.isNull())
+		return nullptr;
+	const auto& slots = m_impl->m_slots[(size_t)h.type];
+	if (h.index >= slots.slotCount)
+		return nullptr;
+	auto& slot = slots[h.index];
+	if (!slot.alive || slot.generation != h.generation)
+		return nullptr;
+	return slot.get();
+}
+
+size_t sb::ShapePool::size() const {
+	return m_impl->m_size;
+}
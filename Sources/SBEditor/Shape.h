@@ -6,6 +6,7 @@ You can't use, distribute or modify this code without my permission.
 
 #pragma once
 class shape_implementation;
+class shape_pool_implementation;
 class SpatialTree_implementation;
 
 namespace sb {
@@ -26,6 +27,7 @@ namespace sb {
 	public:
 		//Friend class
 		friend class ::SpatialTree_implementation;
+		friend class ShapePool;
 		//Constructors
 		static Shape* fromCircle(const Circle& c);
 		static Shape* fromRect(const Rect& r);
@@ -51,13 +53,68 @@ namespace sb {
 	private:
 		//Constructors
 		Shape();
+		Shape(shape_implementation* impl);
 		//Apply Transforms
 		void applyTransform(const Matrix3x3& m);
 		//Set
 		void setDynamic(bool value);
 		void setParent(SpatialTree* value);
+		//Proxy (where the parent tree keeps this shape)
+		size_t proxy() const;
+		void setProxy(size_t value);
+		//Bumped by every transform, so the parent tree can tell which shapes moved
+		uint32_t moveCount() const;
 		//Implementation
 		shape_implementation* m_impl;
 	};
+
+	//Refers to a shape of a ShapePool. The generation tells a handle to a destroyed shape apart from one to the
+	//shape that took its slot afterwards. A default handle refers to nothing.
+	struct ShapeHandle {
+	public:
+		//Members
+		uint32_t index;
+		uint32_t generation;
+		ShapeType type;
+		//Constructors
+		inline ShapeHandle() {
+			index = 0;
+			generation = 0;
+			type = ShapeType::circle;
+		}
+		//Tests
+		inline bool isNull() const {
+			return generation == 0;
+		}
+	};
+
+	//Creates and destroys shapes in O(1) without going to the heap once it's warmed up. Each shape type has its
+	//own chunks of slots and its own free list, so shapes of a type sit next to each other, and a slot keeps its
+	//implementation (and a polygon's point storage) for the next shape that takes it.
+	//Pooled shapes are destroyed with destroy, never deleted, and must be out of their tree by then.
+	class ShapePool {
+	public:
+		//Constructors
+		ShapePool();
+		//Destructor
+		~ShapePool();
+		//Creation
+		ShapeHandle createCircle(const Circle& c);
+		ShapeHandle createRect(const Rect& r);
+		ShapeHandle createPolygon(const Polygon& p);
+		void destroy(ShapeHandle h);
+		//Access
+		//nullptr if the shape was destroyed
+		Shape* get(ShapeHandle h) const;
+		//Shapes alive
+		size_t size() const;
+	private:
+		ShapeHandle allocate(ShapeType type, Shape** shape);
+		//Implementation
+		shape_pool_implementation* m_impl;
+		//Not copyable
+		ShapePool(const ShapePool&) = delete;
+		ShapePool& operator=(const ShapePool&) = delete;
+	};
 }
 
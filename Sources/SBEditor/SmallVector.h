@@ -0,0 +1,173 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#pragma once
+
+namespace sb {
+	//Vector that keeps its first _InlineCount items inside the object itself and only goes to the heap
+	//when it grows past that. Meant for indexes and other trivially copyable items.
+	template<class _Item, size_t _InlineCount>
+	class SmallVector {
+	public:
+		//Typedefs
+		typedef _Item Item;
+		typedef Item* iterator;
+		typedef const Item* const_iterator;
+		//Constructors
+		inline SmallVector() {
+			static_assert(std::is_trivially_copyable<Item>::value, "SmallVector only holds trivially copyable items.");
+			m_data = m_inline;
+			m_count = 0;
+			m_capacity = _InlineCount;
+		}
+		inline SmallVector(const SmallVector& other) : SmallVector() {
+			reserve(other.m_count);
+			memcpy(m_data, other.m_data, other.m_count * sizeof(Item));
+			m_count = other.m_count;
+		}
+		inline SmallVector(SmallVector&& other) noexcept : SmallVector() {
+			moveFrom(other);
+		}
+		//Destructor
+		inline ~SmallVector() noexcept {
+			if (m_data != m_inline)
+				free(m_data);
+		}
+		//Assignment
+		inline SmallVector& operator=(const SmallVector& other) {
+			if (this == &other)
+				return *this;
+			m_count = 0;
+			reserve(other.m_count);
+			memcpy(m_data, other.m_data, other.m_count * sizeof(Item));
+			m_count = other.m_count;
+			return *this;
+		}
+		inline SmallVector& operator=(SmallVector&& other) noexcept {
+			if (this == &other)
+				return *this;
+			if (m_data != m_inline)
+				free(m_data);
+			m_data = m_inline;
+			m_count = 0;
+			m_capacity = _InlineCount;
+			moveFrom(other);
+			return *this;
+		}
+		//Access
+		inline Item& operator[](size_t index) {
+			assert(index < m_count);
+			return m_data[index];
+		}
+		inline const Item& operator[](size_t index) const {
+			assert(index < m_count);
+			return m_data[index];
+		}
+		inline Item& back() {
+			assert(m_count != 0);
+			return m_data[m_count - 1];
+		}
+		inline const Item& back() const {
+			assert(m_count != 0);
+			return m_data[m_count - 1];
+		}
+		inline Item* data() {
+			return m_data;
+		}
+		inline const Item* data() const {
+			return m_data;
+		}
+		inline iterator begin() {
+			return m_data;
+		}
+		inline iterator end() {
+			return m_data + m_count;
+		}
+		inline const_iterator begin() const {
+			return m_data;
+		}
+		inline const_iterator end() const {
+			return m_data + m_count;
+		}
+		//Size + Capacity
+		inline size_t size() const {
+			return m_count;
+		}
+		inline bool empty() const {
+			return m_count == 0;
+		}
+		inline size_t capacity() const {
+			return m_capacity;
+		}
+		inline bool isInline() const {
+			return m_data == m_inline;
+		}
+		inline void reserve(size_t capacity) {
+			if (capacity <= m_capacity)
+				return;
+			auto newData = (Item*)malloc(capacity * sizeof(Item));
+			assert(newData);
+			memcpy(newData, m_data, m_count * sizeof(Item));
+			if (m_data != m_inline)
+				free(m_data);
+			m_data = newData;
+			m_capacity = capacity;
+		}
+		inline void resize(size_t count) {
+			reserve(count);
+			m_count = count;
+		}
+		//Modifying
+		inline void push_back(const Item& item) {
+			if (m_count == m_capacity)
+				reserve(m_capacity * 2);
+			m_data[m_count] = item;
+			m_count++;
+		}
+		inline void pop_back() {
+			assert(m_count != 0);
+			m_count--;
+		}
+		inline void clear() {
+			m_count = 0;
+		}
+		//Removes the item at index by moving the last item into its place. Doesn't keep the order.
+		inline void swapErase(size_t index) {
+			assert(index < m_count);
+			m_data[index] = m_data[m_count - 1];
+			m_count--;
+		}
+		//Removes the first occurrence of item, if any. Doesn't keep the order.
+		inline bool swapEraseItem(const Item& item) {
+			for (size_t i = 0; i < m_count; i++) {
+				if (m_data[i] == item) {
+					swapErase(i);
+					return true;
+				}
+			}
+			return false;
+		}
+	private:
+		inline void moveFrom(SmallVector& other) {
+			if (other.m_data == other.m_inline) {
+				memcpy(m_inline, other.m_inline, other.m_count * sizeof(Item));
+				m_count = other.m_count;
+			}
+			else {
+				m_data = other.m_data;
+				m_count = other.m_count;
+				m_capacity = other.m_capacity;
+				other.m_data = other.m_inline;
+				other.m_capacity = _InlineCount;
+			}
+			other.m_count = 0;
+		}
+		Item* m_data;
+		size_t m_count;
+		size_t m_capacity;
+		Item m_inline[_InlineCount];
+	};
+}
@@ -0,0 +1,59 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#pragma once
+
+//Define SbSpatialTreeStats in the preprocessor definitions to have the spatial structures count the work
+//their queries do. Without it the counters compile to nothing.
+
+namespace sb {
+	//Work done by spatial queries
+	struct QueryStats {
+	public:
+		//Members
+		uint64_t queries;
+		//Tree nodes walked, in the static BVH and in the dynamic AABB tree
+		uint64_t nodesVisited;
+		//Grid cells looked up
+		uint64_t cellsVisited;
+		//Shapes a grid query met again in another cell
+		uint64_t duplicatesSkipped;
+		//Shapes that reached the leaf tests
+		uint64_t candidates;
+		//Exact tests against a shape: intersections, ray hits, distances and sweeps
+		uint64_t narrowphaseTests;
+		//Constructors
+		inline QueryStats() {
+			clear();
+		}
+		//Modifying
+		inline void clear() {
+			queries = 0;
+			nodesVisited = 0;
+			cellsVisited = 0;
+			duplicatesSkipped = 0;
+			candidates = 0;
+			narrowphaseTests = 0;
+		}
+		inline QueryStats& operator+=(const QueryStats& other) {
+			queries += other.queries;
+			nodesVisited += other.nodesVisited;
+			cellsVisited += other.cellsVisited;
+			duplicatesSkipped += other.duplicatesSkipped;
+			candidates += other.candidates;
+			narrowphaseTests += other.narrowphaseTests;
+			return *this;
+		}
+	};
+
+#ifdef SbSpatialTreeStats
+	//Counters of the query running on this thread
+	extern thread_local QueryStats t_queryStats;
+#define SbCountStat(counter, n) (::sb::t_queryStats.counter += (n))
+#else
+#define SbCountStat(counter, n) ((void)0)
+#endif
+}
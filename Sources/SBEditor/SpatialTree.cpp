@@ -12,166 +12,576 @@ You can't use, distribute or modify this code without my permission.
 #include "Ray.h" 
 #include "Intersection.h" 
 #include "Matrix3x3.h" 
+#include "Polygon.h"
+#include "DynamicAABBTree.h"
+#include "HashGrid.h"
+#include "StaticBVH.h"
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
 
 using namespace sb;
 
-Rect computeBounds(const std::vector<Shape*>& shapes) {
-	assert(shapes.size() != 0);
-	Option<Rect> bounds = nullptr;
-	for (auto& s : shapes) {
-		if (!bounds)
-			bounds = s->bounds();
-		else
-			bounds = getUnion(bounds.value(), s->bounds());
+//Cell coordinates are clamped to this, so they always fit the packed grid keys
+#define SbMaxCellCoordinate 1073741824.0f
+//A batch is only split across threads when each thread gets at least this many rays
+#define SbRayBatchParallelMinCount 256
+//Same for the transforms of an update
+#define SbUpdateParallelMinCount 1024
+
+//Where the dynamic structure keeps a dynamic shape: the grid cells it was inserted into, or its AABB tree proxy
+struct DynamicRecord {
+	uint32_t level;
+	CellRange cells;
+	uint32_t treeProxy;
+};
+
+//Shapes kept column by column: packed bounds, type masks and types. Broadphase and leaf tests walk these
+//arrays and only the narrowphase dereferences the Shape.
+struct ShapeTable {
+	std::vector<float> minx, miny, maxx, maxy;
+	std::vector<size_t> typeMasks;
+	std::vector<ShapeType> types;
+	std::vector<Shape*> shapes;
+
+	inline size_t size() const {
+		return shapes.size();
 	}
-	assert(bounds);
-	return bounds.value();
-}
+	inline void push(Shape* s) {
+		minx.push_back(0);
+		miny.push_back(0);
+		maxx.push_back(0);
+		maxy.push_back(0);
+		typeMasks.push_back(0);
+		types.push_back(ShapeType::circle);
+		shapes.push_back(nullptr);
+		set(size() - 1, s);
+	}
+	inline void set(size_t i, Shape* s) {
+		shapes[i] = s;
+		types[i] = s->type();
+		typeMasks[i] = s->typeMask();
+		setBounds(i, s->bounds());
+	}
+	inline void setBounds(size_t i, const Rect& b) {
+		minx[i] = b.left();
+		miny[i] = b.bottom();
+		maxx[i] = b.right();
+		maxy[i] = b.top();
+	}
+	//An empty slot matches no mask
+	inline void clear(size_t i) {
+		shapes[i] = nullptr;
+		typeMasks[i] = 0;
+	}
+	//Moves the last row into i, the way the static shapes are renumbered
+	inline void swapRemove(size_t i) {
+		const auto last = size() - 1;
+		minx[i] = minx[last];
+		miny[i] = miny[last];
+		maxx[i] = maxx[last];
+		maxy[i] = maxy[last];
+		typeMasks[i] = typeMasks[last];
+		types[i] = types[last];
+		shapes[i] = shapes[last];
+		minx.pop_back();
+		miny.pop_back();
+		maxx.pop_back();
+		maxy.pop_back();
+		typeMasks.pop_back();
+		types.pop_back();
+		shapes.pop_back();
+	}
+	inline AABB bounds(size_t i) const {
+		return AABB(minx[i], miny[i], maxx[i], maxy[i]);
+	}
+	//Every leaf test starts here
+	inline bool matches(size_t i, size_t mask) const {
+		SbCountStat(candidates, 1);
+		return (typeMasks[i] & mask) != 0;
+	}
+	inline bool overlaps(size_t i, const AABB& b) const {
+		return minx[i] <= b.maxx && b.minx <= maxx[i] && miny[i] <= b.maxy && b.miny <= maxy[i];
+	}
+	inline bool containsPoint(size_t i, const Vec2& pt) const {
+		return pt.x >= minx[i] && pt.x <= maxx[i] && pt.y >= miny[i] && pt.y <= maxy[i];
+	}
+	//A rect is its own bounds, so a point in them hits it without a narrowphase
+	inline bool pick(size_t i, const Vec2& pt) const {
+		if (!containsPoint(i, pt))
+			return false;
+		if (types[i] != ShapeType::Rect)
+			SbCountStat(narrowphaseTests, 1);
+		if (types[i] == ShapeType::circle)
+			return Intersection::test(shapes[i]->circle(), pt);
+		if (types[i] == ShapeType::Polygon)
+			return Intersection::test(shapes[i]->Polygon(), pt);
+		return true;
+	}
+};
+
+//A transform queued between beginUpdate and endUpdate
+struct PendingMove {
+	Shape* shape;
+	Matrix3x3 transform;
+	//where the shape was right before the transform, for the AABB tree's displacement
+	Vec2 oldCenter;
+};
+
+//A grid record that changed cells in an update
+struct CellMove {
+	uint32_t record;
+	uint32_t level;
+	CellRange cells;
+	inline bool operator<(const CellMove& other) const {
+		if (level != other.level)
+			return level < other.level;
+		if (cells.miny != other.cells.miny)
+			return cells.miny < other.cells.miny;
+		if (cells.minx != other.cells.minx)
+			return cells.minx < other.cells.minx;
+		return record < other.record;
+	}
+};
+
+//The cells of one size in the dynamic grid
+struct GridLevel {
+	HashGrid cells;
+	float cellSize;
+};
+
+//A dynamic shape in the sweep and prune list, with the bounds and masks it had on the last sweep
+struct SweepEntry {
+	float minx, maxx, miny, maxy;
+	size_t typeMask;
+	size_t collisionMask;
+	Shape* shape;
+	uint32_t record;
+};
+
+//The static shapes and the tree over them as the queries see them. Never changed once published.
+struct StaticSnapshot {
+	StaticBVH tree;
+	ShapeTable shapes;
+};
 
-class SpatialTreeNode {
+#ifdef SbSpatialTreeStats
+thread_local QueryStats sb::t_queryStats;
+//What the last query finished on this thread did
+static thread_local QueryStats t_lastQueryStats;
+//Queries running on this thread, counting the ones run from visitors
+static thread_local size_t t_queryDepth = 0;
+#endif
+
+//Visit stamps of the dynamic records, one array per nesting level
+struct VisitLevel {
+	std::vector<uint32_t> stamps;
+	uint32_t epoch = 0;
+};
+//a deque doesn't move the outer levels when a nested query adds one
+static thread_local std::deque<VisitLevel> t_visitLevels;
+static thread_local size_t t_visitDepth = 0;
+
+//Shapes spanning several cells are found more than once by a grid query, so the query stamps the records it
+//visits with a new epoch: a record was already seen if its stamp is the current epoch. Stamps are per thread,
+//and a query run from inside a visitor gets a level of its own, so concurrent and nested queries don't clash.
+class VisitedRecords {
 public:
-	//Constructors
-	static SpatialTreeNode* nonTerminal(SpatialTreeNode* side0, SpatialTreeNode* side1) {
-		auto node = new SpatialTreeNode();
-		node->m_side0 = side0;
-		node->m_side1 = side1;
-		node->m_bounds = getUnion(side0->m_bounds, side1->m_bounds);
-		return node;
-	}
-	static SpatialTreeNode* terminal(const std::vector<Shape*>& shapes) {
-		auto node = new SpatialTreeNode();
-		node->m_bounds = computeBounds(shapes);
-		node->m_shapes = shapes;
-		node->m_side0 = nullptr;
-		node->m_side1 = nullptr;
-		return node;
-	}
-	//Accessors
-	const std::vector<Shape*>& shapes() const {
-		return m_shapes;
-	}
-	const SpatialTreeNode* side0() const {
-		return m_side0;
-	}
-	const SpatialTreeNode* side1() const {
-		return m_side1;
-	}
-	const Rect& bounds() const {
-		return m_bounds;
-	}
-	bool isTerminal() const {
-		return m_shapes.size() != 0;
-	}
-	//Destructors
-	~SpatialTreeNode() {
-		if (m_side0)
-			delete m_side0;
-		if (m_side1)
-			delete m_side1;
+	VisitedRecords(size_t recordCount) {
+		if (t_visitDepth == t_visitLevels.size())
+			t_visitLevels.emplace_back();
+		m_level = &t_visitLevels[t_visitDepth];
+		t_visitDepth++;
+		if (m_level->stamps.size() < recordCount)
+			m_level->stamps.resize(recordCount, 0);
+		m_level->epoch++;
+		//the epoch wrapped around, so old stamps could match it
+		if (m_level->epoch == 0) {
+			std::fill(m_level->stamps.begin(), m_level->stamps.end(), 0);
+			m_level->epoch = 1;
+		}
+	}
+	~VisitedRecords() {
+		t_visitDepth--;
+	}
+	VisitedRecords(const VisitedRecords&) = delete;
+	VisitedRecords& operator=(const VisitedRecords&) = delete;
+	//True the first time the query sees the record
+	inline bool firstVisit(uint32_t record) {
+		auto& stamp = m_level->stamps[record];
+		if (stamp == m_level->epoch) {
+			SbCountStat(duplicatesSkipped, 1);
+			return false;
+		}
+		stamp = m_level->epoch;
+		return true;
+	}
+private:
+	VisitLevel* m_level;
+};
+
+//The k nearest shapes found so far, kept as a heap with the farthest on top at the end of the result vector
+class NearestShapes {
+public:
+	NearestShapes(std::vector<ShapeDistance>* result, size_t k, float maxDistance) {
+		m_result = result;
+		m_begin = result->size();
+		m_k = k;
+		m_maxDistance = maxDistance;
+	}
+	//How far the search still has to go
+	inline float reach() const {
+		return count() == m_k ? (*m_result)[m_begin].distance : m_maxDistance;
+	}
+	inline void offer(Shape* s, float distance) {
+		if (distance > reach())
+			return;
+		if (count() == m_k) {
+			if (distance == reach())
+				return;
+			std::pop_heap(m_result->begin() + m_begin, m_result->end(), closer);
+			m_result->pop_back();
+		}
+		m_result->push_back(ShapeDistance(s, distance));
+		std::push_heap(m_result->begin() + m_begin, m_result->end(), closer);
+	}
+	//Leaves the shapes sorted, nearest first
+	void finish() {
+		std::sort_heap(m_result->begin() + m_begin, m_result->end(), closer);
+	}
+private:
+	inline size_t count() const {
+		return m_result->size() - m_begin;
+	}
+	static bool closer(const ShapeDistance& a, const ShapeDistance& b) {
+		return a.distance < b.distance;
+	}
+	std::vector<ShapeDistance>* m_result;
+	size_t m_begin;
+	size_t m_k;
+	float m_maxDistance;
+};
+
+//The corners and outward edge normals of a rect or convex polygon, for the shape cast sweeps and the
+//separating axes of the contact cache
+class ConvexHull {
+public:
+	explicit ConvexHull(Shape* s) {
+		if (s->type() == ShapeType::Rect) {
+			m_polygon = nullptr;
+			for (size_t i = 0; i < 4; i++) {
+				m_corners[i] = s->Rect().point(i);
+				m_normals[i] = s->Rect().normal(i);
+			}
+			m_pointCount = 4;
+			m_edgeCount = 4;
+		}
+		else {
+			m_polygon = &s->Polygon();
+			m_pointCount = m_polygon->pointCount();
+			m_edgeCount = m_polygon->edgeCount();
+		}
+	}
+	ConvexHull(const ConvexHull&) = delete;
+	ConvexHull& operator=(const ConvexHull&) = delete;
+	inline size_t pointCount() const {
+		return m_pointCount;
+	}
+	inline size_t edgeCount() const {
+		return m_edgeCount;
+	}
+	inline Vec2 point(size_t i) const {
+		return m_polygon ? m_polygon->point(i) : m_corners[i];
+	}
+	inline Vec2 normal(size_t i) const {
+		return m_polygon ? m_polygon->normal(i) : m_normals[i];
+	}
+	void project(const Vec2& axis, float* min, float* max) const {
+		*min = std::numeric_limits<float>::max();
+		*max = std::numeric_limits<float>::lowest();
+		for (size_t i = 0; i < m_pointCount; i++) {
+			const auto p = dot(point(i), axis);
+			*min = std::min(*min, p);
+			*max = std::max(*max, p);
+		}
 	}
 private:
-	SpatialTreeNode() {
+	const Polygon* m_polygon;
+	Vec2 m_corners[4];
+	Vec2 m_normals[4];
+	size_t m_pointCount;
+	size_t m_edgeCount;
+};
+
+//A pair in the contact cache, in address order so either bodyA gives the same key
+struct ContactKey {
+	Shape* a;
+	Shape* b;
+	ContactKey(Shape* bodyA, Shape* bodyB) {
+		a = std::min(bodyA, bodyB);
+		b = std::max(bodyA, bodyB);
+	}
+	inline bool operator==(const ContactKey& other) const {
+		return a == other.a && b == other.b;
 	}
-	SpatialTreeNode* m_side0;
-	SpatialTreeNode* m_side1;
-	std::vector<Shape*> m_shapes;
-	Rect m_bounds;
 };
 
-enum class RayCastStaticTest {
-	none,
-	onlyA,
-	onlyB,
-	both,
-	aAfterB,
-	bAfterA
+struct ContactKeyHash {
+	inline size_t operator()(const ContactKey& k) const {
+		return std::hash<Shape*>()(k.a) ^ (std::hash<Shape*>()(k.b) * (size_t)0x9e3779b97f4a7c15ULL);
+	}
+};
+
+//What updateContacts found for a pair the last time it looked
+struct CachedContact {
+	ExIntersectionInfo info;
+	//moveCount of both shapes when info was worked out
+	uint32_t movesA;
+	uint32_t movesB;
+	//When the shapes were apart, an axis they didn't overlap on
+	bool hasAxis;
+	Vec2 axis;
+	//Last updateContacts that saw the pair
+	uint32_t frame;
 };
 
 class SpatialTree_implementation {
 public:
 	//Constructor
-	SpatialTree_implementation(SpatialTree* parent) {
-		m_staticTree = nullptr;
+	SpatialTree_implementation(SpatialTree* parent, DynamicStructure ds) {
 		m_staticDirty = true;
+		m_staticPending = false;
+		m_updating = false;
+		m_contactFrame = 0;
+		m_staticSnapshot = std::make_shared<const StaticSnapshot>();
 		m_parent = parent;
+		m_dynamicStructure = ds;
+		if (ds == DynamicStructure::hierarchicalGrid) {
+			m_gridLevelCount = SbHGridLevelCount;
+			for (uint32_t i = 0; i < m_gridLevelCount; i++)
+				m_gridLevels[i].cellSize = ldexpf(SbHGridBaseCellSize, (int)i);
+		}
+		else {
+			m_gridLevelCount = 1;
+			m_gridLevels[0].cellSize = SbCellSize;
+		}
 	}
 	//Destructor
 	~SpatialTree_implementation() {
-		if (m_staticTree)
-			delete m_staticTree;
 	}
 	//Static Tree
+	//Writers change the shapes and the working tree, then mark them pending. The first query after that (or
+	//buildStatic) publishes a copy for the readers, which never see the working tree.
 	void addStaticNode(Shape* s) {
 		assert(s);
 		assert(!s->parent());
-		m_staticShapes.insert(s);
+		std::lock_guard<std::mutex> lock(m_staticMutex);
+		prepareForQueries(s);
+		s->setProxy(m_staticShapes.size());
+		m_staticShapes.push(s);
 		s->setParent(m_parent);
 		s->setDynamic(false);
-		m_staticDirty = true;
+		//once the tree is built, shapes go in one by one until it gets worse enough to be rebuilt
+		if (!m_staticDirty) {
+			const auto primitive = m_staticTree.insert(m_staticShapes.bounds(s->proxy()), s->typeMask());
+			assert(primitive == s->proxy());
+			(void)primitive;
+			m_staticDirty = m_staticTree.needsRebuild();
+		}
+		m_staticPending.store(true, std::memory_order_release);
 	}
 	void removeStaticNode(Shape* s) {
 		assert(s);
 		assert(s->parent() == m_parent);
 		assert(!s->isDynamic());
-		m_staticShapes.erase(s);
+		forgetContacts(s);
+		std::lock_guard<std::mutex> lock(m_staticMutex);
+		const auto index = s->proxy();
+		assert(index < m_staticShapes.size() && m_staticShapes.shapes[index] == s);
+		m_staticShapes.swapRemove(index);
+		if (index < m_staticShapes.size())
+			m_staticShapes.shapes[index]->setProxy(index);
+		s->setProxy(std::numeric_limits<size_t>::max());
 		s->setParent(nullptr);
 		s->setDynamic(false);
-		m_staticDirty = true;
+		//the tree renumbers its primitives the same way we just did
+		if (!m_staticDirty) {
+			m_staticTree.remove((uint32_t)index);
+			m_staticDirty = m_staticTree.needsRebuild();
+		}
+		m_staticPending.store(true, std::memory_order_release);
 	}
-	void rebuildStaticTree() const {
-		if (!m_staticDirty)
+	//Masks
+	void typeMaskChanged(Shape* s) {
+		if (!s->isDynamic()) {
+			std::lock_guard<std::mutex> lock(m_staticMutex);
+			m_staticShapes.typeMasks[s->proxy()] = s->typeMask();
+			//a dirty tree is rebuilt with the new masks anyway
+			if (!m_staticDirty)
+				m_staticTree.setMask((uint32_t)s->proxy(), s->typeMask());
+			m_staticPending.store(true, std::memory_order_release);
 			return;
-		std::vector<Shape*> shapes;
-		for (auto& s : m_staticShapes)
-			shapes.push_back(s);
-
-		if (m_staticTree)
-			delete m_staticTree;
-		if (shapes.size() == 0) {
-			m_staticTree = nullptr;
-			m_staticDirty = false;
+		}
+		m_dynamicShapes.typeMasks[s->proxy()] = s->typeMask();
+		if (m_dynamicStructure == DynamicStructure::aabbTree)
 			return;
+		const auto& record = m_dynamicRecords[s->proxy()];
+		m_gridLevels[record.level].cells.addMask(record.cells, s->typeMask());
+	}
+	//The latest published snapshot. Lock free unless a writer changed the shapes since the last one.
+	std::shared_ptr<const StaticSnapshot> staticSnapshot() const {
+		if (m_staticPending.load(std::memory_order_acquire))
+			publishStaticSnapshot();
+		return std::atomic_load(&m_staticSnapshot);
+	}
+	void publishStaticSnapshot() const {
+		std::lock_guard<std::mutex> lock(m_staticMutex);
+		//another reader got here first
+		if (!m_staticPending.load(std::memory_order_relaxed))
+			return;
+		if (m_staticDirty) {
+			m_staticBounds.clear();
+			for (size_t i = 0; i < m_staticShapes.size(); i++)
+				m_staticBounds.push_back(m_staticShapes.bounds(i));
+			m_staticTree.build(m_staticBounds.data(), m_staticShapes.typeMasks.data(), m_staticBounds.size());
+			m_staticDirty = false;
 		}
-		m_staticTree = partition(shapes);
-		m_staticDirty = false;
+		auto snapshot = std::make_shared<StaticSnapshot>();
+		snapshot->tree = m_staticTree;
+		snapshot->shapes = m_staticShapes;
+		//readers still walking the old snapshot keep it alive until they're done
+		std::atomic_store(&m_staticSnapshot, std::shared_ptr<const StaticSnapshot>(std::move(snapshot)));
+		m_staticPending.store(false, std::memory_order_release);
 	}
-	RayCastResult staticRayCast(const Ray& r, size_t mask) const {
+	RayCastResult staticRayCast(const StaticSnapshot& snapshot, const Ray& r, size_t mask) const {
 		if (aeq(r.direction(), Vec2::zero))
 			return RayCastResult(); //no Intersection
 
-		rebuildStaticTree();
-		if (!m_staticTree)
+		if (snapshot.tree.isEmpty())
 			return RayCastResult();
-		return staticRayCast(r, mask, m_staticTree);
-	}
-	void staticRangeQuery(RangeQueryResult* result, const Rect& r, size_t mask) const {
-		return staticRangeQuery(result, r, mask, nullptr);
+		RayCastResult res;
+		auto callback = [&](uint32_t index, float t) {
+			if (!snapshot.shapes.matches(index, mask))
+				return t;
+			return closerHit(r, snapshot.shapes.shapes[index], t, &res);
+		};
+		snapshot.tree.rayCast(r.point(), r.direction().normalized(), std::numeric_limits<float>::max(), callback, mask);
+		return res;
 	}
-	void staticRangeQuery(RangeQueryResult* result, const Rect& r, size_t mask, Shape* exclude) const {
-		rebuildStaticTree();
-		if (!m_staticTree)
+	//Casts up to SbRayPacketSize rays through the static tree together. Rays that can't share a packet are
+	//cast one by one.
+	void staticRayCastPacket(const StaticSnapshot& snapshot, const Ray* rays, size_t count, size_t mask, RayCastResult* results) const {
+		assert(count <= SbRayPacketSize);
+		RayPacket packet;
+		Vec2 directions[SbRayPacketSize];
+		bool coherent = count > 1;
+		for (size_t i = 0; i < count && coherent; i++) {
+			if (aeq(rays[i].direction(), Vec2::zero))
+				coherent = false;
+			directions[i] = rays[i].direction().normalized();
+			coherent = coherent && directions[i].x != 0 && directions[i].y != 0 &&
+				(directions[i].x < 0) == (directions[0].x < 0) && (directions[i].y < 0) == (directions[0].y < 0);
+		}
+		if (!coherent || snapshot.tree.isEmpty()) {
+			for (size_t i = 0; i < count; i++)
+				results[i] = staticRayCast(snapshot, rays[i], mask);
 			return;
-		staticRangeQuery(r, mask, exclude, m_staticTree, *result);
+		}
+		uint32_t lanes = 0;
+		for (size_t i = 0; i < SbRayPacketSize; i++) {
+			//unused lanes repeat the first ray and are left out of lanes
+			const auto k = i < count ? i : 0;
+			packet.originX[i] = rays[k].point().x;
+			packet.originY[i] = rays[k].point().y;
+			packet.invDirectionX[i] = 1.0f / directions[k].x;
+			packet.invDirectionY[i] = 1.0f / directions[k].y;
+			packet.maxT[i] = std::numeric_limits<float>::max();
+			if (i < count) {
+				results[i] = RayCastResult();
+				lanes |= 1 << i;
+			}
+		}
+		packet.negative[0] = directions[0].x < 0;
+		packet.negative[1] = directions[0].y < 0;
+		auto callback = [&](uint32_t lane, uint32_t index, float t) {
+			if (!snapshot.shapes.matches(index, mask))
+				return t;
+			return closerHit(rays[lane], snapshot.shapes.shapes[index], t, &results[lane]);
+		};
+		snapshot.tree.rayCast(packet, lanes, callback, mask);
 	}
-	void staticPickQuery(RangeQueryResult* result, const Vec2& pt, size_t mask) const {
-		rebuildStaticTree();
-		if (!m_staticTree)
-			return;
-		staticPickQuery(pt, mask, m_staticTree, *result);
+	//Visitors return false to stop the query; so do these functions when the visitor stopped
+	template<class F>
+	bool staticRangeQuery(const StaticSnapshot& snapshot, const Rect& r, size_t mask, Shape* exclude, F& visitor) const {
+		bool completed = true;
+		const auto range = AABB(r);
+		const auto& shapes = snapshot.shapes;
+		auto callback = [&](uint32_t index) {
+			if (!shapes.matches(index, mask) || !shapes.overlaps(index, range))
+				return true;
+			if (exclude && shapes.shapes[index] == exclude)
+				return true;
+			if (!visitor(shapes.shapes[index]))
+				completed = false;
+			return completed;
+		};
+		snapshot.tree.query(range, callback, mask);
+		return completed;
+	}
+	template<class F>
+	bool staticPickQuery(const StaticSnapshot& snapshot, const Vec2& pt, size_t mask, F& visitor) const {
+		bool completed = true;
+		const auto& shapes = snapshot.shapes;
+		auto callback = [&](uint32_t index) {
+			if (!shapes.matches(index, mask))
+				return true;
+			if (shapes.pick(index, pt) && !visitor(shapes.shapes[index]))
+				completed = false;
+			return completed;
+		};
+		snapshot.tree.query(pt, callback, mask);
+		return completed;
 	}
 	//Dynamic Tree
+	DynamicStructure dynamicStructure() const {
+		return m_dynamicStructure;
+	}
 	void addDynamicNode(Shape* s) {
 		assert(s);
 		assert(!s->parent());
+		prepareForQueries(s);
 		addToDynamicTable(s);
 		s->setParent(m_parent);
 		s->setDynamic(true);
+		//the next sweep sorts it into place
+		SweepEntry e;
+		e.minx = e.maxx = e.miny = e.maxy = std::numeric_limits<float>::max();
+		e.typeMask = e.collisionMask = 0;
+		e.shape = s;
+		e.record = (uint32_t)s->proxy();
+		m_sweepEntries.push_back(e);
 	}
 	void removeDynamicNode(Shape* s) {
 		assert(s);
 		assert(s->parent() == m_parent);
 		assert(s->isDynamic());
+		forgetContacts(s);
+		if (m_updating) {
+			m_pendingMoves.erase(std::remove_if(m_pendingMoves.begin(), m_pendingMoves.end(), [s](const PendingMove& move) {
+				return move.shape == s;
+			}), m_pendingMoves.end());
+		}
 		removeFromDynamicTable(s);
+		//erasing keeps the rest of the list sorted
+		auto it = std::find_if(m_sweepEntries.begin(), m_sweepEntries.end(), [s](const SweepEntry& e) {
+			return e.shape == s;
+		});
+		assert(it != m_sweepEntries.end());
+		m_sweepEntries.erase(it);
 		s->setParent(nullptr);
 		s->setDynamic(false);
 	}
@@ -179,27 +589,676 @@ public:
 		assert(s);
 		assert(s->parent() == m_parent);
 		assert(s->isDynamic());
-		removeFromDynamicTable(s);
+		if (m_updating) {
+			PendingMove move;
+			move.shape = s;
+			move.transform = m;
+			m_pendingMoves.push_back(move);
+			return;
+		}
+		const auto index = (uint32_t)s->proxy();
+		const auto oldCenter = m_dynamicShapes.bounds(index).center();
 		s->applyTransform(m);
-		addToDynamicTable(s);
+		prepareForQueries(s);
+		m_dynamicShapes.setBounds(index, s->bounds());
+		if (m_dynamicStructure == DynamicStructure::aabbTree) {
+			//nothing happens to the tree while the shape stays inside its fat box
+			const auto b = m_dynamicShapes.bounds(index);
+			m_dynamicTree.moveProxy(m_dynamicRecords[index].treeProxy, b, b.center() - oldCenter);
+			return;
+		}
+		moveInDynamicTable(index);
+	}
+	//Batched Updates
+	void beginUpdate() {
+		assert(!m_updating);
+		m_updating = true;
+	}
+	void endUpdate(bool parallel) {
+		assert(m_updating);
+		m_updating = false;
+		applyPendingMoves(parallel);
+		if (m_dynamicStructure == DynamicStructure::aabbTree) {
+			for (auto& move : m_pendingMoves) {
+				const auto index = (uint32_t)move.shape->proxy();
+				const auto b = m_dynamicShapes.bounds(index);
+				m_dynamicTree.moveProxy(m_dynamicRecords[index].treeProxy, b, b.center() - move.oldCenter);
+			}
+		}
+		else
+			rebucketPendingMoves();
+		m_pendingMoves.clear();
+	}
+	//Moves the geometry of the shapes. Threads take the shapes by hash, so a shape moved twice is moved
+	//twice by the same thread, in order.
+	void applyPendingMoves(bool parallel) {
+		size_t tasks = parallel ? std::min((size_t)std::thread::hardware_concurrency(), m_pendingMoves.size() / SbUpdateParallelMinCount) : 1;
+		if (tasks < 2) {
+			applyPendingMoves(0, 1);
+			return;
+		}
+		std::vector<std::future<void>> futures;
+		for (size_t part = 1; part < tasks; part++) {
+			futures.push_back(std::async(std::launch::async, [=]() {
+				applyPendingMoves(part, tasks);
+			}));
+		}
+		applyPendingMoves(0, tasks);
+		for (auto& f : futures)
+			f.get();
+	}
+	void applyPendingMoves(size_t part, size_t parts) {
+		std::hash<Shape*> hash;
+		for (auto& move : m_pendingMoves) {
+			if (parts > 1 && hash(move.shape) % parts != part)
+				continue;
+			//each thread writes the rows of its own shapes only
+			const auto index = move.shape->proxy();
+			move.oldCenter = m_dynamicShapes.bounds(index).center();
+			move.shape->applyTransform(move.transform);
+			prepareForQueries(move.shape);
+			m_dynamicShapes.setBounds(index, move.shape->bounds());
+		}
+	}
+	//Only the records that left their cells are moved, sorted by their new cells so the hash grid is walked
+	//in order instead of at random
+	void rebucketPendingMoves() {
+		m_cellMoves.clear();
+		for (auto& move : m_pendingMoves) {
+			const auto index = (uint32_t)move.shape->proxy();
+			assert(index < m_dynamicRecords.size());
+			const auto& record = m_dynamicRecords[index];
+			const auto b = m_dynamicShapes.bounds(index).toRect();
+			CellMove cm;
+			cm.record = index;
+			cm.level = levelFor(b);
+			cm.cells = cellRange(b, m_gridLevels[cm.level].cellSize);
+			if (cm.level != record.level || cm.cells != record.cells)
+				m_cellMoves.push_back(cm);
+		}
+		std::sort(m_cellMoves.begin(), m_cellMoves.end());
+		for (auto& cm : m_cellMoves)
+			moveRecord(cm.record, cm.level, cm.cells);
+	}
+	//The dynamic shapes are only searched up to the static hit
+	RayCastResult closerDynamicHit(const Ray& r, size_t mask, const RayCastResult& staticResult) const {
+		Option<float> sqrdLen = nullptr;
+		if (!staticResult.empty)
+			sqrdLen = (staticResult.point - r.point()).squaredLength();
+
+		RayCastResult rc = dynamicRayCast(r, mask, sqrdLen);
+		if (staticResult.empty || (!rc.empty && rc.parameter < staticResult.parameter))
+			return rc;
+		return staticResult;
 	}
 	RayCastResult dynamicRayCast(const Ray& r, size_t mask, const Option<float>& maxSqrdLen) const {
 		if (aeq(r.direction(), Vec2::zero))
 			return RayCastResult(); //no Intersection
 
-		return internalDynamicRayCast(r, mask, maxSqrdLen);
+		if (m_dynamicStructure == DynamicStructure::aabbTree)
+			return treeRayCast(r, mask, maxSqrdLen);
+		return gridRayCast(r, mask, maxSqrdLen);
+	}
+	template<class F>
+	bool dynamicRangeQuery(const Rect& r, size_t mask, Shape* exclude, F& visitor) const {
+		if (m_dynamicStructure == DynamicStructure::aabbTree)
+			return treeRangeQuery(r, mask, exclude, visitor);
+		return gridRangeQuery(r, mask, exclude, visitor);
+	}
+	template<class F>
+	bool dynamicPickQuery(const Vec2& pt, size_t mask, F& visitor) const {
+		if (m_dynamicStructure == DynamicStructure::aabbTree)
+			return treePickQuery(pt, mask, visitor);
+		return gridPickQuery(pt, mask, visitor);
+	}
+	//Both
+	template<class F>
+	void rangeQuery(const Rect& r, size_t mask, StaticDynamicMask sdFilter, Shape* exclude, F& visitor) const {
+		if ((sdFilter & sdmDynamic) && !dynamicRangeQuery(r, mask, exclude, visitor))
+			return;
+		if (sdFilter & sdmStatic)
+			staticRangeQuery(*staticSnapshot(), r, mask, exclude, visitor);
+	}
+	template<class F>
+	void pickQuery(const Vec2& pt, size_t mask, StaticDynamicMask sdFilter, F& visitor) const {
+		if ((sdFilter & sdmDynamic) && !dynamicPickQuery(pt, mask, visitor))
+			return;
+		if (sdFilter & sdmStatic)
+			staticPickQuery(*staticSnapshot(), pt, mask, visitor);
+	}
+	template<class F>
+	bool intersectionQuery(Shape* bodyA, StaticDynamicMask sdFilter, F& visitor) const {
+		bool completed = true;
+		auto narrowphase = [&](Shape* bodyB) {
+			ExIntersectionInfo ei;
+			testIntersection(&ei, bodyA, bodyB);
+			if (ei.empty)
+				return true;
+			completed = visitor(ei);
+			return completed;
+		};
+		rangeQuery(bodyA->bounds(), bodyA->collisionMask(), sdFilter, bodyA, narrowphase);
+		return completed;
+	}
+	//Ray Casts
+	RayCastResult rayCast(const Ray& r, size_t mask, StaticDynamicMask sdFilter) const {
+		RayCastResult rc;
+		if (sdFilter & sdmStatic)
+			rc = staticRayCast(*staticSnapshot(), r, mask);
+		if (sdFilter & sdmDynamic)
+			rc = closerDynamicHit(r, mask, rc);
+		return rc;
+	}
+	void rayCastBatch(const Ray* rays, size_t count, size_t mask, StaticDynamicMask sdFilter, RayCastResult* results) const {
+		std::shared_ptr<const StaticSnapshot> snapshot;
+		if (sdFilter & sdmStatic)
+			snapshot = staticSnapshot();
+		for (size_t i = 0; i < count; i += SbRayPacketSize) {
+			const auto n = std::min(count - i, (size_t)SbRayPacketSize);
+			if (snapshot)
+				staticRayCastPacket(*snapshot, rays + i, n, mask, results + i);
+			else
+				std::fill(results + i, results + i + n, RayCastResult());
+			if (sdFilter & sdmDynamic) {
+				for (size_t j = i; j < i + n; j++)
+					results[j] = closerDynamicHit(rays[j], mask, results[j]);
+			}
+		}
+	}
+	//Splits the batch in runs of whole packets, one per thread
+	void parallelRayCastBatch(const Ray* rays, size_t count, size_t mask, StaticDynamicMask sdFilter, RayCastResult* results) const {
+		size_t tasks = std::min((size_t)std::thread::hardware_concurrency(), count / SbRayBatchParallelMinCount);
+		if (tasks < 2) {
+			rayCastBatch(rays, count, mask, sdFilter, results);
+			return;
+		}
+		auto run = (count + tasks - 1) / tasks;
+		run = (run + SbRayPacketSize - 1) / SbRayPacketSize * SbRayPacketSize;
+		std::vector<std::future<QueryStats>> futures;
+		for (size_t begin = run; begin < count; begin += run) {
+			const auto n = std::min(run, count - begin);
+			futures.push_back(std::async(std::launch::async, [=]() {
+				//the helper thread counts from zero and hands its counters to this one
+				takeThreadStats();
+				rayCastBatch(rays + begin, n, mask, sdFilter, results + begin);
+				return takeThreadStats();
+			}));
+		}
+		rayCastBatch(rays, std::min(run, count), mask, sdFilter, results);
+		for (auto& f : futures)
+			addThreadStats(f.get());
+	}
+	//Statistics
+	void addQueryStats(const QueryStats& stats) const {
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		m_totalStats += stats;
+	}
+	QueryStats totalQueryStats() const {
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		return m_totalStats;
+	}
+	void resetQueryStats() {
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		m_totalStats.clear();
+	}
+	//Counters of the calling thread, cleared
+	static QueryStats takeThreadStats() {
+#ifdef SbSpatialTreeStats
+		const auto stats = t_queryStats;
+		t_queryStats.clear();
+		return stats;
+#else
+		return QueryStats();
+#endif
+	}
+	static void addThreadStats(const QueryStats& stats) {
+#ifdef SbSpatialTreeStats
+		t_queryStats += stats;
+#else
+		(void)stats;
+#endif
+	}
+	StructureStats structureStats() const {
+		StructureStats stats;
+		auto snapshot = staticSnapshot();
+		const auto& tree = snapshot->tree;
+		stats.staticShapes = snapshot->shapes.size();
+		stats.staticNodes = tree.nodeCount();
+		stats.staticDepth = tree.depth();
+		for (const auto& node : tree.nodes()) {
+			if (!node.isLeaf())
+				continue;
+			if (stats.staticLeafOccupancy.size() <= node.count)
+				stats.staticLeafOccupancy.resize(node.count + 1, 0);
+			stats.staticLeafOccupancy[node.count]++;
+		}
+		stats.dynamicRecords = m_dynamicRecords.size();
+		stats.dynamicShapes = m_dynamicRecords.size() - m_freeDynamicRecords.size();
+		if (stats.dynamicRecords != 0)
+			stats.dynamicTableLoadFactor = (float)stats.dynamicShapes / (float)stats.dynamicRecords;
+		if (m_dynamicStructure == DynamicStructure::aabbTree) {
+			stats.dynamicTreeHeight = m_dynamicTree.height();
+			return stats;
+		}
+		size_t entries = 0;
+		size_t slots = 0;
+		auto callback = [&](int32_t, int32_t, const HashGrid::ItemList& items) {
+			if (stats.cellOccupancy.size() <= items.size())
+				stats.cellOccupancy.resize(items.size() + 1, 0);
+			stats.cellOccupancy[items.size()]++;
+		};
+		for (uint32_t level = 0; level < m_gridLevelCount; level++) {
+			const auto& cells = m_gridLevels[level].cells;
+			stats.occupiedCells += cells.cellCount();
+			entries += cells.entryCount();
+			slots += cells.slotCount();
+			cells.forEachCell(callback);
+		}
+		if (stats.dynamicShapes != 0)
+			stats.cellsPerShape = (float)entries / (float)stats.dynamicShapes;
+		if (slots != 0)
+			stats.cellTableLoadFactor = (float)stats.occupiedCells / (float)slots;
+		return stats;
 	}
-	void dynamicRangeQuery(RangeQueryResult* result, const Rect& r, size_t mask, Shape* exclude) const {
-		dynamicRangeQuery(r, mask, exclude, *result);
+	//All Pairs
+	//Dynamic pairs come from a sweep and prune on x. The entries stay sorted from the previous sweep, so the
+	//insertion sort only moves the shapes that passed one another since then. Each dynamic shape then finds
+	//its static pairs in the static tree.
+	template<class F>
+	void allPairs(StaticDynamicMask sdFilter, F& visitor) const {
+		auto narrowphase = [&](Shape* bodyA, Shape* bodyB) {
+			ExIntersectionInfo ei;
+			testIntersection(&ei, bodyA, bodyB);
+			return ei.empty || visitor(ei);
+		};
+		candidatePairs(sdFilter, narrowphase);
+	}
+	//visitor(bodyA, bodyB) gets every pair whose bounds overlap and where bodyA collides with bodyB
+	template<class F>
+	void candidatePairs(StaticDynamicMask sdFilter, F& visitor) const {
+		//the sweep list is shared by every call
+		std::lock_guard<std::mutex> lock(m_sweepMutex);
+		auto& entries = m_sweepEntries;
+		for (auto& e : entries) {
+			e.minx = m_dynamicShapes.minx[e.record];
+			e.maxx = m_dynamicShapes.maxx[e.record];
+			e.miny = m_dynamicShapes.miny[e.record];
+			e.maxy = m_dynamicShapes.maxy[e.record];
+			e.typeMask = m_dynamicShapes.typeMasks[e.record];
+			e.collisionMask = e.shape->collisionMask();
+		}
+		for (size_t i = 1; i < entries.size(); i++) {
+			const auto e = entries[i];
+			auto j = i;
+			for (; j > 0 && entries[j - 1].minx > e.minx; j--)
+				entries[j] = entries[j - 1];
+			entries[j] = e;
+		}
+
+		if (sdFilter & sdmDynamic) {
+			for (size_t i = 0; i < entries.size(); i++) {
+				const auto& a = entries[i];
+				for (size_t j = i + 1; j < entries.size() && entries[j].minx <= a.maxx; j++) {
+					const auto& b = entries[j];
+					if (b.miny > a.maxy || a.miny > b.maxy)
+						continue;
+					//bodyA is the one that collides with the other, as in intersectionQuery
+					bool completed;
+					if (a.collisionMask & b.typeMask)
+						completed = visitor(a.shape, b.shape);
+					else if (b.collisionMask & a.typeMask)
+						completed = visitor(b.shape, a.shape);
+					else
+						continue;
+					if (!completed)
+						return;
+				}
+			}
+		}
+		if (sdFilter & sdmStatic) {
+			for (auto& e : entries) {
+				bool completed = true;
+				auto callback = [&](Shape* bodyB) {
+					completed = visitor(e.shape, bodyB);
+					return completed;
+				};
+				rangeQuery(AABB(e.minx, e.miny, e.maxx, e.maxy).toRect(), e.collisionMask, sdmStatic, e.shape, callback);
+				if (!completed)
+					return;
+			}
+		}
+	}
+	//Contacts
+	void updateContacts(StaticDynamicMask sdFilter, std::vector<ContactEvent>* result) {
+		std::lock_guard<std::mutex> lock(m_contactMutex);
+		m_contactFrame++;
+		auto visitor = [&](Shape* bodyA, Shape* bodyB) {
+			auto it = m_contacts.find(ContactKey(bodyA, bodyB));
+			if (it == m_contacts.end()) {
+				CachedContact c;
+				c.info.bodyA = bodyA;
+				c.info.bodyB = bodyB;
+				c.movesA = c.movesB = 0;
+				c.hasAxis = false;
+				c.frame = 0;
+				it = m_contacts.emplace(ContactKey(bodyA, bodyB), c).first;
+			}
+			auto& c = it->second;
+			const auto touched = c.frame != 0 && !c.info.empty;
+			const auto moved = c.frame == 0 || c.info.bodyA != bodyA ||
+				c.movesA != bodyA->moveCount() || c.movesB != bodyB->moveCount();
+			if (moved && !(c.hasAxis && separatedAlong(bodyA, bodyB, c.axis))) {
+				testIntersection(&c.info, bodyA, bodyB);
+				c.hasAxis = c.info.empty && separatingAxis(bodyA, bodyB, &c.axis);
+			}
+			c.movesA = bodyA->moveCount();
+			c.movesB = bodyB->moveCount();
+			c.frame = m_contactFrame;
+			if (!c.info.empty)
+				result->push_back(ContactEvent(touched ? ContactState::persist : ContactState::begin, c.info));
+			else if (touched)
+				result->push_back(ContactEvent(ContactState::end, c.info));
+			return true;
+		};
+		candidatePairs(sdFilter, visitor);
+		//pairs the broadphase no longer gave
+		for (auto it = m_contacts.begin(); it != m_contacts.end();) {
+			if (it->second.frame == m_contactFrame) {
+				++it;
+				continue;
+			}
+			if (!it->second.info.empty) {
+				auto ei = it->second.info;
+				ei.empty = true;
+				result->push_back(ContactEvent(ContactState::end, ei));
+			}
+			it = m_contacts.erase(it);
+		}
+	}
+	void forgetContacts(Shape* s) {
+		std::lock_guard<std::mutex> lock(m_contactMutex);
+		for (auto it = m_contacts.begin(); it != m_contacts.end();) {
+			if (it->first.a == s || it->first.b == s)
+				it = m_contacts.erase(it);
+			else
+				++it;
+		}
+	}
+	//Nearest
+	//Dynamic shapes go first, so the static tree starts with a shorter reach
+	void nearestQuery(const Vec2& pt, size_t mask, StaticDynamicMask sdFilter, NearestShapes& nearest) const {
+		if (sdFilter & sdmDynamic) {
+			if (m_dynamicStructure == DynamicStructure::aabbTree)
+				treeNearest(pt, mask, nearest);
+			else
+				gridNearest(pt, mask, nearest);
+		}
+		if (sdFilter & sdmStatic)
+			staticNearest(*staticSnapshot(), pt, mask, nearest);
+		nearest.finish();
 	}
-	void dynamicRangeQuery(RangeQueryResult* result, const Rect& r, size_t mask) const {
-		dynamicRangeQuery(result, r, mask, nullptr);
+	void staticNearest(const StaticSnapshot& snapshot, const Vec2& pt, size_t mask, NearestShapes& nearest) const {
+		auto callback = [&](uint32_t index, float) {
+			if (snapshot.shapes.matches(index, mask))
+				offerNearest(snapshot.shapes, index, pt, nearest);
+			return nearest.reach();
+		};
+		snapshot.tree.nearest(pt, nearest.reach(), callback, mask);
 	}
-	void dynamicPickQuery(RangeQueryResult* result, const Vec2& pt, size_t mask) const {
-		dynamicPickQuery(pt, mask, *result);
+	//Shape Cast
+	ShapeCastResult shapeCast(Shape* s, const Vec2& d, size_t mask, StaticDynamicMask sdFilter) const {
+		ShapeCastResult res;
+		const auto from = AABB(s->bounds());
+		auto swept = from;
+		swept.merge(AABB(from.minx + d.x, from.miny + d.y, from.maxx + d.x, from.maxy + d.y));
+		auto narrowphase = [&](Shape* other) {
+			//boxes that only meet after the best hit so far can't give a closer one
+			const auto limit = res.empty ? 1.0f : res.time;
+			if (boundsSweepTime(from, d, AABB(other->bounds())) > limit)
+				return true;
+			float t;
+			Vec2 n;
+			if (sweep(s, d, other, &t, &n) && t <= limit && (res.empty || t < res.time))
+				res = ShapeCastResult(other, n, t);
+			//nothing gets closer than touching already
+			return res.empty || res.time > 0;
+		};
+		rangeQuery(swept.toRect(), mask, sdFilter, s, narrowphase);
+		return res;
 	}
 	//utility
-	void testIntersection(ExIntersectionInfo* ei, Shape* bodyA, Shape* bodyB) {
+	//Time in [0, 1] when box a moving by d starts overlapping b, past 1 when it doesn't
+	static float boundsSweepTime(const AABB& a, const Vec2& d, const AABB& b) {
+		float enter = 0;
+		float exit = 1;
+		if (!axisSweepTime(a.minx, a.maxx, d.x, b.minx, b.maxx, &enter, &exit) ||
+			!axisSweepTime(a.miny, a.maxy, d.y, b.miny, b.maxy, &enter, &exit))
+			return 2;
+		return enter;
+	}
+	//Narrows [enter, exit] to when interval a moving by v overlaps b. False when they never do in it.
+	static bool axisSweepTime(float amin, float amax, float v, float bmin, float bmax, float* enter, float* exit) {
+		if (v == 0) {
+			if (amax < bmin || bmax < amin)
+				return false;
+			return *enter <= *exit;
+		}
+		auto t0 = (bmin - amax) / v;
+		auto t1 = (bmax - amin) / v;
+		if (t0 > t1)
+			std::swap(t0, t1);
+		*enter = std::max(*enter, t0);
+		*exit = std::min(*exit, t1);
+		return *enter <= *exit;
+	}
+	//Time of impact and normal of a moving by d against b
+	static bool sweep(Shape* a, const Vec2& d, Shape* b, float* t, Vec2* normal) {
+		ExIntersectionInfo ei;
+		testIntersection(&ei, a, b);
+		if (!ei.empty) {
+			*t = 0;
+			*normal = ei.normal;
+			return true;
+		}
+		if (d.isZero())
+			return false;
+		if (a->type() == ShapeType::circle) {
+			const auto& c = a->circle();
+			if (b->type() == ShapeType::circle)
+				return sweepCircle(c.center(), c.radius() + b->circle().radius(), d, b->circle().center(), t, normal);
+			return sweepCircle(c.center(), c.radius(), d, ConvexHull(b), t, normal);
+		}
+		if (b->type() == ShapeType::circle) {
+			//the same as the circle moving the other way, seen from the circle
+			const auto& c = b->circle();
+			if (!sweepCircle(c.center(), c.radius(), -d, ConvexHull(a), t, normal))
+				return false;
+			*normal = -*normal;
+			return true;
+		}
+		return sweepHulls(ConvexHull(a), d, ConvexHull(b), t, normal);
+	}
+	//Circle of radius r at p moving by d against a circle of the same radius at center, which is a ray against it
+	static bool sweepCircle(const Vec2& p, float r, const Vec2& d, const Vec2& center, float* t, Vec2* normal) {
+		const auto m = p - center;
+		const auto a = dot(d, d);
+		const auto b = dot(m, d);
+		const auto c = dot(m, m) - r * r;
+		//moving away, or never close enough
+		if (b >= 0 || a == 0)
+			return false;
+		const auto disc = b * b - a * c;
+		if (disc < 0)
+			return false;
+		const auto u = std::max((-b - sqrtf(disc)) / a, 0.0f);
+		if (u > 1)
+			return false;
+		*t = u;
+		*normal = (m + d * u).normalized();
+		return true;
+	}
+	//Circle moving by d against a hull: a ray against the hull grown by r, its edges pushed out and its
+	//corners rounded
+	static bool sweepCircle(const Vec2& p, float r, const Vec2& d, const ConvexHull& h, float* t, Vec2* normal) {
+		bool hit = false;
+		float best = 1;
+		for (size_t i = 0; i < h.edgeCount(); i++) {
+			const auto n = h.normal(i);
+			const auto v = dot(d, n);
+			if (v >= 0)
+				continue;
+			const auto a = h.point(i) + n * r;
+			const auto u = dot(a - p, n) / v;
+			if (u < 0 || u > best)
+				continue;
+			const auto edge = h.point((i + 1) % h.pointCount()) - h.point(i);
+			const auto along = dot(p + d * u - a, edge);
+			if (along < 0 || along > dot(edge, edge))
+				continue;
+			hit = true;
+			best = u;
+			*normal = n;
+		}
+		for (size_t i = 0; i < h.pointCount(); i++) {
+			float u;
+			Vec2 n;
+			if (sweepCircle(p, r, d, h.point(i), &u, &n) && u < best) {
+				hit = true;
+				best = u;
+				*normal = n;
+			}
+		}
+		*t = best;
+		return hit;
+	}
+	//Separating axis test with the velocity: the hulls touch when the last of the axes stops separating them
+	static bool sweepHulls(const ConvexHull& a, const Vec2& d, const ConvexHull& b, float* t, Vec2* normal) {
+		float enter = 0;
+		float exit = 1;
+		bool separated = false;
+		for (size_t i = 0; i < a.edgeCount() + b.edgeCount(); i++) {
+			const auto axis = i < a.edgeCount() ? a.normal(i) : b.normal(i - a.edgeCount());
+			float amin, amax, bmin, bmax;
+			a.project(axis, &amin, &amax);
+			b.project(axis, &bmin, &bmax);
+			float axisEnter = 0;
+			float axisExit = 1;
+			if (!axisSweepTime(amin, amax, dot(d, axis), bmin, bmax, &axisEnter, &axisExit))
+				return false;
+			if ((amax < bmin || bmax < amin) && (!separated || axisEnter > enter)) {
+				separated = true;
+				*normal = amax < bmin ? -axis : axis;
+			}
+			enter = std::max(enter, axisEnter);
+			exit = std::min(exit, axisExit);
+			if (enter > exit)
+				return false;
+		}
+		if (!separated)
+			return false;
+		*t = enter;
+		return true;
+	}
+	static void projectShape(Shape* s, const Vec2& axis, float* min, float* max) {
+		if (s->type() == ShapeType::circle) {
+			const auto c = dot(s->circle().center(), axis);
+			*min = c - s->circle().radius();
+			*max = c + s->circle().radius();
+		}
+		else
+			ConvexHull(s).project(axis, min, max);
+	}
+	static bool separatedAlong(Shape* a, Shape* b, const Vec2& axis) {
+		float amin, amax, bmin, bmax;
+		projectShape(a, axis, &amin, &amax);
+		projectShape(b, axis, &bmin, &bmax);
+		return amax < bmin || bmax < amin;
+	}
+	//An axis a and b don't overlap on: one of the edge normals or, for a circle, the way to the other shape
+	static bool separatingAxis(Shape* a, Shape* b, Vec2* axis) {
+		for (auto s : { a, b }) {
+			if (s->type() == ShapeType::circle) {
+				const auto center = s->circle().center();
+				auto other = s == a ? b : a;
+				Vec2 closest;
+				if (other->type() == ShapeType::circle)
+					closest = other->circle().center();
+				else if (other->type() == ShapeType::Rect) {
+					const auto& r = other->Rect();
+					closest = Vec2(clamp(center.x, r.left(), r.right()), clamp(center.y, r.bottom(), r.top()));
+				}
+				else
+					closest = other->Polygon().closestPointFrom(center);
+				const auto v = closest - center;
+				if (!v.isZero() && separatedAlong(a, b, v.normalized())) {
+					*axis = v.normalized();
+					return true;
+				}
+				continue;
+			}
+			ConvexHull h(s);
+			for (size_t i = 0; i < h.edgeCount(); i++) {
+				if (separatedAlong(a, b, h.normal(i))) {
+					*axis = h.normal(i);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+	//Distance from pt to the closest point of s, 0 when pt is inside
+	static float shapeDistance(Shape* s, const Vec2& pt) {
+		SbCountStat(narrowphaseTests, 1);
+		if (s->type() == ShapeType::circle)
+			return std::max(distance(pt, s->circle().center()) - s->circle().radius(), 0.0f);
+		if (s->type() == ShapeType::Rect)
+			return pointDistance(AABB(s->Rect()), pt);
+		if (Intersection::test(s->Polygon(), pt))
+			return 0;
+		return distance(pt, s->Polygon().closestPointFrom(pt));
+	}
+	static Option<Vec2> rayIntersection(const Ray& r, Shape* s) {
+		SbCountStat(narrowphaseTests, 1);
+		if (s->type() == ShapeType::circle)
+			return Intersection::get(r, s->circle());
+		if (s->type() == ShapeType::Rect)
+			return Intersection::get(r, s->Rect());
+		return Intersection::get(r, s->Polygon());
+	}
+	//Polygons work some of their properties out the first time they're asked for. Asking here, on the writer's
+	//thread, keeps concurrent queries from racing to fill them in.
+	static void prepareForQueries(Shape* s) {
+		if (s->type() != ShapeType::Polygon)
+			return;
+		const auto& p = s->Polygon();
+		p.bounds();
+		p.isConvex();
+		p.isSimple();
+		if (p.edgeCount() != 0 && p.ordering() != PointOrdering::unknown)
+			p.normal(0);
+	}
+	//Keeps the hit of r on s in res if it's the closest so far. Returns the new maxT for the tree walks.
+	static float closerHit(const Ray& r, Shape* s, float t, RayCastResult* res) {
+		auto pt = rayIntersection(r, s);
+		if (!pt.hasValue())
+			return t;
+		auto p = r.computeT(pt.value());
+		if (res->empty || p < res->parameter) {
+			res->empty = false;
+			res->intersected = s;
+			res->parameter = p;
+			res->point = pt.value();
+		}
+		//nothing behind this hit can be closer
+		return std::min(t, p);
+	}
+	//The bounds are never farther than the shape, so shapes whose bounds are out of reach aren't measured
+	static void offerNearest(const ShapeTable& shapes, size_t i, const Vec2& pt, NearestShapes& nearest) {
+		if (pointDistance(shapes.bounds(i), pt) <= nearest.reach())
+			nearest.offer(shapes.shapes[i], shapeDistance(shapes.shapes[i], pt));
+	}
+	static void testIntersection(ExIntersectionInfo* ei, Shape* bodyA, Shape* bodyB) {
+		SbCountStat(narrowphaseTests, 1);
 		IntersectionInfo ii;
 		float invert = 1;
 
@@ -265,498 +1324,414 @@ private:
 	//Fields
 	SpatialTree* m_parent;
 	//Static
-	mutable SpatialTreeNode* m_staticTree;
-	std::unordered_set<Shape*> m_staticShapes;
+	//Guards the working tree and shapes below, which only writers and publishStaticSnapshot touch
+	mutable std::mutex m_staticMutex;
+	mutable StaticBVH m_staticTree;
+	ShapeTable m_staticShapes;
+	mutable std::vector<AABB> m_staticBounds;
 	mutable bool m_staticDirty;
+	//Set when the working tree and shapes changed since the last snapshot
+	mutable std::atomic<bool> m_staticPending;
+	//Use std::atomic_load and std::atomic_store, so readers and the publisher don't race on it
+	mutable std::shared_ptr<const StaticSnapshot> m_staticSnapshot;
 	//Dynamic
-	std::unordered_multimap<Vec2, Shape*, std::hash<Vec2>,
-		std::equal_to<Vec2>, boost::pool_allocator<std::pair<const Vec2, Shape*>>> m_dynamicTable;
-	std::map<float, size_t, std::less<float>, boost::fast_pool_allocator<std::pair<const float, size_t>>> m_xrange;
-	std::map<float, size_t, std::less<float>, boost::fast_pool_allocator<std::pair<const float, size_t>>> m_yrange;
+	DynamicStructure m_dynamicStructure;
+	DynamicAABBTree m_dynamicTree;
+	GridLevel m_gridLevels[SbHGridLevelCount];
+	uint32_t m_gridLevelCount;
+	std::vector<DynamicRecord> m_dynamicRecords;
+	ShapeTable m_dynamicShapes;
+	std::vector<uint32_t> m_freeDynamicRecords;
+	//Dynamic shapes sorted by their left side on the last sweep
+	mutable std::mutex m_sweepMutex;
+	mutable std::vector<SweepEntry> m_sweepEntries;
+	//Pairs seen by the last updateContacts
+	std::mutex m_contactMutex;
+	std::unordered_map<ContactKey, CachedContact, ContactKeyHash> m_contacts;
+	uint32_t m_contactFrame;
+	//Work done by the queries since the last reset
+	mutable std::mutex m_statsMutex;
+	mutable QueryStats m_totalStats;
+	//Transforms queued between beginUpdate and endUpdate
+	bool m_updating;
+	std::vector<PendingMove> m_pendingMoves;
+	std::vector<CellMove> m_cellMoves;
 	//Methods
-	//Static
-	static bool staticHorizontalPartition(const std::vector<Shape*>& shapes, std::vector<Shape*>& side0, std::vector<Shape*>& side1) {
-		assert(shapes.size() != 0);
-		side0.clear();
-		side1.clear();
-
-		if (shapes.size() == 1)
-			return false;
-
-		auto bounds = computeBounds(shapes);
-
-		auto sortedShapes = shapes;
-		std::sort(sortedShapes.begin(), sortedShapes.end(), [](Shape* s1, Shape* s2) {
-			return s1->bounds().right() < s2->bounds().right();
-		});
-		auto middle = sortedShapes.size() % 2 == 0 ? (sortedShapes.size() / 2) - 1 : sortedShapes.size() / 2;
-		auto rSide0 = Rect();
-		rSide0.setBounds(bounds.left(), sortedShapes[middle]->bounds().right(), bounds.bottom(), bounds.top());
-
-		for (auto& s : sortedShapes) {
-			if (strictlyIntersects(s->bounds(), rSide0))
-				side0.push_back(s);
-			else
-				side1.push_back(s);
-		}
-		if (side0.size() == 0 || side1.size() == 0) {
-			side0.clear();
-			side1.clear();
-			return false;
-		}
-		return true;
-	}
-	static bool staticVerticalPartition(const std::vector<Shape*>& shapes, std::vector<Shape*>& side0, std::vector<Shape*>& side1) {
-		assert(shapes.size() != 0);
-		side0.clear();
-		side1.clear();
-
-		if (shapes.size() == 1)
-			return false;
-
-		auto bounds = computeBounds(shapes);
-
-		auto sortedShapes = shapes;
-		std::sort(sortedShapes.begin(), sortedShapes.end(), [](Shape* s1, Shape* s2) {
-			return s1->bounds().bottom() < s2->bounds().bottom();
-		});
-		auto middle = sortedShapes.size() % 2 == 0 ? (sortedShapes.size() / 2) - 1 : sortedShapes.size() / 2;
-		auto rSide0 = Rect();
-		rSide0.setBounds(bounds.left(), bounds.right(), sortedShapes[middle]->bounds().bottom(), bounds.top());
-
-		for (auto& s : sortedShapes) {
-			if (strictlyIntersects(s->bounds(), rSide0))
-				side0.push_back(s);
-			else
-				side1.push_back(s);
-		}
-		if (side0.size() == 0 || side1.size() == 0) {
-			side0.clear();
-			side1.clear();
-			return false;
-		}
-		return true;
-	}
-	static bool staticBestPartition(const std::vector<Shape*>& shapes, std::vector<Shape*>& side0, std::vector<Shape*>& side1) {
-		std::vector<Shape*> hs0, hs1, vs0, vs1;
-		auto hr = staticHorizontalPartition(shapes, hs0, hs1);
-		auto vr = staticHorizontalPartition(shapes, vs0, vs1);
-
-		if (!hr) {
-			side0 = vs0;
-			side1 = vs1;
-			return vr;
-		}
-		if (!vr) {
-			side0 = hs0;
-			side1 = hs1;
-			return hr;
-		}
-
-		auto middle = (float)shapes.size() / 2.0f;
-		auto hd = fabsf(middle - (float)hs0.size());
-		auto vd = fabsf(middle - (float)vs0.size());
-		if (hd < vd) {
-			side0 = hs0;
-			side1 = hs1;
-			return true;
-		}
-		else {
-			side0 = vs0;
-			side1 = vs1;
-			return true;
-		}
+	//Dynamic
+	static int32_t cellCoordinate(float v, float cellSize) {
+		auto c = floorf(v / cellSize);
+		if (c < -SbMaxCellCoordinate)
+			return -(int32_t)SbMaxCellCoordinate;
+		if (c > SbMaxCellCoordinate)
+			return (int32_t)SbMaxCellCoordinate;
+		return (int32_t)c;
 	}
-	static SpatialTreeNode* partition(const std::vector<Shape*>& shapes) {
-		std::vector<Shape*> s0, s1;
-		auto r = staticBestPartition(shapes, s0, s1);
-		if (!r) {
-			return SpatialTreeNode::terminal(shapes);
-		}
-		else {
-			return SpatialTreeNode::nonTerminal(
-				partition(s0),
-				partition(s1)
-				);
-		}
+	static CellRange cellRange(const Rect& r, float cellSize) {
+		return CellRange(cellCoordinate(r.left(), cellSize), cellCoordinate(r.bottom(), cellSize),
+						 cellCoordinate(r.right(), cellSize), cellCoordinate(r.top(), cellSize));
 	}
-	//Ray Cast
-	static RayCastStaticTest computeRayCastStaticTest(const Ray& r, const SpatialTreeNode* node) {
-		assert(!node->isTerminal());
-		Option<Vec2> i0 = Intersection::get(r, node->side0()->bounds());
-		Option<Vec2> i1 = Intersection::get(r, node->side1()->bounds());
-
-		if (i0.hasValue()) {
-			if (i1.hasValue()) {
-				auto containsA = node->side0()->bounds().containsPoint(r.point());
-				auto containsB = node->side1()->bounds().containsPoint(r.point());
-
-				if (containsA && containsB)
-					return RayCastStaticTest::both;
-				else {
-					if (containsA)
-						return RayCastStaticTest::aAfterB;
-					else if (containsB)
-						return RayCastStaticTest::bAfterA;
-					else {
-						auto p1 = r.computeT(i0.value());
-						auto p2 = r.computeT(i1.value());
-						return p1 < p2 ? RayCastStaticTest::aAfterB : RayCastStaticTest::bAfterA;
-					}
-				}
-			}
-			else
-				return RayCastStaticTest::onlyA;
-		}
-		else {
-			if (i1.hasValue()) {
-				return RayCastStaticTest::onlyB;
-			}
-			else
-				return RayCastStaticTest::none;
-		}
+	static Rect cellBounds(int32_t x, int32_t y, float cellSize) {
+		Rect r;
+		r.setBounds(x * cellSize, (x + 1) * cellSize, y * cellSize, (y + 1) * cellSize);
+		return r;
 	}
-	static RayCastResult staticRayCast(const Ray& r, size_t mask, const SpatialTreeNode* node) {
-		if (node->isTerminal()) {
-			RayCastResult rr;
-			auto cp = std::numeric_limits<float>::max();
-			for (auto& s : node->shapes()) {
-				if (!(s->typeMask() & mask))
-					continue;
-				auto tr = s->type() == ShapeType::circle ? Intersection::get(r, s->circle()) : (
-					s->type() == ShapeType::Rect ? Intersection::get(r, s->Rect()) : Intersection::get(r, s->Polygon())
-					);
-				if (!tr.hasValue())
-					continue;
-				auto p = r.computeT(tr.value());
-				if (p < cp) {
-					cp = p;
-					rr.parameter = p;
-					rr.empty = false;
-					rr.intersected = s;
-					rr.point = tr.value();
-				}
-			}
-			return rr;
-		}
-		auto rt = computeRayCastStaticTest(r, node);
-		RayCastResult r0, r1;
-		switch (rt) {
-		case RayCastStaticTest::none:
-			return RayCastResult();
-		case RayCastStaticTest::onlyA:
-			return staticRayCast(r, mask, node->side0());
-		case RayCastStaticTest::onlyB:
-			return staticRayCast(r, mask, node->side1());;
-		case RayCastStaticTest::both:
-			r0 = staticRayCast(r, mask, node->side0());
-			r1 = staticRayCast(r, mask, node->side1());
-			if (r0.empty)
-				return r1;
-			if (r1.empty)
-				return r0;
-			return r0.parameter < r1.parameter ? r0 : r1;
-		case RayCastStaticTest::aAfterB:
-			r0 = staticRayCast(r, mask, node->side0());
-			if (!r0.empty && !node->side1()->bounds().containsPoint(r0.point))
-				return r0;
-			r1 = staticRayCast(r, mask, node->side1());
-			if (r0.empty)
-				return r1;
-			if (r1.empty)
-				return r0;
-			return r0.parameter < r1.parameter ? r0 : r1;
-		case RayCastStaticTest::bAfterA:
-			r1 = staticRayCast(r, mask, node->side1());
-			if (!r1.empty && !node->side0()->bounds().containsPoint(r1.point))
-				return r1;
-			r0 = staticRayCast(r, mask, node->side0());
-			if (r0.empty)
-				return r1;
-			if (r1.empty)
-				return r0;
-			return r0.parameter < r1.parameter ? r0 : r1;
-		default:
-			throw "should never get here!";
-		}
+	//The plain grid only uses level 0. The hierarchical grid puts a shape in the finest level whose cells are
+	//at least as big as the shape, so it's never in more than 2x2 cells.
+	uint32_t levelFor(const Rect& bounds) const {
+		if (m_gridLevelCount == 1)
+			return 0;
+		const auto extent = std::max(bounds.width(), bounds.height());
+		uint32_t level = 0;
+		while (level + 1 < m_gridLevelCount && m_gridLevels[level].cellSize < extent)
+			level++;
+		return level;
 	}
-	//Range Query
-	static void staticRangeQuery(const Rect& r, size_t mask, Shape* exclude, const SpatialTreeNode* node, RangeQueryResult& rq) {
-		if (rq.isFull())
-			return;
-
-		if (node->isTerminal()) {
-			for (auto& s : node->shapes()) {
-				if (rq.isFull())
-					break;
-				if (exclude && s == exclude)
-					continue;
-				if (!(s->typeMask() & mask))
-					continue;
-				if (Intersection::test(r, s->bounds()))
-					rq.pushShape(s);
-			}
+	//Every dynamic shape has a record and a row of m_dynamicShapes under the same index, its proxy. The AABB
+	//tree keeps the index as user data.
+	void addToDynamicTable(Shape* s) {
+		uint32_t index;
+		if (m_freeDynamicRecords.size() != 0) {
+			index = m_freeDynamicRecords.back();
+			m_freeDynamicRecords.pop_back();
+			m_dynamicShapes.set(index, s);
 		}
 		else {
-			if (Intersection::test(r, node->side0()->bounds()))
-				staticRangeQuery(r, mask, exclude, node->side0(), rq);
-			if (Intersection::test(r, node->side1()->bounds()))
-				staticRangeQuery(r, mask, exclude, node->side1(), rq);
+			m_dynamicRecords.push_back(DynamicRecord());
+			m_dynamicShapes.push(s);
+			index = (uint32_t)(m_dynamicRecords.size() - 1);
 		}
-	}
-	static void staticPickQuery(const Vec2& pt, size_t mask, const SpatialTreeNode* node, RangeQueryResult& rq) {
-		if (rq.isFull())
+		auto& record = m_dynamicRecords[index];
+		s->setProxy(index);
+		if (m_dynamicStructure == DynamicStructure::aabbTree) {
+			record.treeProxy = m_dynamicTree.createProxy(m_dynamicShapes.bounds(index), (void*)(uintptr_t)index);
 			return;
-
-		if (node->isTerminal()) {
-			for (auto& s : node->shapes()) {
-				if (rq.isFull())
-					break;
-				if (!(s->typeMask() & mask))
-					continue;
-				if (Intersection::test(s->bounds(), pt)) {
-					if (s->type() == ShapeType::circle && Intersection::test(s->circle(), pt))
-						rq.pushShape(s);
-					else if (s->type() == ShapeType::Rect)
-						rq.pushShape(s);
-					else if (s->type() == ShapeType::Polygon && Intersection::test(s->Polygon(), pt))
-						rq.pushShape(s);
-				}
-			}
 		}
-		else {
-			if (Intersection::test(node->side0()->bounds(), pt))
-				staticPickQuery(pt, mask, node->side0(), rq);
-			if (Intersection::test(node->side1()->bounds(), pt))
-				staticPickQuery(pt, mask, node->side1(), rq);
-		}
-	}
-	//Dynamic
-	static Vec2 cellAddress(const Vec2& v) {
-		float vx = v.x / SbCellSize;
-		float vy = v.y / SbCellSize;
-		return Vec2(floor(vx), floor(vy));
+		const auto b = m_dynamicShapes.bounds(index).toRect();
+		record.level = levelFor(b);
+		record.cells = cellRange(b, m_gridLevels[record.level].cellSize);
+		m_gridLevels[record.level].cells.insert(record.cells, index, s->typeMask());
 	}
-	static Rect cellBounds(const Vec2& v) {
-		Rect r;
-		r.setBounds(v.x * SbCellSize, (v.x + 1) * SbCellSize, v.y * SbCellSize, (v.y + 1) * SbCellSize);
-		return r;
-	}
-	static void cellAddressRange(const Rect& r, Vec2& aMin, Vec2& aMax) {
-		aMin = cellAddress(r.bottomLeft());
-		aMax = cellAddress(r.topRight());
+	void removeFromDynamicTable(Shape* s) {
+		const auto index = (uint32_t)s->proxy();
+		assert(index < m_dynamicRecords.size());
+		assert(m_dynamicShapes.shapes[index] == s);
+		auto& record = m_dynamicRecords[index];
+		if (m_dynamicStructure == DynamicStructure::aabbTree)
+			m_dynamicTree.destroyProxy(record.treeProxy);
+		else
+			m_gridLevels[record.level].cells.remove(record.cells, index);
+		m_dynamicShapes.clear(index);
+		m_freeDynamicRecords.push_back(index);
+		s->setProxy(std::numeric_limits<size_t>::max());
 	}
-	void addToDynamicTable(Shape* s) {
-		auto b = s->bounds();
-		Vec2 aMin, aMax;
-		cellAddressRange(b, aMin, aMax);
-
-		for (float i = aMin.x; i <= aMax.x; i += 1.0f) {
-			for (float j = aMin.y; j <= aMax.y; j += 1.0f)
-				m_dynamicTable.insert({ Vec2(i, j), s });
-
-			if (m_xrange.count(i))
-				m_xrange[i]++;
-			else
-				m_xrange[i] = 1;
-		}
-
-		for (float j = aMin.y; j <= aMax.y; j += 1.0f) {
-			if (m_yrange.count(j))
-				m_yrange[j]++;
-			else
-				m_yrange[j] = 1;
-		}
+	void moveInDynamicTable(uint32_t index) {
+		assert(index < m_dynamicRecords.size());
+		const auto b = m_dynamicShapes.bounds(index).toRect();
+		const auto level = levelFor(b);
+		moveRecord(index, level, cellRange(b, m_gridLevels[level].cellSize));
 	}
-	void removeFromDynamicTable(Shape* s) {
-		auto b = s->bounds();
-		Vec2 aMin, aMax;
-		cellAddressRange(b, aMin, aMax);
-
-		for (float i = aMin.x; i <= aMax.x; i += 1.0f) {
-			for (float j = aMin.y; j <= aMax.y; j += 1.0f) {
-				auto shapes = m_dynamicTable.equal_range(Vec2(i, j));
-				auto it = shapes.first;
-				while (it != shapes.second) {
-					if (it->second == s) {
-						it = m_dynamicTable.erase(it);
-						break;
-					}
-					else
-						it++;
-				}
-			}
-
-			m_xrange[i]--;
-			if (m_xrange[i] == 0)
-				m_xrange.erase(i);
-		}
-
-		for (float j = aMin.y; j <= aMax.y; j += 1.0f) {
-			m_yrange[j]--;
-			if (m_yrange[j] == 0)
-				m_yrange.erase(j);
-		}
+	void moveRecord(uint32_t index, uint32_t level, const CellRange& cells) {
+		auto& record = m_dynamicRecords[index];
+		//most moves don't cross a cell border; neither does a shape moved twice in an update, the second time
+		if (level == record.level && cells == record.cells)
+			return;
+		m_gridLevels[record.level].cells.remove(record.cells, index);
+		record.level = level;
+		record.cells = cells;
+		m_gridLevels[level].cells.insert(cells, index, m_dynamicShapes.typeMasks[index]);
 	}
-	Rect dynamicBounds() const {
-		if (m_xrange.size() == 0 || m_yrange.size() == 0)
+	Rect levelBounds(const GridLevel& level) const {
+		if (level.cells.isEmpty())
 			return Rect();
-		float xmin = m_xrange.begin()->first;
-		float xmax = m_xrange.rbegin()->first;
-		float ymin = m_yrange.begin()->first;
-		float ymax = m_yrange.rbegin()->first;
-		Rect r1 = cellBounds(Vec2(xmin, ymin));
-		Rect r2 = cellBounds(Vec2(xmax, ymax));
+		auto c = level.cells.bounds();
+		Rect r1 = cellBounds(c.minx, c.miny, level.cellSize);
+		Rect r2 = cellBounds(c.maxx, c.maxy, level.cellSize);
 		return getUnion(r1, r2);
 	}
 	//Ray Cast
-	RayCastResult internalDynamicRayCast(const Ray& r, size_t mask, const Option<float>& maxSqrdLen) const {
-		if (m_dynamicTable.size() == 0)
-			return RayCastResult();
-		if (aeq(r.direction(), Vec2::zero))
-			return RayCastResult(); //no Intersection
-		auto bd = dynamicBounds();
-		Vec2 startAddr;
-		if (!bd.containsPoint(r.point())) {
-			auto ri = Intersection::get(r, bd);
-			if (!ri)
-				return RayCastResult(); //doesn't intersect anyone...
-			else
-				startAddr = cellAddress(ri.value());
-		}
-		else
-			startAddr = cellAddress(r.point());
+	//Levels are walked from coarse to fine, so the big shapes found first cut the walk through the finer ones short
+	RayCastResult gridRayCast(const Ray& r, size_t mask, const Option<float>& maxSqrdLen) const {
 		RayCastResult res;
-		bool inside = false;
-		std::unordered_set<Shape*, std::hash<Shape*>, std::equal_to<Shape*>, boost::pool_allocator<Shape*>> checkedShapes;
+		VisitedRecords visited(m_dynamicRecords.size());
+		const auto maxT = maxSqrdLen.hasValue() ? sqrtf(maxSqrdLen.value()) : std::numeric_limits<float>::max();
+		for (auto level = m_gridLevelCount; level-- != 0;) {
+			if (!m_gridLevels[level].cells.isEmpty())
+				levelRayCast(m_gridLevels[level], r, mask, maxT, visited, &res);
+		}
+		return res;
+	}
+	//Walks the cells along the ray in order (Amanatides & Woo). tMaxX and tMaxY are the distances at which the ray
+	//crosses the next vertical and horizontal cell borders; tDeltaX and tDeltaY are the distances between two borders.
+	void levelRayCast(const GridLevel& level, const Ray& r, size_t mask, float maxT, VisitedRecords& visited, RayCastResult* res) const {
+		const auto origin = r.point();
+		const auto direction = r.direction().normalized();
+		const auto cellSize = level.cellSize;
+		if (!res->empty)
+			maxT = std::min(maxT, res->parameter);
+		//we start where the ray enters the occupied cells
+		const auto cells = level.cells.bounds();
+		float tEnter;
+		if (!raySlab(AABB(levelBounds(level)), origin, direction, maxT, &tEnter))
+			return;
+		const auto start = origin + direction * tEnter;
+		auto x = std::min(std::max(cellCoordinate(start.x, cellSize), cells.minx), cells.maxx);
+		auto y = std::min(std::max(cellCoordinate(start.y, cellSize), cells.miny), cells.maxy);
+
+		const auto infinity = std::numeric_limits<float>::infinity();
+		const int32_t stepX = direction.x > 0 ? 1 : -1;
+		const int32_t stepY = direction.y > 0 ? 1 : -1;
+		const auto tDeltaX = direction.x != 0 ? cellSize / fabsf(direction.x) : infinity;
+		const auto tDeltaY = direction.y != 0 ? cellSize / fabsf(direction.y) : infinity;
+		auto tMaxX = direction.x != 0 ? ((x + (stepX > 0 ? 1 : 0)) * cellSize - origin.x) / direction.x : infinity;
+		auto tMaxY = direction.y != 0 ? ((y + (stepY > 0 ? 1 : 0)) * cellSize - origin.y) / direction.y : infinity;
 
 		while (true) {
-			auto cbd = cellBounds(startAddr);
-			if (inside) {
-				if (!bd.containsPoint(cbd.center()))
-					break;
-			}
-			if (bd.containsPoint(cbd.center()))
-				inside = true;
-			auto shapes = m_dynamicTable.equal_range(startAddr);
-			for (auto it = shapes.first; it != shapes.second; it++) {
-				if (!(it->second->typeMask() & mask))
-					continue;
-				if (checkedShapes.count(it->second))
-					continue;
-				Option<Vec2> pt = it->second->type() == ShapeType::circle ? Intersection::get(r, it->second->circle()) :
-					(it->second->type() == ShapeType::Rect ? Intersection::get(r, it->second->Rect()) :
-					 Intersection::get(r, it->second->Polygon()));
-				checkedShapes.insert(it->second);
-				if (pt.hasValue()) {
-					auto p = r.computeT(pt.value());
-					if (res.empty || p < res.parameter) {
-						res.empty = false;
-						res.intersected = it->second;
-						res.parameter = p;
-						res.point = pt.value();
-					}
+			auto items = level.cells.cell(x, y, mask);
+			if (items) {
+				for (auto index : *items) {
+					if (!m_dynamicShapes.matches(index, mask))
+						continue;
+					if (!visited.firstVisit(index))
+						continue;
+					closerHit(r, m_dynamicShapes.shapes[index], maxT, res);
 				}
 			}
-			if (!res.empty && cbd.containsPoint(res.point))
+			//a hit before the next border can't be beaten by the cells after it
+			const auto tNext = std::min(tMaxX, tMaxY);
+			if (!res->empty && res->parameter <= tNext)
 				break;
-			//to the next address
-			auto previousAddr = startAddr;
-			//horizontally
-			if (r.direction().x > 0 && Intersection::get(r, cbd.rightEdge()).hasValue())
-				startAddr.x += 1;
-			else if (r.direction().x < 0 && Intersection::get(r, cbd.leftEdge()).hasValue())
-				startAddr.x -= 1;
-			//vertically
-			if (r.direction().y > 0 && Intersection::get(r, cbd.topEdge()).hasValue())
-				startAddr.y += 1;
-			else if (r.direction().y < 0 && Intersection::get(r, cbd.bottomEdge()).hasValue())
-				startAddr.y -= 1;
-			if (previousAddr == startAddr) //this shouldn't happen
-				return RayCastResult();
-
-			if (maxSqrdLen.hasValue()) {
-				auto itt = Intersection::get(r, cbd);
-				if (itt.hasValue()) {
-					auto vv = itt.value() - r.point();
-					auto sqrdLen = vv.squaredLength();
-					if (sqrdLen > maxSqrdLen.value())
-						break;
-				}
+			if (tNext > maxT)
+				break;
+			if (tMaxX < tMaxY) {
+				x += stepX;
+				if (x < cells.minx || x > cells.maxx)
+					break;
+				tMaxX += tDeltaX;
+			}
+			else {
+				y += stepY;
+				if (y < cells.miny || y > cells.maxy)
+					break;
+				tMaxY += tDeltaY;
 			}
 		}
-
-		return res;
 	}
 	//Range Query
-	void dynamicRangeQuery(const Rect& r, size_t mask, Shape* exclude, RangeQueryResult& rd) const {
-		if (m_dynamicTable.size() == 0)
-			return;
-		auto bd = dynamicBounds();
-		if (!Intersection::test(r, bd))
-			return;
-		Vec2 aMin, aMax;
-		cellAddressRange(r, aMin, aMax);
-		std::unordered_set<Shape*, std::hash<Shape*>, std::equal_to<Shape*>, boost::pool_allocator<Shape*>> checkedShapes;
-
-		for (float i = aMin.x; i <= aMax.x; i += 1.0f) {
-			for (float j = aMin.y; j <= aMax.y; j += 1.0f) {
-				if (rd.isFull())
-					return;
+	template<class F>
+	bool gridRangeQuery(const Rect& r, size_t mask, Shape* exclude, F& visitor) const {
+		VisitedRecords visited(m_dynamicRecords.size());
+		for (auto level = m_gridLevelCount; level-- != 0;) {
+			if (!levelRangeQuery(m_gridLevels[level], r, mask, exclude, visited, visitor))
+				return false;
+		}
+		return true;
+	}
+	template<class F>
+	bool levelRangeQuery(const GridLevel& level, const Rect& r, size_t mask, Shape* exclude, VisitedRecords& visited, F& visitor) const {
+		if (level.cells.isEmpty())
+			return true;
+		const auto range = AABB(r);
+		auto bd = level.cells.bounds();
+		auto cr = cellRange(r, level.cellSize);
+		if (!cr.overlaps(bd))
+			return true;
+		//we never walk cells outside of the occupied ones
+		const auto minx = std::max(cr.minx, bd.minx);
+		const auto miny = std::max(cr.miny, bd.miny);
+		const auto maxx = std::min(cr.maxx, bd.maxx);
+		const auto maxy = std::min(cr.maxy, bd.maxy);
 
-				auto shapes = m_dynamicTable.equal_range(Vec2(i, j));
-				for (auto it = shapes.first; it != shapes.second; it++) {
-					if (rd.isFull())
-						return;
-					if (!(it->second->typeMask() & mask))
+		for (int32_t i = minx; i <= maxx; i++) {
+			for (int32_t j = miny; j <= maxy; j++) {
+				auto items = level.cells.cell(i, j, mask);
+				if (!items)
+					continue;
+				for (auto index : *items) {
+					if (!m_dynamicShapes.matches(index, mask) || !m_dynamicShapes.overlaps(index, range))
 						continue;
-					if (exclude && it->second == exclude)
+					if (exclude && m_dynamicShapes.shapes[index] == exclude)
 						continue;
-					if (checkedShapes.count(it->second))
+					if (!visited.firstVisit(index))
 						continue;
-					if (Intersection::test(it->second->bounds(), r))
-						rd.pushShape(it->second);
-					checkedShapes.insert(it->second);
+					if (!visitor(m_dynamicShapes.shapes[index]))
+						return false;
 				}
 			}
 		}
+		return true;
 	}
-	void dynamicPickQuery(const Vec2& pt, size_t mask, RangeQueryResult& rd) const {
-		if (m_dynamicTable.size() == 0)
-			return;
-		auto bd = dynamicBounds();
-		if (!Intersection::test(bd, pt))
-			return;
-		auto addr = cellAddress(pt);
+	//A shape is in one cell of one level at most, so the point finds it once
+	template<class F>
+	bool gridPickQuery(const Vec2& pt, size_t mask, F& visitor) const {
+		for (auto level = m_gridLevelCount; level-- != 0;) {
+			const auto& l = m_gridLevels[level];
+			if (l.cells.isEmpty())
+				continue;
+			auto items = l.cells.cell(cellCoordinate(pt.x, l.cellSize), cellCoordinate(pt.y, l.cellSize), mask);
+			if (!items)
+				continue;
 
-		auto shapes = m_dynamicTable.equal_range(addr);
-		for (auto it = shapes.first; it != shapes.second; it++) {
-			if (rd.isFull())
+			for (auto index : *items) {
+				if (!m_dynamicShapes.matches(index, mask))
+					continue;
+				if (m_dynamicShapes.pick(index, pt) && !visitor(m_dynamicShapes.shapes[index]))
+					return false;
+			}
+		}
+		return true;
+	}
+	//Nearest
+	void gridNearest(const Vec2& pt, size_t mask, NearestShapes& nearest) const {
+		VisitedRecords visited(m_dynamicRecords.size());
+		for (auto level = m_gridLevelCount; level-- != 0;) {
+			if (!m_gridLevels[level].cells.isEmpty())
+				levelNearest(m_gridLevels[level], pt, mask, visited, nearest);
+		}
+	}
+	//Walks rings of cells around the one pt is in, until the next ring is out of reach
+	void levelNearest(const GridLevel& level, const Vec2& pt, size_t mask, VisitedRecords& visited, NearestShapes& nearest) const {
+		const auto cellSize = level.cellSize;
+		const auto bd = level.cells.bounds();
+		const int64_t cx = cellCoordinate(pt.x, cellSize);
+		const int64_t cy = cellCoordinate(pt.y, cellSize);
+		//ring r is at least r - 1 cells farther than the border of the cell pt is in
+		const auto border = std::max(std::min(std::min(pt.x - cx * cellSize, (cx + 1) * cellSize - pt.x),
+											  std::min(pt.y - cy * cellSize, (cy + 1) * cellSize - pt.y)), 0.0f);
+		//rings before the first and after the last have no occupied cells
+		const auto firstRing = std::max(std::max(std::max(bd.minx - cx, cx - bd.maxx), std::max(bd.miny - cy, cy - bd.maxy)), (int64_t)0);
+		const auto lastRing = std::max(std::max(cx - bd.minx, bd.maxx - cx), std::max(cy - bd.miny, bd.maxy - cy));
+		auto visitCell = [&](int64_t x, int64_t y) {
+			if (x < bd.minx || x > bd.maxx || y < bd.miny || y > bd.maxy)
+				return;
+			auto items = level.cells.cell((int32_t)x, (int32_t)y, mask);
+			if (!items)
 				return;
-			if (!(it->second->typeMask() & mask))
+			for (auto index : *items) {
+				if (!m_dynamicShapes.matches(index, mask))
+					continue;
+				if (!visited.firstVisit(index))
+					continue;
+				offerNearest(m_dynamicShapes, index, pt, nearest);
+			}
+		};
+		for (auto ring = firstRing; ring <= lastRing; ring++) {
+			if (ring > 0 && (ring - 1) * cellSize + border > nearest.reach())
+				break;
+			if (ring == 0) {
+				visitCell(cx, cy);
 				continue;
-			if (Intersection::test(it->second->bounds(), pt)) {
-				if (it->second->type() == ShapeType::circle && Intersection::test(it->second->circle(), pt))
-					rd.pushShape(it->second);
-				else if (it->second->type() == ShapeType::Rect)
-					rd.pushShape(it->second);
-				else if (it->second->type() == ShapeType::Polygon && Intersection::test(it->second->Polygon(), pt))
-					rd.pushShape(it->second);
+			}
+			//top and bottom rows, then the columns between them
+			for (auto x = std::max(cx - ring, (int64_t)bd.minx); x <= std::min(cx + ring, (int64_t)bd.maxx); x++) {
+				visitCell(x, cy - ring);
+				visitCell(x, cy + ring);
+			}
+			for (auto y = std::max(cy - ring + 1, (int64_t)bd.miny); y <= std::min(cy + ring - 1, (int64_t)bd.maxy); y++) {
+				visitCell(cx - ring, y);
+				visitCell(cx + ring, y);
 			}
 		}
 	}
+	//AABB Tree
+	inline uint32_t recordOf(uint32_t proxy) const {
+		return (uint32_t)(uintptr_t)m_dynamicTree.userData(proxy);
+	}
+	RayCastResult treeRayCast(const Ray& r, size_t mask, const Option<float>& maxSqrdLen) const {
+		if (m_dynamicTree.isEmpty())
+			return RayCastResult();
+		RayCastResult res;
+		auto maxT = maxSqrdLen.hasValue() ? sqrtf(maxSqrdLen.value()) : std::numeric_limits<float>::max();
+		auto callback = [&](uint32_t proxy, float t) {
+			const auto index = recordOf(proxy);
+			if (!m_dynamicShapes.matches(index, mask))
+				return t;
+			return closerHit(r, m_dynamicShapes.shapes[index], t, &res);
+		};
+		m_dynamicTree.rayCast(r.point(), r.direction().normalized(), maxT, callback);
+		return res;
+	}
+	void treeNearest(const Vec2& pt, size_t mask, NearestShapes& nearest) const {
+		auto callback = [&](uint32_t proxy, float) {
+			const auto index = recordOf(proxy);
+			if (m_dynamicShapes.matches(index, mask))
+				offerNearest(m_dynamicShapes, index, pt, nearest);
+			return nearest.reach();
+		};
+		m_dynamicTree.nearest(pt, nearest.reach(), callback);
+	}
+	template<class F>
+	bool treeRangeQuery(const Rect& r, size_t mask, Shape* exclude, F& visitor) const {
+		bool completed = true;
+		const auto range = AABB(r);
+		auto callback = [&](uint32_t proxy) {
+			const auto index = recordOf(proxy);
+			if (!m_dynamicShapes.matches(index, mask) || !m_dynamicShapes.overlaps(index, range))
+				return true;
+			if (exclude && m_dynamicShapes.shapes[index] == exclude)
+				return true;
+			if (!visitor(m_dynamicShapes.shapes[index]))
+				completed = false;
+			return completed;
+		};
+		m_dynamicTree.query(range, callback);
+		return completed;
+	}
+	template<class F>
+	bool treePickQuery(const Vec2& pt, size_t mask, F& visitor) const {
+		bool completed = true;
+		auto callback = [&](uint32_t proxy) {
+			const auto index = recordOf(proxy);
+			if (!m_dynamicShapes.matches(index, mask))
+				return true;
+			if (m_dynamicShapes.pick(index, pt) && !visitor(m_dynamicShapes.shapes[index]))
+				completed = false;
+			return completed;
+		};
+		m_dynamicTree.query(pt, callback);
+		return completed;
+	}
 };
 
-sb::SpatialTree::SpatialTree() {
-	m_impl = new SpatialTree_implementation(this);
+//Counts a public query. The outermost query of a thread starts the counters from zero and adds them to the
+//totals of its tree when it's done, so the queries its visitors run count as part of it.
+class QueryScope {
+public:
+#ifdef SbSpatialTreeStats
+	explicit QueryScope(const SpatialTree_implementation* tree) {
+		m_tree = tree;
+		if (t_queryDepth++ == 0) {
+			t_queryStats.clear();
+			t_queryStats.queries = 1;
+		}
+	}
+	~QueryScope() {
+		if (--t_queryDepth != 0)
+			return;
+		t_lastQueryStats = t_queryStats;
+		m_tree->addQueryStats(t_queryStats);
+	}
+private:
+	const SpatialTree_implementation* m_tree;
+#else
+	explicit QueryScope(const SpatialTree_implementation*) {
+	}
+#endif
+};
+
+sb::SpatialTree::SpatialTree(DynamicStructure ds) {
+	m_impl = new SpatialTree_implementation(this, ds);
 }
 
 sb::SpatialTree::~SpatialTree() {
 	delete m_impl;
 }
 
-sb::SpatialTree* sb::SpatialTree::create() {
-	return new SpatialTree();
+sb::SpatialTree* sb::SpatialTree::create(DynamicStructure ds /*= DynamicStructure::grid*/) {
+	return new SpatialTree(ds);
+}
+
+sb::DynamicStructure sb::SpatialTree::dynamicStructure() const {
+	return m_impl->dynamicStructure();
 }
 
 void sb::SpatialTree::addStaticNode(Shape* s) const {
@@ -778,24 +1753,38 @@ void sb::SpatialTree::transform(Shape* s, const Matrix3x3& m) {
 	m_impl->transformDynamicNode(s, m);
 }
 
+void sb::SpatialTree::beginUpdate() {
+	m_impl->beginUpdate();
+}
+
+void sb::SpatialTree::endUpdate(bool parallel /*= false*/) {
+	m_impl->endUpdate(parallel);
+}
+
+void sb::SpatialTree::buildStatic() {
+	m_impl->staticSnapshot();
+}
+
 sb::RayCastResult sb::SpatialTree::rayCast(const Ray& r,
 										   size_t mask /*= std::numeric_limits<size_t>::max()*/,
 										   StaticDynamicMask sdFilter /*= sdmAll*/) const {
-	RayCastResult rc;
-	if (sdFilter & sdmStatic) {
-		rc = m_impl->staticRayCast(r, mask);
-	}
-	if (sdFilter & sdmDynamic) {
-		Option<float> sqrdLen = nullptr;
-		if (!rc.empty)
-			sqrdLen = (rc.point - r.point()).squaredLength();
+	QueryScope scope(m_impl);
+	return m_impl->rayCast(r, mask, sdFilter);
+}
 
-		RayCastResult rc2;
-		rc2 = m_impl->dynamicRayCast(r, mask, sqrdLen);
-		if (rc.empty || (!rc2.empty && rc2.parameter < rc.parameter))
-			rc = rc2;
-	}
-	return rc;
+void sb::SpatialTree::rayCastBatch(const Ray* rays,
+								   size_t count,
+								   RayCastResult* results,
+								   size_t mask /*= std::numeric_limits<size_t>::max()*/,
+								   StaticDynamicMask sdFilter /*= sdmAll*/,
+								   bool parallel /*= false*/) const {
+	assert(rays || count == 0);
+	assert(results || count == 0);
+	QueryScope scope(m_impl);
+	if (parallel)
+		m_impl->parallelRayCastBatch(rays, count, mask, sdFilter, results);
+	else
+		m_impl->rayCastBatch(rays, count, mask, sdFilter, results);
 }
 
 void sb::SpatialTree::rangeQuery(RangeQueryResult* result,
@@ -803,15 +1792,27 @@ void sb::SpatialTree::rangeQuery(RangeQueryResult* result,
 								 size_t mask /*= std::numeric_limits<size_t>::max()*/,
 								 StaticDynamicMask sdFilter /*= sdmAll*/) const {
 	assert(result);
+	QueryScope scope(m_impl);
 	if (result->isFull())
 		return;
-	if (sdFilter & sdmDynamic) {
-		m_impl->dynamicRangeQuery(result, r, mask);
-	}
+	auto visitor = [result](Shape* s) {
+		result->pushShape(s);
+		return !result->isFull();
+	};
+	m_impl->rangeQuery(r, mask, sdFilter, nullptr, visitor);
+}
 
-	if ((sdFilter & sdmStatic) && !result->isFull()) {
-		m_impl->staticRangeQuery(result, r, mask);
-	}
+void sb::SpatialTree::rangeQuery(std::vector<Shape*>* result,
+								 const Rect& r,
+								 size_t mask /*= std::numeric_limits<size_t>::max()*/,
+								 StaticDynamicMask sdFilter /*= sdmAll*/) const {
+	assert(result);
+	QueryScope scope(m_impl);
+	auto visitor = [result](Shape* s) {
+		result->push_back(s);
+		return true;
+	};
+	m_impl->rangeQuery(r, mask, sdFilter, nullptr, visitor);
 }
 
 void sb::SpatialTree::pickQuery(RangeQueryResult* result,
@@ -819,47 +1820,165 @@ void sb::SpatialTree::pickQuery(RangeQueryResult* result,
 								size_t mask /*= std::numeric_limits<size_t>::max()*/,
 								StaticDynamicMask sdFilter /*= sdmAll*/) const {
 	assert(result);
+	QueryScope scope(m_impl);
 	if (result->isFull())
 		return;
-	if (sdFilter & sdmDynamic) {
-		m_impl->dynamicPickQuery(result, pt, mask);
-	}
+	auto visitor = [result](Shape* s) {
+		result->pushShape(s);
+		return !result->isFull();
+	};
+	m_impl->pickQuery(pt, mask, sdFilter, visitor);
+}
 
-	if ((sdFilter & sdmStatic) && !result->isFull()) {
-		m_impl->staticPickQuery(result, pt, mask);
-	}
+void sb::SpatialTree::pickQuery(std::vector<Shape*>* result,
+								const Vec2& pt,
+								size_t mask /*= std::numeric_limits<size_t>::max()*/,
+								StaticDynamicMask sdFilter /*= sdmAll*/) const {
+	assert(result);
+	QueryScope scope(m_impl);
+	auto visitor = [result](Shape* s) {
+		result->push_back(s);
+		return true;
+	};
+	m_impl->pickQuery(pt, mask, sdFilter, visitor);
 }
 
 void sb::SpatialTree::intersectionQuery(IntersectionQueryResult* result, Shape* bodyA, StaticDynamicMask sdFilter) const {
 	assert(result);
 	assert(bodyA);
 	assert(bodyA->parent() == this);
+	QueryScope scope(m_impl);
 	if (result->isFull())
 		return;
-	if (sdFilter & sdmDynamic) {
-		RangeQueryResult r;
-		m_impl->dynamicRangeQuery(&r, bodyA->bounds(), bodyA->collisionMask(), bodyA);
-		for (size_t i = 0; i < r.count; i++) {
-			if (result->isFull())
-				break;
-			ExIntersectionInfo ei;
-			m_impl->testIntersection(&ei, bodyA, r.shapes[i]);
-			if (!ei.empty)
-				result->pushInfo(ei);
-		}
-	}
-	if (result->isFull())
+	auto visitor = [result](const ExIntersectionInfo& ei) {
+		result->pushInfo(ei);
+		return !result->isFull();
+	};
+	m_impl->intersectionQuery(bodyA, sdFilter, visitor);
+}
+
+void sb::SpatialTree::intersectionQuery(std::vector<ExIntersectionInfo>* result, Shape* bodyA, StaticDynamicMask sdFilter) const {
+	assert(result);
+	assert(bodyA);
+	assert(bodyA->parent() == this);
+	QueryScope scope(m_impl);
+	auto visitor = [result](const ExIntersectionInfo& ei) {
+		result->push_back(ei);
+		return true;
+	};
+	m_impl->intersectionQuery(bodyA, sdFilter, visitor);
+}
+
+sb::ShapeCastResult sb::SpatialTree::shapeCast(Shape* s,
+												const Vec2& displacement,
+												size_t mask /*= std::numeric_limits<size_t>::max()*/,
+												StaticDynamicMask sdFilter /*= sdmAll*/) const {
+	assert(s);
+	QueryScope scope(m_impl);
+	return m_impl->shapeCast(s, displacement, mask, sdFilter);
+}
+
+void sb::SpatialTree::updateContacts(std::vector<ContactEvent>* result, StaticDynamicMask sdFilter) {
+	assert(result);
+	QueryScope scope(m_impl);
+	m_impl->updateContacts(sdFilter, result);
+}
+
+void sb::SpatialTree::typeMaskChanged(Shape* s) {
+	assert(s);
+	assert(s->parent() == this);
+	m_impl->typeMaskChanged(s);
+}
+
+void sb::SpatialTree::computeAllPairs(std::vector<ExIntersectionInfo>* result, StaticDynamicMask sdFilter) const {
+	assert(result);
+	QueryScope scope(m_impl);
+	auto visitor = [result](const ExIntersectionInfo& ei) {
+		result->push_back(ei);
+		return true;
+	};
+	m_impl->allPairs(sdFilter, visitor);
+}
+
+void sb::SpatialTree::nearest(std::vector<ShapeDistance>* result,
+							 const Vec2& pt,
+							 size_t k,
+							 size_t mask /*= std::numeric_limits<size_t>::max()*/,
+							 StaticDynamicMask sdFilter /*= sdmAll*/) const {
+	assert(result);
+	QueryScope scope(m_impl);
+	if (k == 0)
 		return;
-	if (sdFilter & sdmStatic) {
-		RangeQueryResult r;
-		m_impl->staticRangeQuery(&r, bodyA->bounds(), bodyA->collisionMask(), bodyA);
-		for (size_t i = 0; i < r.count; i++) {
-			if (result->isFull())
-				break;
-			ExIntersectionInfo ei;
-			m_impl->testIntersection(&ei, bodyA, r.shapes[i]);
-			if (!ei.empty)
-				result->pushInfo(ei);
-		}
-	}
+	NearestShapes nearest(result, k, std::numeric_limits<float>::max());
+	m_impl->nearestQuery(pt, mask, sdFilter, nearest);
+}
+
+void sb::SpatialTree::withinRadius(std::vector<ShapeDistance>* result,
+								   const Vec2& pt,
+								   float radius,
+								   size_t mask /*= std::numeric_limits<size_t>::max()*/,
+								   StaticDynamicMask sdFilter /*= sdmAll*/) const {
+	assert(result);
+	assert(radius >= 0);
+	QueryScope scope(m_impl);
+	NearestShapes nearest(result, std::numeric_limits<size_t>::max(), radius);
+	m_impl->nearestQuery(pt, mask, sdFilter, nearest);
+}
+
+void sb::SpatialTree::erasedRangeQuery(const Rect& r, ShapeVisitor visitor, void* context, size_t mask, StaticDynamicMask sdFilter) const {
+	assert(visitor);
+	QueryScope scope(m_impl);
+	auto callback = [visitor, context](Shape* s) {
+		return visitor(context, s);
+	};
+	m_impl->rangeQuery(r, mask, sdFilter, nullptr, callback);
+}
+
+void sb::SpatialTree::erasedPickQuery(const Vec2& pt, ShapeVisitor visitor, void* context, size_t mask, StaticDynamicMask sdFilter) const {
+	assert(visitor);
+	QueryScope scope(m_impl);
+	auto callback = [visitor, context](Shape* s) {
+		return visitor(context, s);
+	};
+	m_impl->pickQuery(pt, mask, sdFilter, callback);
+}
+
+void sb::SpatialTree::erasedIntersectionQuery(Shape* bodyA, IntersectionVisitor visitor, void* context, StaticDynamicMask sdFilter) const {
+	assert(bodyA);
+	assert(bodyA->parent() == this);
+	assert(visitor);
+	QueryScope scope(m_impl);
+	auto callback = [visitor, context](const ExIntersectionInfo& ei) {
+		return visitor(context, ei);
+	};
+	m_impl->intersectionQuery(bodyA, sdFilter, callback);
+}
+
+void sb::SpatialTree::erasedAllPairs(IntersectionVisitor visitor, void* context, StaticDynamicMask sdFilter) const {
+	assert(visitor);
+	QueryScope scope(m_impl);
+	auto callback = [visitor, context](const ExIntersectionInfo& ei) {
+		return visitor(context, ei);
+	};
+	m_impl->allPairs(sdFilter, callback);
+}
+
+sb::QueryStats sb::SpatialTree::lastQueryStats() const {
+#ifdef SbSpatialTreeStats
+	return t_lastQueryStats;
+#else
+	return QueryStats();
+#endif
+}
+
+sb::QueryStats sb::SpatialTree::totalQueryStats() const {
+	return m_impl->totalQueryStats();
+}
+
+void sb::SpatialTree::resetQueryStats() {
+	m_impl->resetQueryStats();
+}
+
+sb::StructureStats sb::SpatialTree::structureStats() const {
+	return m_impl->structureStats();
 }
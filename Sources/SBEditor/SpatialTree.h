@@ -7,9 +7,13 @@ You can't use, distribute or modify this code without my permission.
 #pragma once
 
 #include "Vec2.h"
+#include "SpatialStats.h"
 
 #define SbMaxCollisions 12
 #define SbCellSize 4.0f
+//Cell size of the finest level of the hierarchical grid. Each level doubles it.
+#define SbHGridBaseCellSize 0.25f
+#define SbHGridLevelCount 16
 
 class SpatialTree_implementation;
 
@@ -100,16 +104,130 @@ namespace sb {
 		}
 	};
 
+	struct ShapeDistance {
+	public:
+		Shape* shape;
+		float distance;
+		ShapeDistance() {
+			shape = nullptr;
+			distance = 0;
+		}
+		ShapeDistance(Shape* s, float d) {
+			shape = s;
+			distance = d;
+		}
+	};
+
+	struct ShapeCastResult {
+	public:
+		bool empty;
+		Shape* intersected;
+		//Points from intersected towards the cast shape
+		Vec2 normal;
+		//Fraction of the displacement travelled before touching, 0 when they already overlap
+		float time;
+		ShapeCastResult() {
+			empty = true;
+			intersected = nullptr;
+			time = 0;
+		}
+		ShapeCastResult(Shape* s, const Vec2& n, float t) {
+			empty = false;
+			intersected = s;
+			normal = n;
+			time = t;
+		}
+	};
+
+	enum class ContactState {
+		begin,
+		persist,
+		end
+	};
+
+	struct ContactEvent {
+	public:
+		ContactState state;
+		//Empty when the contact ends, but bodyA and bodyB are still set
+		ExIntersectionInfo info;
+		ContactEvent() {
+			state = ContactState::begin;
+		}
+		ContactEvent(ContactState s, const ExIntersectionInfo& ei) {
+			state = s;
+			info = ei;
+		}
+	};
+
+	//How the structures of a SpatialTree looked when they were measured
+	struct StructureStats {
+	public:
+		//Static BVH
+		size_t staticShapes;
+		size_t staticNodes;
+		int32_t staticDepth;
+		//staticLeafOccupancy[n] is the number of leaves with n shapes
+		std::vector<size_t> staticLeafOccupancy;
+		//Dynamic
+		size_t dynamicShapes;
+		//Records the dynamic table holds, free ones included, and the part of them in use
+		size_t dynamicRecords;
+		float dynamicTableLoadFactor;
+		//AABB tree
+		int32_t dynamicTreeHeight;
+		//Grids, all levels together
+		size_t occupiedCells;
+		//Cells per dynamic shape, on average
+		float cellsPerShape;
+		//Occupied cells over slots of the cell hash tables
+		float cellTableLoadFactor;
+		//cellOccupancy[n] is the number of cells with n shapes
+		std::vector<size_t> cellOccupancy;
+		StructureStats() {
+			staticShapes = 0;
+			staticNodes = 0;
+			staticDepth = 0;
+			dynamicShapes = 0;
+			dynamicRecords = 0;
+			dynamicTableLoadFactor = 0;
+			dynamicTreeHeight = 0;
+			occupiedCells = 0;
+			cellsPerShape = 0;
+			cellTableLoadFactor = 0;
+		}
+	};
+
+	//Structure used to keep the dynamic shapes
+	enum class DynamicStructure {
+		//Uniform grid of SbCellSize cells. Cheap for many small shapes of similar size.
+		grid,
+		//Incremental AABB tree with fattened leaves. Better when shape sizes vary a lot.
+		aabbTree,
+		//Grids of SbHGridBaseCellSize to SbHGridBaseCellSize * 2^(SbHGridLevelCount - 1) cells. Each shape goes into
+		//the level where it spans at most 2x2 cells, so mixed sizes need no cell size tuning.
+		hierarchicalGrid
+	};
+
 	enum StaticDynamicMask {
 		sdmDynamic = 1,
 		sdmStatic = 2,
 		sdmAll = 3
 	};
 
+	//Visitors get each result of a query. Returning false stops the query.
+	typedef bool(*ShapeVisitor)(void* context, Shape* s);
+	typedef bool(*IntersectionVisitor)(void* context, const ExIntersectionInfo& ei);
+
+	//Threading: any number of threads may run queries at once. Static shapes reach the queries through an
+	//immutable snapshot, so they can be added and removed while queries run: the ones in flight finish on the
+	//snapshot they started with and later ones see the change. A removed shape must outlive the queries that
+	//were running when it was removed. Adding, removing or transforming dynamic shapes needs the tree to itself.
 	class SpatialTree {
 	public:
+		//Friend class
+		friend class Shape;
 		//Constructors
-		static SpatialTree* create();
+		static SpatialTree* create(DynamicStructure ds = DynamicStructure::grid);
 		//Destructor
 		virtual ~SpatialTree();
 		//Modifying
@@ -117,13 +235,89 @@ namespace sb {
 		void addDynamicNode(Shape* s) const;
 		void removeNode(Shape* s) const;
 		void transform(Shape* s, const Matrix3x3& m);
+		//Between beginUpdate and endUpdate, transform only queues the moves and queries still see the shapes
+		//where they were. endUpdate applies them all at once, and with parallel set it transforms the shapes
+		//on several threads. Meant for moving most of the dynamic shapes every frame.
+		void beginUpdate();
+		void endUpdate(bool parallel = false);
+		//The static structure is otherwise rebuilt and published by the first query after a static shape is
+		//added or removed. Call this (from a loading thread, for instance) to pay for it up front.
+		void buildStatic();
+		//Info
+		DynamicStructure dynamicStructure() const;
 		//Queries
 		RayCastResult rayCast(const Ray& r, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const;
+		//Casts count rays; results[i] is what rayCast(rays[i]) returns. Rays going roughly the same way are
+		//walked through the static tree in packets, so keep neighbouring rays coherent. With parallel set,
+		//big batches are split across threads.
+		void rayCastBatch(const Ray* rays, size_t count, RayCastResult* results, size_t mask = std::numeric_limits<size_t>::max(),
+						  StaticDynamicMask sdFilter = sdmAll, bool parallel = false) const;
 		void rangeQuery(RangeQueryResult* result, const Rect& r, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const;
 		void pickQuery(RangeQueryResult* result, const Vec2& pt, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const;
 		void intersectionQuery(IntersectionQueryResult* result, Shape* bodyA, StaticDynamicMask sdFilter = sdmAll) const;
+		//Unbounded queries. Results are appended, so the same buffer can be cleared and reused every frame.
+		void rangeQuery(std::vector<Shape*>* result, const Rect& r, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const;
+		void pickQuery(std::vector<Shape*>* result, const Vec2& pt, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const;
+		void intersectionQuery(std::vector<ExIntersectionInfo>* result, Shape* bodyA, StaticDynamicMask sdFilter = sdmAll) const;
+		//Shapes by their distance to pt, nearest first; the distance is 0 when pt is inside the shape. nearest gives
+		//the k nearest ones and withinRadius the ones at most radius away.
+		void nearest(std::vector<ShapeDistance>* result, const Vec2& pt, size_t k, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const;
+		void withinRadius(std::vector<ShapeDistance>* result, const Vec2& pt, float radius, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const;
+		//First shape s would touch if moved by displacement, s itself left out
+		ShapeCastResult shapeCast(Shape* s, const Vec2& displacement, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const;
+		//Every intersecting pair with a dynamic bodyA, once. Pairs are the ones intersectionQuery would give for each
+		//dynamic shape; sdFilter tells which bodyB to look for: sdmDynamic for dynamic pairs, sdmStatic for static ones.
+		void computeAllPairs(std::vector<ExIntersectionInfo>* result, StaticDynamicMask sdFilter = sdmAll) const;
+		//The pairs computeAllPairs gives, as events since the last call: begin for new contacts, persist for the ones
+		//still touching and end for the ones that stopped. Pairs are kept between calls, and the narrowphase is
+		//skipped for the ones where neither shape moved or that are still apart along the axis that separated them
+		//the last time. Needs the tree to itself, like adding or removing shapes. Removed shapes are forgotten
+		//without an end event.
+		void updateContacts(std::vector<ContactEvent>* result, StaticDynamicMask sdFilter = sdmAll);
+		//Statistics
+		//What the last query of the calling thread did, and what all queries did since resetQueryStats. A query
+		//run from a visitor counts as part of the one that called it. Only counted when SbSpatialTreeStats is
+		//defined; otherwise they're always empty.
+		QueryStats lastQueryStats() const;
+		QueryStats totalQueryStats() const;
+		void resetQueryStats();
+		//Walks the structures to measure them, so it's not meant for every frame. Publishes the static snapshot
+		//if it's pending, like a query.
+		StructureStats structureStats() const;
+		//Visitor queries. visitor(Shape*) or visitor(const ExIntersectionInfo&) returns false to stop.
+		template<class F>
+		void visitRange(const Rect& r, F&& visitor, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const {
+			typedef typename std::remove_reference<F>::type Visitor;
+			erasedRangeQuery(r, &invokeVisitor<Visitor, Shape*>, (void*)&visitor, mask, sdFilter);
+		}
+		template<class F>
+		void visitPick(const Vec2& pt, F&& visitor, size_t mask = std::numeric_limits<size_t>::max(), StaticDynamicMask sdFilter = sdmAll) const {
+			typedef typename std::remove_reference<F>::type Visitor;
+			erasedPickQuery(pt, &invokeVisitor<Visitor, Shape*>, (void*)&visitor, mask, sdFilter);
+		}
+		template<class F>
+		void visitIntersections(Shape* bodyA, F&& visitor, StaticDynamicMask sdFilter = sdmAll) const {
+			typedef typename std::remove_reference<F>::type Visitor;
+			erasedIntersectionQuery(bodyA, &invokeVisitor<Visitor, const ExIntersectionInfo&>, (void*)&visitor, sdFilter);
+		}
+		template<class F>
+		void visitAllPairs(F&& visitor, StaticDynamicMask sdFilter = sdmAll) const {
+			typedef typename std::remove_reference<F>::type Visitor;
+			erasedAllPairs(&invokeVisitor<Visitor, const ExIntersectionInfo&>, (void*)&visitor, sdFilter);
+		}
 	private:
-		SpatialTree();
+		SpatialTree(DynamicStructure ds);
+		//Called by the shape, so the nodes and cells above it get its new bits
+		void typeMaskChanged(Shape* s);
+		//Visitors
+		template<class F, class T>
+		static bool invokeVisitor(void* context, T item) {
+			return (*(F*)context)(item);
+		}
+		void erasedRangeQuery(const Rect& r, ShapeVisitor visitor, void* context, size_t mask, StaticDynamicMask sdFilter) const;
+		void erasedPickQuery(const Vec2& pt, ShapeVisitor visitor, void* context, size_t mask, StaticDynamicMask sdFilter) const;
+		void erasedIntersectionQuery(Shape* bodyA, IntersectionVisitor visitor, void* context, StaticDynamicMask sdFilter) const;
+		void erasedAllPairs(IntersectionVisitor visitor, void* context, StaticDynamicMask sdFilter) const;
 		SpatialTree_implementation* m_impl;
 	};
 }
@@ -0,0 +1,532 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#include "pch.h"
+#include "StaticBVH.h"
+#include <future>
+#include <thread>
+
+using namespace sb;
+
+static inline float axisValue(const Vec2& v, uint32_t axis) {
+	return axis == 0 ? v.x : v.y;
+}
+
+//Small nodes use fewer bins; most of them would be empty anyway
+static inline uint32_t binCountFor(uint32_t count) {
+	return count < SbBVHBinCount ? count : SbBVHBinCount;
+}
+
+static inline uint32_t binOf(float value, float minValue, float scale, uint32_t binCount) {
+	auto bin = (uint32_t)((value - minValue) * scale);
+	return bin < binCount ? bin : binCount - 1;
+}
+
+sb::StaticBVH::StaticBVH() {
+	m_deadNodes = 0;
+	m_totalCost = 0;
+	m_builtCost = 0;
+}
+
+void sb::StaticBVH::clear() {
+	m_nodes.clear();
+	m_indices.clear();
+	m_primitiveBounds.clear();
+	m_primitiveMasks.clear();
+	m_leafOf.clear();
+	m_deadNodes = 0;
+	m_totalCost = 0;
+	m_builtCost = 0;
+}
+
+//Primitives are copied with their bounds and centroid and partitioned in place, so the build walks memory
+//sequentially instead of jumping through the index array
+struct sb::StaticBVH::BuildRef {
+	AABB bounds;
+	Vec2 centroid;
+	size_t mask;
+	uint32_t index;
+};
+
+void sb::StaticBVH::build(const AABB* bounds, const size_t* masks, size_t count, bool parallel /*= true*/) {
+	assert(count == 0 || bounds);
+	assert(count < SbNullNode);
+	clear();
+	if (count == 0)
+		return;
+
+	std::vector<BuildRef> refs(count);
+	for (size_t i = 0; i < count; i++) {
+		refs[i].bounds = bounds[i];
+		refs[i].centroid = bounds[i].center();
+		refs[i].mask = masks ? masks[i] : std::numeric_limits<size_t>::max();
+		refs[i].index = (uint32_t)i;
+	}
+	m_indices.resize(count);
+	m_primitiveBounds.assign(bounds, bounds + count);
+	if (masks)
+		m_primitiveMasks.assign(masks, masks + count);
+	else
+		m_primitiveMasks.assign(count, std::numeric_limits<size_t>::max());
+	m_leafOf.resize(count);
+	//other threads would only add overhead on a single core
+	if (std::thread::hardware_concurrency() < 2)
+		parallel = false;
+	//a binary tree with leaves of at least one primitive never has more than 2n - 1 nodes
+	m_nodes.reserve(2 * count - 1);
+	buildNode(m_nodes, SbNullNode, refs.data(), 0, (uint32_t)count, 0, parallel);
+
+	for (uint32_t id = 0; id < m_nodes.size(); id++) {
+		const auto& n = m_nodes[id];
+		m_totalCost += nodeCost(n);
+		if (n.isLeaf()) {
+			for (auto i = n.offset; i < n.offset + n.count; i++)
+				m_leafOf[m_indices[i]] = id;
+		}
+	}
+	m_builtCost = cost();
+}
+
+//Appends the nodes in the order they are created, which is depth first. Every leaf writes to its own range of
+//m_indices, so subtrees can be built by different threads as long as each one gets its own node array.
+uint32_t sb::StaticBVH::buildNode(std::vector<Node>& nodes, uint32_t parent, BuildRef* refs, uint32_t begin, uint32_t end, uint32_t depth, bool parallel) {
+	assert(begin < end);
+	const auto id = (uint32_t)nodes.size();
+	nodes.push_back(Node());
+
+	auto nodeBounds = AABB::inverted();
+	auto centroidBounds = AABB::inverted();
+	size_t nodeMask = 0;
+	for (auto i = begin; i < end; i++) {
+		const auto& c = refs[i].centroid;
+		nodeBounds.merge(refs[i].bounds);
+		nodeMask |= refs[i].mask;
+		centroidBounds.minx = std::min(centroidBounds.minx, c.x);
+		centroidBounds.miny = std::min(centroidBounds.miny, c.y);
+		centroidBounds.maxx = std::max(centroidBounds.maxx, c.x);
+		centroidBounds.maxy = std::max(centroidBounds.maxy, c.y);
+	}
+	nodes[id].bounds = nodeBounds;
+	nodes[id].parent = parent;
+	nodes[id].mask = nodeMask;
+
+	const auto count = end - begin;
+	uint32_t axis = 0, splitBin = 0, mid = begin;
+	if (count > 1 && findSplit(refs + begin, count, nodeBounds, centroidBounds, &axis, &splitBin)) {
+		const auto minValue = axis == 0 ? centroidBounds.minx : centroidBounds.miny;
+		const auto extent = axis == 0 ? centroidBounds.width() : centroidBounds.height();
+		const auto binCount = binCountFor(count);
+		const auto scale = binCount / extent;
+		mid = (uint32_t)(std::partition(refs + begin, refs + end, [&](const BuildRef& r) {
+			return binOf(axisValue(r.centroid, axis), minValue, scale, binCount) < splitBin;
+		}) - refs);
+	}
+	else if (count > SbBVHMaxLeafSize) {
+		//every centroid is in the same spot, so any split is as good as another
+		axis = nodeBounds.width() >= nodeBounds.height() ? 0 : 1;
+		mid = begin + count / 2;
+	}
+
+	if (mid == begin || mid == end) {
+		nodes[id].axis = SbBVHLeaf;
+		nodes[id].offset = begin;
+		nodes[id].count = count;
+		for (auto i = begin; i < end; i++)
+			m_indices[i] = refs[i].index;
+		return id;
+	}
+
+	nodes[id].axis = axis;
+	nodes[id].count = 0;
+	if (!parallel || depth >= SbBVHParallelMaxDepth || end - mid < SbBVHParallelMinCount) {
+		buildNode(nodes, id, refs, begin, mid, depth + 1, parallel);
+		const auto right = buildNode(nodes, id, refs, mid, end, depth + 1, parallel);
+		nodes[id].offset = right;
+		return id;
+	}
+
+	//the right subtree goes to another thread while this one builds the left subtree in place
+	std::vector<Node> rightNodes;
+	auto rightTask = std::async(std::launch::async, [&]() {
+		rightNodes.reserve(2 * (end - mid) - 1);
+		buildNode(rightNodes, SbNullNode, refs, mid, end, depth + 1, parallel);
+	});
+	buildNode(nodes, id, refs, begin, mid, depth + 1, parallel);
+	rightTask.get();
+
+	//then it's moved after the left subtree, just where a serial build would have put it
+	const auto right = (uint32_t)nodes.size();
+	for (auto n : rightNodes) {
+		n.parent = n.parent == SbNullNode ? id : n.parent + right;
+		if (!n.isLeaf())
+			n.offset += right;
+		nodes.push_back(n);
+	}
+	nodes[id].offset = right;
+	return id;
+}
+
+//Looks for the cheapest split over both axes. Returns false if keeping the primitives in a leaf is cheaper,
+//unless there are too many of them for a leaf.
+bool sb::StaticBVH::findSplit(const BuildRef* refs, uint32_t count, const AABB& nodeBounds, const AABB& centroidBounds,
+							  uint32_t* axis, uint32_t* splitBin) {
+	struct Bin {
+		AABB bounds;
+		uint32_t count;
+	};
+	const float minValue[2] = { centroidBounds.minx, centroidBounds.miny };
+	const float extent[2] = { centroidBounds.width(), centroidBounds.height() };
+	//a flat axis puts everything in bin 0 and never produces a split
+	const auto binCount = binCountFor(count);
+	const float scale[2] = {
+		extent[0] > 0 ? binCount / extent[0] : 0,
+		extent[1] > 0 ? binCount / extent[1] : 0
+	};
+
+	//both axes are binned in the same pass over the primitives
+	Bin bins[2][SbBVHBinCount];
+	for (uint32_t a = 0; a < 2; a++) {
+		for (uint32_t i = 0; i < binCount; i++) {
+			bins[a][i].bounds = AABB::inverted();
+			bins[a][i].count = 0;
+		}
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		const auto& r = refs[i];
+		auto& bx = bins[0][binOf(r.centroid.x, minValue[0], scale[0], binCount)];
+		auto& by = bins[1][binOf(r.centroid.y, minValue[1], scale[1], binCount)];
+		bx.bounds.merge(r.bounds);
+		bx.count++;
+		by.bounds.merge(r.bounds);
+		by.count++;
+	}
+
+	//costs are kept multiplied by the node perimeter, so degenerated nodes don't divide by 0
+	const auto leafCost = (float)count * nodeBounds.perimeter();
+	auto bestCost = std::numeric_limits<float>::max();
+	bool found = false;
+	for (uint32_t a = 0; a < 2; a++) {
+		if (extent[a] <= 0)
+			continue;
+		//right to left sweep: cost of everything to the right of each split
+		float rightCost[SbBVHBinCount];
+		auto rightBounds = AABB::inverted();
+		uint32_t rightCount = 0;
+		for (uint32_t i = binCount - 1; i > 0; i--) {
+			rightBounds.merge(bins[a][i].bounds);
+			rightCount += bins[a][i].count;
+			rightCost[i] = rightCount == 0 ? 0 : (float)rightCount * rightBounds.perimeter();
+		}
+		//left to right sweep: split i puts bins [0, i) on the left
+		auto leftBounds = AABB::inverted();
+		uint32_t leftCount = 0;
+		for (uint32_t i = 1; i < binCount; i++) {
+			leftBounds.merge(bins[a][i - 1].bounds);
+			leftCount += bins[a][i - 1].count;
+			if (leftCount == 0 || leftCount == count)
+				continue;
+			const auto cost = SbBVHTraversalCost * nodeBounds.perimeter() +
+				(float)leftCount * leftBounds.perimeter() + rightCost[i];
+			if (cost < bestCost) {
+				bestCost = cost;
+				*axis = a;
+				*splitBin = i;
+				found = true;
+			}
+		}
+	}
+
+	if (!found)
+		return false;
+	return bestCost < leafCost || count > SbBVHMaxLeafSize;
+}
+
+//How much the perimeter of node grows if bounds is added to it
+static float growth(const AABB& node, const AABB& bounds) {
+	if (node.minx > node.maxx)
+		return bounds.perimeter();
+	return getUnion(node, bounds).perimeter() - node.perimeter();
+}
+
+double sb::StaticBVH::nodeCost(const Node& node) const {
+	//empty subtrees have inverted bounds and cost nothing
+	if (node.bounds.minx > node.bounds.maxx)
+		return 0;
+	if (!node.isLeaf())
+		return SbBVHTraversalCost * node.bounds.perimeter();
+	return (double)node.count * node.bounds.perimeter();
+}
+
+float sb::StaticBVH::cost() const {
+	if (m_primitiveBounds.size() == 0)
+		return 0;
+	const auto rootPerimeter = m_nodes[0].bounds.perimeter();
+	if (rootPerimeter <= 0)
+		return (float)m_primitiveBounds.size();
+	return (float)(m_totalCost / rootPerimeter);
+}
+
+bool sb::StaticBVH::needsRebuild() const {
+	if (m_primitiveBounds.size() == 0)
+		return false;
+	//too much garbage in the arrays
+	if (m_deadNodes > m_nodes.size() / 2 || m_indices.size() > 2 * m_primitiveBounds.size() + SbBVHMaxLeafSize)
+		return true;
+	return cost() > m_builtCost * SbBVHRebuildRatio;
+}
+
+//Recomputes the bounds of the ancestors of node, stopping as soon as one of them doesn't change
+void sb::StaticBVH::refitParents(uint32_t node) {
+	auto id = m_nodes[node].parent;
+	while (id != SbNullNode) {
+		auto& n = m_nodes[id];
+		const auto b = getUnion(m_nodes[id + 1].bounds, m_nodes[n.offset].bounds);
+		if (b == n.bounds)
+			break;
+		m_totalCost -= nodeCost(n);
+		n.bounds = b;
+		m_totalCost += nodeCost(n);
+		id = n.parent;
+	}
+}
+
+//ORs mask into the ancestors of node, stopping at the first one that already has all of its bits
+void sb::StaticBVH::addMaskToParents(uint32_t node, size_t mask) {
+	auto id = m_nodes[node].parent;
+	while (id != SbNullNode && (m_nodes[id].mask | mask) != m_nodes[id].mask) {
+		m_nodes[id].mask |= mask;
+		id = m_nodes[id].parent;
+	}
+}
+
+size_t sb::StaticBVH::leafMask(const Node& leaf) const {
+	size_t mask = 0;
+	for (auto i = leaf.offset; i < leaf.offset + leaf.count; i++)
+		mask |= m_primitiveMasks[m_indices[i]];
+	return mask;
+}
+
+uint32_t sb::StaticBVH::insert(const AABB& bounds, size_t mask /*= std::numeric_limits<size_t>::max()*/) {
+	assert(m_primitiveBounds.size() < SbNullNode);
+	const auto primitive = (uint32_t)m_primitiveBounds.size();
+	m_primitiveBounds.push_back(bounds);
+	m_primitiveMasks.push_back(mask);
+
+	if (m_nodes.size() == 0) {
+		Node root;
+		root.bounds = bounds;
+		root.offset = (uint32_t)m_indices.size();
+		root.count = 1;
+		root.axis = SbBVHLeaf;
+		root.parent = SbNullNode;
+		root.mask = mask;
+		m_nodes.push_back(root);
+		m_indices.push_back(primitive);
+		m_leafOf.push_back(0);
+		m_totalCost = nodeCost(root);
+		m_builtCost = cost();
+		return primitive;
+	}
+
+	//we walk down to the child that grows the least
+	uint32_t id = 0;
+	while (!m_nodes[id].isLeaf()) {
+		const auto& left = m_nodes[id + 1].bounds;
+		const auto& right = m_nodes[m_nodes[id].offset].bounds;
+		const auto leftGrowth = growth(left, bounds);
+		const auto rightGrowth = growth(right, bounds);
+		if (leftGrowth < rightGrowth || (leftGrowth == rightGrowth && left.perimeter() <= right.perimeter()))
+			id = id + 1;
+		else
+			id = m_nodes[id].offset;
+	}
+
+	//the leaf range can only grow at the end of the index array, so it's moved there unless it already is
+	auto& leaf = m_nodes[id];
+	if (leaf.offset + leaf.count != m_indices.size()) {
+		const auto offset = (uint32_t)m_indices.size();
+		for (auto i = leaf.offset; i < leaf.offset + leaf.count; i++)
+			m_indices.push_back(m_indices[i]);
+		leaf.offset = offset;
+	}
+	m_indices.push_back(primitive);
+	m_leafOf.push_back(id);
+
+	m_totalCost -= nodeCost(leaf);
+	leaf.bounds = leaf.count == 0 ? bounds : getUnion(leaf.bounds, bounds);
+	leaf.mask = leaf.count == 0 ? mask : leaf.mask | mask;
+	leaf.count++;
+	m_totalCost += nodeCost(leaf);
+	refitParents(id);
+	addMaskToParents(id, mask);
+	return primitive;
+}
+
+void sb::StaticBVH::remove(uint32_t primitive) {
+	assert(primitive < m_primitiveBounds.size());
+	if (m_primitiveBounds.size() == 1) {
+		clear();
+		return;
+	}
+
+	const auto id = m_leafOf[primitive];
+	auto& leaf = m_nodes[id];
+	auto last = leaf.offset + leaf.count - 1;
+	for (auto i = leaf.offset; i <= last; i++) {
+		if (m_indices[i] == primitive) {
+			m_indices[i] = m_indices[last];
+			break;
+		}
+	}
+	m_totalCost -= nodeCost(leaf);
+	leaf.count--;
+	leaf.mask = leafMask(leaf);
+	if (leaf.count == 0) {
+		leaf.bounds = AABB::inverted();
+		collapse(id);
+	}
+	else {
+		leaf.bounds = AABB::inverted();
+		for (auto i = leaf.offset; i < leaf.offset + leaf.count; i++)
+			leaf.bounds.merge(m_primitiveBounds[m_indices[i]]);
+		m_totalCost += nodeCost(leaf);
+		refitParents(id);
+	}
+
+	//the last primitive takes the number of the removed one
+	const auto lastPrimitive = (uint32_t)(m_primitiveBounds.size() - 1);
+	if (primitive != lastPrimitive) {
+		const auto& lastLeaf = m_nodes[m_leafOf[lastPrimitive]];
+		for (auto i = lastLeaf.offset; i < lastLeaf.offset + lastLeaf.count; i++) {
+			if (m_indices[i] == lastPrimitive) {
+				m_indices[i] = primitive;
+				break;
+			}
+		}
+		m_leafOf[primitive] = m_leafOf[lastPrimitive];
+		m_primitiveBounds[primitive] = m_primitiveBounds[lastPrimitive];
+		m_primitiveMasks[primitive] = m_primitiveMasks[lastPrimitive];
+	}
+	m_primitiveBounds.pop_back();
+	m_primitiveMasks.pop_back();
+	m_leafOf.pop_back();
+}
+
+void sb::StaticBVH::setMask(uint32_t primitive, size_t mask) {
+	assert(primitive < m_primitiveMasks.size());
+	m_primitiveMasks[primitive] = mask;
+	const auto id = m_leafOf[primitive];
+	m_nodes[id].mask = leafMask(m_nodes[id]);
+	addMaskToParents(id, mask);
+}
+
+//A leaf just lost its last primitive. When its sibling is a leaf too, the parent takes the place of
+//the sibling. An inner sibling can't be moved (its left child must stay right after it), so then the
+//empty leaf is kept with inverted bounds, which no query can hit.
+void sb::StaticBVH::collapse(uint32_t emptyLeaf) {
+	const auto parent = m_nodes[emptyLeaf].parent;
+	assert(parent != SbNullNode);
+	const auto sibling = parent + 1 == emptyLeaf ? m_nodes[parent].offset : parent + 1;
+	if (!m_nodes[sibling].isLeaf()) {
+		refitParents(emptyLeaf);
+		return;
+	}
+
+	auto& p = m_nodes[parent];
+	const auto& s = m_nodes[sibling];
+	m_totalCost -= nodeCost(p) + nodeCost(s);
+	p.bounds = s.bounds;
+	p.offset = s.offset;
+	p.count = s.count;
+	p.mask = s.mask;
+	p.axis = SbBVHLeaf;
+	m_totalCost += nodeCost(p);
+	for (auto i = p.offset; i < p.offset + p.count; i++)
+		m_leafOf[m_indices[i]] = parent;
+	m_deadNodes += 2;
+	//if the sibling was empty as well, the parent is now an empty leaf
+	if (p.count == 0 && p.parent != SbNullNode)
+		collapse(parent);
+	else
+		refitParents(parent);
+}
+
+AABB sb::StaticBVH::bounds() const {
+	if (m_nodes.size() == 0)
+		return AABB();
+	return m_nodes[0].bounds;
+}
+
+int32_t sb::StaticBVH::computeDepth(uint32_t node) const {
+	const auto& n = m_nodes[node];
+	if (n.isLeaf())
+		return 0;
+	return 1 + std::max(computeDepth(node + 1), computeDepth(n.offset));
+}
+
+int32_t sb::StaticBVH::depth() const {
+	if (m_nodes.size() == 0)
+		return 0;
+	return computeDepth(0);
+}
+
+void sb::StaticBVH::validateNode(uint32_t id, std::vector<bool>& seen) const {
+	const auto& n = m_nodes[id];
+	if (n.isLeaf()) {
+		assert(n.offset + n.count <= m_indices.size());
+		for (auto i = n.offset; i < n.offset + n.count; i++) {
+			const auto p = m_indices[i];
+			assert(p < m_primitiveBounds.size());
+			assert(!seen[p]);
+			seen[p] = true;
+			assert(m_leafOf[p] == id);
+			assert(n.bounds.containsAABB(m_primitiveBounds[p]));
+			assert((m_primitiveMasks[p] & ~n.mask) == 0);
+		}
+		return;
+	}
+	assert(id + 1 < m_nodes.size() && n.offset < m_nodes.size());
+	assert(m_nodes[id + 1].parent == id);
+	assert(m_nodes[n.offset].parent == id);
+	const auto& left = m_nodes[id + 1].bounds;
+	const auto& right = m_nodes[n.offset].bounds;
+	assert(left.minx > left.maxx || n.bounds.containsAABB(left));
+	assert(right.minx > right.maxx || n.bounds.containsAABB(right));
+	assert((m_nodes[id + 1].mask & ~n.mask) == 0 && (m_nodes[n.offset].mask & ~n.mask) == 0);
+	validateNode(id + 1, seen);
+	validateNode(n.offset, seen);
+}
+
+void sb::StaticBVH::validate() const {
+	assert(m_leafOf.size() == m_primitiveBounds.size());
+	assert(m_primitiveMasks.size() == m_primitiveBounds.size());
+	if (m_nodes.size() == 0) {
+		assert(m_primitiveBounds.size() == 0);
+		return;
+	}
+	assert(m_nodes[0].parent == SbNullNode);
+	std::vector<bool> seen(m_primitiveBounds.size(), false);
+	validateNode(0, seen);
+	for (auto s : seen) {
+		assert(s);
+		(void)s;
+	}
+	//the cost kept by the incremental changes must match the tree
+	double total = 0;
+	SmallVector<uint32_t, 64> stack;
+	stack.push_back(0);
+	while (!stack.empty()) {
+		const auto id = stack.back();
+		stack.pop_back();
+		total += nodeCost(m_nodes[id]);
+		if (!m_nodes[id].isLeaf()) {
+			stack.push_back(id + 1);
+			stack.push_back(m_nodes[id].offset);
+		}
+	}
+	assert(fabs(total - m_totalCost) <= 1e-3 * std::max(1.0, total));
+	(void)total;
+}
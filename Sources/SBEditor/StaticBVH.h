@@ -0,0 +1,360 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#pragma once
+
+#include "AABB.h"
+#include "SmallVector.h"
+#include "SpatialStats.h"
+
+//Number of buckets the centroids are binned into when looking for the best split
+#define SbBVHBinCount 16
+//Leaves are always split past this size
+#define SbBVHMaxLeafSize 8
+//Cost of visiting a node relative to testing a primitive
+#define SbBVHTraversalCost 1.0f
+//Subtrees with at least this many primitives are built on another thread
+#define SbBVHParallelMinCount 4096
+//Subtrees are only handed to other threads this close to the root, which caps the number of tasks
+#define SbBVHParallelMaxDepth 6
+//Incremental changes trigger a rebuild once the expected query cost grows this much over the built tree
+#define SbBVHRebuildRatio 1.5f
+//Axis value that marks a leaf
+#define SbBVHLeaf 2
+#define SbNullNode ((uint32_t)-1)
+//Rays in a packet
+#define SbRayPacketSize 4
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <xmmintrin.h>
+#define SbRayPacketSSE
+#endif
+
+namespace sb {
+	//Rays walked through the tree together. All directions must be normalized, have no zero component and
+	//share their signs, so every ray orders the children the same way and the slab test needs no swaps.
+	struct RayPacket {
+		float originX[SbRayPacketSize];
+		float originY[SbRayPacketSize];
+		float invDirectionX[SbRayPacketSize];
+		float invDirectionY[SbRayPacketSize];
+		float maxT[SbRayPacketSize];
+		bool negative[2];
+	};
+
+	//Slab test of the rays in lanes against the box. Returns the lanes that hit it. Computes the same
+	//values as raySlab, so a ray hits the same boxes in a packet as on its own.
+	inline uint32_t packetSlab(const AABB& b, const RayPacket& p, uint32_t lanes) {
+		const auto nearX = p.negative[0] ? b.maxx : b.minx;
+		const auto farX = p.negative[0] ? b.minx : b.maxx;
+		const auto nearY = p.negative[1] ? b.maxy : b.miny;
+		const auto farY = p.negative[1] ? b.miny : b.maxy;
+#ifdef SbRayPacketSSE
+		const auto ox = _mm_loadu_ps(p.originX);
+		const auto oy = _mm_loadu_ps(p.originY);
+		const auto ix = _mm_loadu_ps(p.invDirectionX);
+		const auto iy = _mm_loadu_ps(p.invDirectionY);
+		auto tmin = _mm_max_ps(_mm_setzero_ps(), _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearX), ox), ix));
+		tmin = _mm_max_ps(tmin, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearY), oy), iy));
+		auto tmax = _mm_min_ps(_mm_loadu_ps(p.maxT), _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farX), ox), ix));
+		tmax = _mm_min_ps(tmax, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farY), oy), iy));
+		return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) & lanes;
+#else
+		uint32_t hits = 0;
+		for (uint32_t i = 0; i < SbRayPacketSize; i++) {
+			if (!(lanes & (1 << i)))
+				continue;
+			const auto tmin = std::max(std::max(0.0f, (nearX - p.originX[i]) * p.invDirectionX[i]), (nearY - p.originY[i]) * p.invDirectionY[i]);
+			const auto tmax = std::min(std::min(p.maxT[i], (farX - p.originX[i]) * p.invDirectionX[i]), (farY - p.originY[i]) * p.invDirectionY[i]);
+			if (tmin <= tmax)
+				hits |= 1 << i;
+		}
+		return hits;
+#endif
+	}
+
+	//Bounding volume hierarchy built top down with the binned surface area heuristic. Nodes are kept
+	//depth first in one array, so the left child of an inner node is always the next node and only the
+	//right one needs an index. Leaves point to a range of one shared index array.
+	//Primitives can also be inserted and removed without a build: they go into (or leave) a leaf and the
+	//bounds are refitted up to the root. That wears the tree down, so needsRebuild() tells when it's time
+	//for a new build.
+	//Each primitive has a mask and each node the OR of the masks below it, so queries for some of the bits skip
+	//the subtrees that have none of them. Removals leave the bits of inner nodes as they were until the next build.
+	class StaticBVH {
+	public:
+		struct Node {
+			AABB bounds;
+			//inner nodes: index of the right child. leaves: first position in the index array
+			uint32_t offset;
+			//number of primitives, 0 for inner nodes
+			uint32_t count;
+			//axis the node was split on (0 = x, 1 = y) or SbBVHLeaf
+			uint32_t axis;
+			uint32_t parent;
+			size_t mask;
+			inline bool isLeaf() const {
+				return axis == SbBVHLeaf;
+			}
+		};
+		//Constructors
+		StaticBVH();
+		//Building
+		//Builds the hierarchy over count primitives. Queries report primitives by their position in bounds.
+		//Big subtrees are built in parallel unless parallel is false; the result is the same either way.
+		//Without masks every primitive gets all the bits.
+		void build(const AABB* bounds, size_t count, bool parallel = true) {
+			build(bounds, nullptr, count, parallel);
+		}
+		void build(const AABB* bounds, const size_t* masks, size_t count, bool parallel = true);
+		void clear();
+		//Incremental changes
+		//Adds a primitive to the leaf that grows the least and returns its number, which is primitiveCount() - 1.
+		uint32_t insert(const AABB& bounds, size_t mask = std::numeric_limits<size_t>::max());
+		//Removes a primitive. Like a swap and pop, the last primitive takes its number.
+		void remove(uint32_t primitive);
+		void setMask(uint32_t primitive, size_t mask);
+		//True when the tree got so much worse than a fresh build that it should be rebuilt.
+		bool needsRebuild() const;
+		//Info
+		inline bool isEmpty() const {
+			return m_nodes.size() == 0;
+		}
+		inline size_t nodeCount() const {
+			return m_nodes.size();
+		}
+		inline size_t primitiveCount() const {
+			return m_primitiveBounds.size();
+		}
+		inline const AABB& primitiveBounds(uint32_t primitive) const {
+			assert(primitive < m_primitiveBounds.size());
+			return m_primitiveBounds[primitive];
+		}
+		inline size_t primitiveMask(uint32_t primitive) const {
+			assert(primitive < m_primitiveMasks.size());
+			return m_primitiveMasks[primitive];
+		}
+		inline const std::vector<Node>& nodes() const {
+			return m_nodes;
+		}
+		AABB bounds() const;
+		int32_t depth() const;
+		//Expected cost of a query, in primitive tests, according to the surface area heuristic
+		float cost() const;
+		void validate() const;
+		//Queries
+		//Every query only walks the nodes that have some bit of mask.
+		//callback(primitive) is called for each primitive in a leaf that overlaps aabb. Return false to stop.
+		template<class F>
+		void query(const AABB& aabb, F& callback, size_t mask = std::numeric_limits<size_t>::max()) const {
+			if (m_nodes.size() == 0)
+				return;
+			SmallVector<uint32_t, 64> stack;
+			stack.push_back(0);
+			while (!stack.empty()) {
+				const auto id = stack.back();
+				stack.pop_back();
+				SbCountStat(nodesVisited, 1);
+				const auto& node = m_nodes[id];
+				if (!(node.mask & mask) || !node.bounds.overlaps(aabb))
+					continue;
+				if (node.isLeaf()) {
+					for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+						if (!callback(m_indices[i]))
+							return;
+					}
+				}
+				else {
+					stack.push_back(node.offset);
+					stack.push_back(id + 1);
+				}
+			}
+		}
+		//callback(primitive) is called for each primitive in a leaf that contains pt. Return false to stop.
+		template<class F>
+		void query(const Vec2& pt, F& callback, size_t mask = std::numeric_limits<size_t>::max()) const {
+			if (m_nodes.size() == 0)
+				return;
+			SmallVector<uint32_t, 64> stack;
+			stack.push_back(0);
+			while (!stack.empty()) {
+				const auto id = stack.back();
+				stack.pop_back();
+				SbCountStat(nodesVisited, 1);
+				const auto& node = m_nodes[id];
+				if (!(node.mask & mask) || !node.bounds.containsPoint(pt))
+					continue;
+				if (node.isLeaf()) {
+					for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+						if (!callback(m_indices[i]))
+							return;
+					}
+				}
+				else {
+					stack.push_back(node.offset);
+					stack.push_back(id + 1);
+				}
+			}
+		}
+		//Walks the leaves hit by the ray before maxT, near side first. callback(primitive, maxT) returns
+		//the new maxT: the distance to the hit it found, or maxT itself to keep going. Returning 0 stops.
+		//direction must be normalized.
+		template<class F>
+		void rayCast(const Vec2& origin, const Vec2& direction, float maxT, F& callback, size_t mask = std::numeric_limits<size_t>::max()) const {
+			if (m_nodes.size() == 0)
+				return;
+			const bool negative[2] = { direction.x < 0, direction.y < 0 };
+			SmallVector<uint32_t, 64> stack;
+			float t;
+			stack.push_back(0);
+			while (!stack.empty()) {
+				const auto id = stack.back();
+				stack.pop_back();
+				SbCountStat(nodesVisited, 1);
+				const auto& node = m_nodes[id];
+				if (!(node.mask & mask) || !raySlab(node.bounds, origin, direction, maxT, &t))
+					continue;
+				if (node.isLeaf()) {
+					for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+						maxT = callback(m_indices[i], maxT);
+						if (maxT <= 0)
+							return;
+					}
+					continue;
+				}
+				//the near child goes last, so it's popped first
+				if (negative[node.axis]) {
+					stack.push_back(id + 1);
+					stack.push_back(node.offset);
+				}
+				else {
+					stack.push_back(node.offset);
+					stack.push_back(id + 1);
+				}
+			}
+		}
+		//Walks the leaves nearest first, skipping the ones farther than maxDistance from pt. callback(primitive,
+		//maxDistance) returns the new maxDistance, which is how far the search still has to go. A negative one stops.
+		template<class F>
+		void nearest(const Vec2& pt, float maxDistance, F& callback, size_t mask = std::numeric_limits<size_t>::max()) const {
+			if (m_nodes.size() == 0)
+				return;
+			struct Entry {
+				float distance;
+				uint32_t node;
+			};
+			auto farther = [](const Entry& a, const Entry& b) {
+				return a.distance > b.distance;
+			};
+			if (!(m_nodes[0].mask & mask))
+				return;
+			SmallVector<Entry, 64> heap;
+			heap.push_back({ pointDistance(m_nodes[0].bounds, pt), 0 });
+			while (!heap.empty()) {
+				std::pop_heap(heap.begin(), heap.end(), farther);
+				const auto entry = heap.back();
+				heap.pop_back();
+				SbCountStat(nodesVisited, 1);
+				//everything left in the heap is farther still
+				if (entry.distance > maxDistance)
+					return;
+				const auto& node = m_nodes[entry.node];
+				if (node.isLeaf()) {
+					for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+						maxDistance = callback(m_indices[i], maxDistance);
+						if (maxDistance < 0)
+							return;
+					}
+					continue;
+				}
+				const uint32_t children[2] = { entry.node + 1, node.offset };
+				for (auto child : children) {
+					if (!(m_nodes[child].mask & mask))
+						continue;
+					const auto d = pointDistance(m_nodes[child].bounds, pt);
+					if (d <= maxDistance) {
+						heap.push_back({ d, child });
+						std::push_heap(heap.begin(), heap.end(), farther);
+					}
+				}
+			}
+		}
+		//rayCast for a packet of rays. Each node is tested against every ray that hit its parent, and a leaf
+		//calls callback(lane, primitive, maxT) for each ray that hits it, so a ray visits the same leaves in
+		//the same order as it would on its own. Returning 0 stops that ray; lanes tells which rays are used.
+		template<class F>
+		void rayCast(RayPacket& packet, uint32_t lanes, F& callback, size_t mask = std::numeric_limits<size_t>::max()) const {
+			if (m_nodes.size() == 0)
+				return;
+			struct Entry {
+				uint32_t node;
+				uint32_t lanes;
+			};
+			SmallVector<Entry, 64> stack;
+			stack.push_back({ 0, lanes });
+			while (!stack.empty()) {
+				const auto entry = stack.back();
+				stack.pop_back();
+				SbCountStat(nodesVisited, 1);
+				const auto& node = m_nodes[entry.node];
+				if (!(node.mask & mask))
+					continue;
+				//rays stopped since the entry was pushed drop out here
+				const auto hits = packetSlab(node.bounds, packet, entry.lanes & lanes);
+				if (!hits)
+					continue;
+				if (node.isLeaf()) {
+					for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+						for (uint32_t lane = 0; lane < SbRayPacketSize; lane++) {
+							if (!(hits & lanes & (1 << lane)))
+								continue;
+							packet.maxT[lane] = callback(lane, m_indices[i], packet.maxT[lane]);
+							if (packet.maxT[lane] <= 0)
+								lanes &= ~(1 << lane);
+						}
+					}
+					if (!lanes)
+						return;
+					continue;
+				}
+				if (packet.negative[node.axis]) {
+					stack.push_back({ entry.node + 1, hits });
+					stack.push_back({ node.offset, hits });
+				}
+				else {
+					stack.push_back({ node.offset, hits });
+					stack.push_back({ entry.node + 1, hits });
+				}
+			}
+		}
+	private:
+		//Building
+		struct BuildRef;
+		uint32_t buildNode(std::vector<Node>& nodes, uint32_t parent, BuildRef* refs, uint32_t begin, uint32_t end, uint32_t depth, bool parallel);
+		static bool findSplit(const BuildRef* refs, uint32_t count, const AABB& nodeBounds, const AABB& centroidBounds,
+							  uint32_t* axis, uint32_t* splitBin);
+		//Incremental changes
+		double nodeCost(const Node& node) const;
+		void refitParents(uint32_t node);
+		void addMaskToParents(uint32_t node, size_t mask);
+		size_t leafMask(const Node& leaf) const;
+		void collapse(uint32_t emptyLeaf);
+		int32_t computeDepth(uint32_t node) const;
+		void validateNode(uint32_t node, std::vector<bool>& seen) const;
+		//Fields
+		std::vector<Node> m_nodes;
+		//Positions not covered by any leaf are left over from incremental changes
+		std::vector<uint32_t> m_indices;
+		std::vector<AABB> m_primitiveBounds;
+		std::vector<size_t> m_primitiveMasks;
+		std::vector<uint32_t> m_leafOf;
+		//Nodes cut off the tree by incremental changes
+		size_t m_deadNodes;
+		//Sum of the unnormalized node costs, kept up to date by the incremental changes
+		double m_totalCost;
+		float m_builtCost;
+	};
+}
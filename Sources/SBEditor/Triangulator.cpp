@@ -0,0 +1,406 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#include "pch.h"
+#include "Triangulator.h"
+#include "Polygon.h"
+#include "Rect.h"
+
+using namespace sb;
+
+namespace {
+	enum class VertexType {
+		start,
+		end,
+		split,
+		merge,
+		regular
+	};
+	//The sweep goes from top to bottom, and from left to right between points at the same height
+	inline bool above(const Vec2& p, const Vec2& q) {
+		return p.y > q.y || (p.y == q.y && p.x < q.x);
+	}
+	//Positive when r is to the left of the line from p to q
+	inline double orient(const Vec2& p, const Vec2& q, const Vec2& r) {
+		return ((double)q.x - p.x) * ((double)r.y - p.y) - ((double)q.y - p.y) * ((double)r.x - p.x);
+	}
+	//Every ring in one array, wound so that the interior is always on the left
+	struct Rings {
+		std::vector<Vec2> points;
+		std::vector<uint32_t> next;
+		std::vector<uint32_t> prev;
+
+		void add(const Polygon& p, bool ccw) {
+			assert(p.pointCount() >= 3);
+			const auto start = (uint32_t)points.size();
+			const auto count = (uint32_t)p.pointCount();
+			const bool flip = (p.signedArea() > 0) != ccw;
+			points.insert(points.end(), p.allPoints().begin(), p.allPoints().end());
+			for (uint32_t i = 0; i < count; i++) {
+				const auto n = start + (i + 1) % count;
+				const auto pr = start + (i + count - 1) % count;
+				next.push_back(flip ? pr : n);
+				prev.push_back(flip ? n : pr);
+			}
+		}
+	};
+	//Edge cut by the sweep line, from its upper to its lower point
+	struct SweepEdge {
+		Vec2 upper;
+		Vec2 lower;
+		mutable uint32_t helper;
+	};
+	//Orders the edges cut by the sweep line from left to right. The edge that starts lower has its start
+	//tested against the other, which spans it since edges don't cross.
+	struct SweepEdgeOrder {
+		bool operator()(const SweepEdge& a, const SweepEdge& b) const {
+			if (!above(a.upper, b.upper)) {
+				auto side = orient(b.upper, b.lower, a.upper);
+				if (side == 0)
+					side = orient(b.upper, b.lower, a.lower);
+				return side < 0;
+			}
+			else {
+				auto side = orient(a.upper, a.lower, b.upper);
+				if (side == 0)
+					side = orient(a.upper, a.lower, b.lower);
+				return side > 0;
+			}
+		}
+	};
+	typedef std::set<SweepEdge, SweepEdgeOrder> SweepStatus;
+
+	VertexType classify(const Rings& r, uint32_t v) {
+		const auto& p = r.points[r.prev[v]];
+		const auto& c = r.points[v];
+		const auto& n = r.points[r.next[v]];
+		const bool convex = orient(p, c, n) > 0;
+		if (above(c, p) && above(c, n))
+			return convex ? VertexType::start : VertexType::split;
+		else if (above(p, c) && above(n, c))
+			return convex ? VertexType::end : VertexType::merge;
+		else
+			return VertexType::regular;
+	}
+	//Diagonals that split the rings into y-monotone pieces
+	void monotoneDiagonals(const Rings& r, std::vector<std::pair<uint32_t, uint32_t>>& diagonals) {
+		const auto count = (uint32_t)r.points.size();
+		std::vector<uint32_t> order(count);
+		std::vector<VertexType> types(count);
+		for (uint32_t i = 0; i < count; i++) {
+			order[i] = i;
+			types[i] = classify(r, i);
+		}
+		std::sort(order.begin(), order.end(), [&r](uint32_t a, uint32_t b) {
+			return above(r.points[a], r.points[b]);
+		});
+
+		SweepStatus status;
+		std::vector<SweepStatus::iterator> edges(count, status.end());
+		const auto insertEdge = [&](uint32_t v) {
+			const auto& c = r.points[v];
+			const auto& n = r.points[r.next[v]];
+			SweepEdge e;
+			e.upper = above(c, n) ? c : n;
+			e.lower = above(c, n) ? n : c;
+			e.helper = v;
+			edges[v] = status.insert(e).first;
+		};
+		const auto removeEdge = [&](uint32_t v) {
+			assert(edges[v] != status.end());
+			status.erase(edges[v]);
+			edges[v] = status.end();
+		};
+		const auto leftOf = [&](uint32_t v) {
+			SweepEdge probe;
+			probe.upper = probe.lower = r.points[v];
+			auto it = status.lower_bound(probe);
+			assert(it != status.begin());
+			return --it;
+		};
+		const auto connectMerge = [&](uint32_t v, const SweepEdge& e) {
+			if (types[e.helper] == VertexType::merge)
+				diagonals.emplace_back(v, e.helper);
+		};
+
+		for (const auto v : order) {
+			const auto p = r.prev[v];
+			switch (types[v]) {
+			case VertexType::start:
+				insertEdge(v);
+				break;
+			case VertexType::end:
+				connectMerge(v, *edges[p]);
+				removeEdge(p);
+				break;
+			case VertexType::split: {
+				const auto e = leftOf(v);
+				diagonals.emplace_back(v, e->helper);
+				e->helper = v;
+				insertEdge(v);
+				break;
+			}
+			case VertexType::merge: {
+				connectMerge(v, *edges[p]);
+				removeEdge(p);
+				const auto e = leftOf(v);
+				connectMerge(v, *e);
+				e->helper = v;
+				break;
+			}
+			case VertexType::regular:
+				if (above(r.points[p], r.points[v])) {
+					//Interior to the right
+					connectMerge(v, *edges[p]);
+					removeEdge(p);
+					insertEdge(v);
+				}
+				else {
+					const auto e = leftOf(v);
+					connectMerge(v, *e);
+					e->helper = v;
+				}
+				break;
+			}
+		}
+	}
+	//Walks the faces the rings and the diagonals enclose, each a y-monotone polygon wound counter-clockwise
+	template<typename F>
+	void forEachFace(const Rings& r, const std::vector<std::pair<uint32_t, uint32_t>>& diagonals, const F& faceFunction) {
+		const auto count = (uint32_t)r.points.size();
+		//Neighbours of each point, counter-clockwise
+		std::vector<uint32_t> offsets(count + 1, 2);
+		offsets[count] = 0;
+		for (const auto& d : diagonals) {
+			offsets[d.first]++;
+			offsets[d.second]++;
+		}
+		uint32_t total = 0;
+		for (uint32_t i = 0; i <= count; i++) {
+			const auto degree = offsets[i];
+			offsets[i] = total;
+			total += degree;
+		}
+		std::vector<uint32_t> neighbours(total);
+		std::vector<float> angles(total);
+		std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (uint32_t i = 0; i < count; i++) {
+			neighbours[fill[i]++] = r.next[i];
+			neighbours[fill[i]++] = r.prev[i];
+		}
+		for (const auto& d : diagonals) {
+			neighbours[fill[d.first]++] = d.second;
+			neighbours[fill[d.second]++] = d.first;
+		}
+		const auto angle = [&r](uint32_t from, uint32_t to) {
+			const auto d = r.points[to] - r.points[from];
+			return atan2f(d.y, d.x);
+		};
+		std::vector<std::pair<float, uint32_t>> sorted;
+		for (uint32_t i = 0; i < count; i++) {
+			sorted.clear();
+			for (auto k = offsets[i]; k < offsets[i + 1]; k++)
+				sorted.emplace_back(angle(i, neighbours[k]), neighbours[k]);
+			std::sort(sorted.begin(), sorted.end());
+			for (auto k = offsets[i]; k < offsets[i + 1]; k++) {
+				angles[k] = sorted[k - offsets[i]].first;
+				neighbours[k] = sorted[k - offsets[i]].second;
+			}
+		}
+		//Half edges going around the rings backwards face the outside
+		std::vector<bool> visited(total, false);
+		for (uint32_t i = 0; i < count; i++) {
+			for (auto k = offsets[i]; k < offsets[i + 1]; k++) {
+				if (neighbours[k] == r.prev[i] && neighbours[k] != r.next[i]) {
+					visited[k] = true;
+					break;
+				}
+			}
+		}
+
+		std::vector<uint32_t> face;
+		for (uint32_t i = 0; i < count; i++) {
+			for (auto k = offsets[i]; k < offsets[i + 1]; k++) {
+				if (visited[k])
+					continue;
+				face.clear();
+				auto from = i;
+				auto edge = k;
+				while (!visited[edge]) {
+					visited[edge] = true;
+					face.push_back(from);
+					//Next edge of the face is the one clockwise from the way back
+					const auto to = neighbours[edge];
+					const auto first = angles.begin() + offsets[to];
+					const auto last = angles.begin() + offsets[to + 1];
+					auto back = (uint32_t)(std::lower_bound(first, last, angle(to, from)) - angles.begin());
+					while (neighbours[back] != from)
+						back++;
+					edge = back == offsets[to] ? offsets[to + 1] - 1 : back - 1;
+					from = to;
+				}
+				faceFunction(face);
+			}
+		}
+	}
+	//Stack triangulation of a y-monotone polygon wound counter-clockwise
+	void triangulateMonotone(const Rings& r, const std::vector<uint32_t>& face, std::vector<uint32_t>& indices, std::vector<std::pair<uint32_t, bool>>& sorted, std::vector<std::pair<uint32_t, bool>>& stack) {
+		const auto count = face.size();
+		assert(count >= 3);
+		const auto emit = [&](uint32_t a, uint32_t b, uint32_t c) {
+			if (orient(r.points[a], r.points[b], r.points[c]) < 0)
+				std::swap(b, c);
+			indices.push_back(a);
+			indices.push_back(b);
+			indices.push_back(c);
+		};
+		if (count == 3) {
+			emit(face[0], face[1], face[2]);
+			return;
+		}
+		size_t top = 0, bottom = 0;
+		for (size_t i = 1; i < count; i++) {
+			if (above(r.points[face[i]], r.points[face[top]]))
+				top = i;
+			if (above(r.points[face[bottom]], r.points[face[i]]))
+				bottom = i;
+		}
+		//Going forward from the top walks down the left chain, going backwards walks down the right one
+		sorted.clear();
+		sorted.emplace_back(face[top], true);
+		auto left = (top + 1) % count;
+		auto right = (top + count - 1) % count;
+		while (left != bottom || right != bottom) {
+			if (right == bottom || (left != bottom && above(r.points[face[left]], r.points[face[right]]))) {
+				sorted.emplace_back(face[left], true);
+				left = (left + 1) % count;
+			}
+			else {
+				sorted.emplace_back(face[right], false);
+				right = (right + count - 1) % count;
+			}
+		}
+		sorted.emplace_back(face[bottom], true);
+
+		stack.clear();
+		stack.push_back(sorted[0]);
+		stack.push_back(sorted[1]);
+		for (size_t j = 2; j < count - 1; j++) {
+			const auto u = sorted[j];
+			if (u.second != stack.back().second) {
+				while (stack.size() > 1) {
+					const auto a = stack.back().first;
+					stack.pop_back();
+					emit(u.first, a, stack.back().first);
+				}
+				stack.clear();
+				stack.push_back(sorted[j - 1]);
+				stack.push_back(u);
+			}
+			else {
+				auto last = stack.back();
+				stack.pop_back();
+				while (!stack.empty()) {
+					const auto& pu = r.points[u.first];
+					const auto& pl = r.points[last.first];
+					const auto& ps = r.points[stack.back().first];
+					const auto side = u.second ? orient(ps, pl, pu) : orient(pu, pl, ps);
+					if (side <= 0)
+						break;
+					emit(u.first, last.first, stack.back().first);
+					last = stack.back();
+					stack.pop_back();
+				}
+				stack.push_back(last);
+				stack.push_back(u);
+			}
+		}
+		const auto u = sorted[count - 1].first;
+		while (stack.size() > 1) {
+			const auto a = stack.back().first;
+			stack.pop_back();
+			emit(u, a, stack.back().first);
+		}
+	}
+
+	void triangulateRings(const Rings& r, std::vector<uint32_t>& indices, uint32_t base) {
+		std::vector<std::pair<uint32_t, uint32_t>> diagonals;
+		monotoneDiagonals(r, diagonals);
+		const auto start = indices.size();
+		std::vector<std::pair<uint32_t, bool>> sorted, stack;
+		forEachFace(r, diagonals, [&](const std::vector<uint32_t>& face) {
+			triangulateMonotone(r, face, indices, sorted, stack);
+		});
+		if (base != 0) {
+			for (auto i = start; i < indices.size(); i++)
+				indices[i] += base;
+		}
+	}
+
+	void makeRings(const Polygon& outline, const std::vector<Polygon>* holes, Rings& r) {
+		assert(outline.isClosed());
+		size_t count = outline.pointCount();
+		if (holes) {
+			for (const auto& h : *holes)
+				count += h.pointCount();
+		}
+		r.points.reserve(count);
+		r.next.reserve(count);
+		r.prev.reserve(count);
+		r.add(outline, true);
+		if (holes) {
+			for (const auto& h : *holes) {
+				assert(h.isClosed());
+				r.add(h, false);
+			}
+		}
+	}
+
+	void triangulateIntoMesh(const Polygon& outline, const std::vector<Polygon>* holes, const Rect& uvBounds, BasicMesh* mesh) {
+		assert(mesh);
+		assert(uvBounds.width() > 0 && uvBounds.height() > 0);
+		Rings r;
+		makeRings(outline, holes, r);
+		const auto vbStart = mesh->VBCount();
+		const auto ibStart = mesh->IBCount();
+		std::vector<uint32_t> indices;
+		indices.reserve(3 * Triangulator::triangleCount(r.points.size(), holes ? holes->size() : 0));
+		triangulateRings(r, indices, (uint32_t)vbStart);
+
+		mesh->setVBCount(vbStart + r.points.size());
+		auto vertex = mesh->VB() + vbStart;
+		const auto left = uvBounds.left(), top = uvBounds.top();
+		const auto w = uvBounds.width(), h = uvBounds.height();
+		for (const auto& pt : r.points) {
+			vertex->setPosition(pt);
+			vertex->setTexture((pt.x - left) / w, (top - pt.y) / h);
+			vertex++;
+		}
+		mesh->copyIndexes(ibStart, indices.data(), indices.size());
+	}
+}
+
+void Triangulator::triangulate(const Polygon& outline, std::vector<uint32_t>* indices) {
+	assert(indices);
+	Rings r;
+	makeRings(outline, nullptr, r);
+	triangulateRings(r, *indices, 0);
+}
+
+void Triangulator::triangulate(const Polygon& outline, const std::vector<Polygon>& holes, std::vector<uint32_t>* indices) {
+	assert(indices);
+	Rings r;
+	makeRings(outline, &holes, r);
+	triangulateRings(r, *indices, 0);
+}
+
+void Triangulator::triangulate(const Polygon& outline, const Rect& uvBounds, BasicMesh* mesh) {
+	triangulateIntoMesh(outline, nullptr, uvBounds, mesh);
+}
+
+void Triangulator::triangulate(const Polygon& outline, const std::vector<Polygon>& holes, const Rect& uvBounds, BasicMesh* mesh) {
+	triangulateIntoMesh(outline, &holes, uvBounds, mesh);
+}
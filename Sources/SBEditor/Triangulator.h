@@ -0,0 +1,33 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#pragma once
+
+#include "BasicVertex.h"
+
+namespace sb {
+	//Forward Declarations
+	struct Polygon;
+	struct Rect;
+	//Triangulation of simple polygons with holes. A sweep line splits the polygon into y-monotone pieces and
+	//each piece is triangulated with a stack, O(n log n) in total. Points must be distinct and the holes must
+	//lie inside the outline without touching it or each other. Either winding is accepted for every ring.
+	class Triangulator {
+	public:
+		//Appends counter-clockwise triangles to indices. The indices refer to the outline points followed by
+		//the points of each hole, in order.
+		static void triangulate(const Polygon& outline, std::vector<uint32_t>* indices);
+		static void triangulate(const Polygon& outline, const std::vector<Polygon>& holes, std::vector<uint32_t>* indices);
+		//Appends the vertices and indices to mesh. uvBounds is mapped to the whole texture, its top left
+		//corner to uv (0, 0).
+		static void triangulate(const Polygon& outline, const Rect& uvBounds, BasicMesh* mesh);
+		static void triangulate(const Polygon& outline, const std::vector<Polygon>& holes, const Rect& uvBounds, BasicMesh* mesh);
+		//Triangle count for the given number of points and holes
+		static inline size_t triangleCount(size_t pointCount, size_t holeCount) {
+			return pointCount + 2 * holeCount - 2;
+		}
+	};
+}
@@ -0,0 +1,70 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "Affine2.h"
+#include <random>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace sb;
+
+namespace SBTest
+{
+	TEST_CLASS(Affine2Tests) {
+
+		TEST_METHOD(testTransformations) {
+			auto t = Affine2::fromTranslation(1, 2);
+			Assert::IsTrue(t.transformedVector(Vec2::zero) == Vec2::zero, L"Translation Failed.");
+			Assert::IsTrue(t.transformedPoint(Vec2::zero) == Vec2(1, 2), L"Translation Failed.");
+			auto s = Affine2::fromScale(2, 3);
+			Assert::IsTrue(s.transformedVector(Vec2(7, 5)) == Vec2(14, 15), L"Scale Failed");
+			auto r = Affine2::fromRotation(SbToRadians(90));
+			Assert::IsTrue(aeq(r.transformedVector(Vec2::right), Vec2::up), L"Rotation Failed");
+		}
+
+		TEST_METHOD(testConversions) {
+			auto m = Matrix3x3::fromRotation(SbToRadians(30)) * Matrix3x3::fromScale(2, 3);
+			m.setTranslation(4, 5);
+			Assert::IsTrue(m.isAffine(), L"m should be affine.");
+			auto a = Affine2(m);
+			Assert::IsTrue(a.toMatrix3x3() == m, L"Conversion round trip failed.");
+			Assert::IsTrue(Affine2::identity.toMatrix3x3() == Matrix3x3::identity, L"Identity conversion failed.");
+			Assert::IsTrue(Affine2::fromSkew(1, 2).toMatrix3x3() == Matrix3x3::fromSkew(1, 2), L"Skew conversion failed.");
+			Assert::IsTrue(Affine2::fromRotation(0.5f).toMatrix3x3() == Matrix3x3::fromRotation(0.5f), L"Rotation conversion failed.");
+			Assert::IsFalse((Matrix3x3::identity * 2.0f).isAffine(), L"A scaled bottom row isn't affine.");
+		}
+
+		TEST_METHOD(testCompose) {
+			std::mt19937 rng(777);
+			std::uniform_real_distribution<float> unit(-5, 5);
+			for (int i = 0; i < 100; i++) {
+				auto a = Affine2::fromRotation(unit(rng)) * Affine2::fromScale(unit(rng), unit(rng));
+				a.setTranslation(unit(rng), unit(rng));
+				auto b = Affine2::fromSkew(unit(rng), unit(rng)) * Affine2::fromTranslation(unit(rng), unit(rng));
+				//The terms the 3x3 product adds for the bottom row are exact zeros and ones
+				Assert::IsTrue((a * b).toMatrix3x3() == a.toMatrix3x3() * b.toMatrix3x3(), L"Compose failed.");
+				auto c = a;
+				c *= b;
+				Assert::IsTrue(c == a * b, L"Compose in place failed.");
+				const auto pt = Vec2(unit(rng), unit(rng));
+				Assert::IsTrue(a.transformedPoint(pt) == a.toMatrix3x3().transformedPoint(pt), L"Transform failed.");
+			}
+		}
+
+		TEST_METHOD(testInverse) {
+			auto r = Affine2::fromRotation(SbToRadians(45));
+			r.setTranslation(3, -2);
+			auto i = r.inverse();
+			Assert::IsTrue((r * i).isIdentity(true), L"r * i is not identity.");
+			Assert::IsTrue((i * r).isIdentity(true), L"i * r is not identity.");
+			auto m = Affine2::fromSkew(0.5f, 0.25f) * Affine2::fromScale(2, 4) * Affine2::fromTranslation(1, 1);
+			Assert::IsTrue(aeq(m.inverse().toMatrix3x3(), m.toMatrix3x3().inverse()), L"Inverse differs from Matrix3x3.");
+			Assert::IsTrue(aeq(m.inverse().transformedPoint(m.transformedPoint(Vec2(7, 3))), Vec2(7, 3)), L"Inverse transform failed.");
+		}
+
+	};
+}
\ No newline at end of file
@@ -15,11 +15,30 @@ You can't use, distribute or modify this code without my permission.
 #include "Intersection.h"
 #include "Option.h"
 #include "Matrix3x3.h"
+#include <random>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace sb;
 
 namespace sb {
+	//Convex hull with 16 to 32 points on an ellipse, in counterclockwise order before the rotation
+	static Polygon randomHull(std::mt19937& rng) {
+		std::uniform_real_distribution<float> unit(0, 1);
+		std::uniform_int_distribution<int> sides(16, 32);
+		std::vector<float> angles(sides(rng));
+		for (auto& angle : angles)
+			angle = unit(rng) * 2 * SbPI;
+		std::sort(angles.begin(), angles.end());
+		angles.erase(std::unique(angles.begin(), angles.end()), angles.end());
+		const auto rx = 0.5f + unit(rng) * 2;
+		const auto ry = 0.5f + unit(rng) * 2;
+		const auto center = Vec2(unit(rng) * 6, unit(rng) * 6);
+		std::vector<Vec2> points;
+		for (const auto angle : angles)
+			points.push_back(center + Vec2(cosf(angle) * rx, sinf(angle) * ry));
+		return Matrix3x3::fromRotation(unit(rng) * 2 * SbPI).transformedPolygon(Polygon(points));
+	}
+
 	TEST_CLASS(IntersectionTests) {
 
 		TEST_METHOD(testRayIntersection) {
@@ -200,5 +219,138 @@ namespace sb {
 			Assert::IsTrue(aeq(result.penetration, 0));
 		}
 
+		TEST_METHOD(testPolygonIntersectionGJK) {
+			Polygon a = Rect(Vec2(0.5f, 0.5f), Vec2::one).toPolygon();
+			Polygon b = Rect(Vec2(1.5f, 0.5f), Vec2::one).toPolygon();
+			auto result = Intersection::get(a, b, PolygonAlgorithm::gjk);
+			Assert::IsTrue(!result.empty);
+			Assert::IsTrue(aeq(result.penetration, 0));
+			Assert::IsTrue(aeq(result.normal, Vec2::left));
+			result = Intersection::get(b, a, PolygonAlgorithm::gjk);
+			Assert::IsTrue(!result.empty);
+			Assert::IsTrue(aeq(result.penetration, 0));
+			Assert::IsTrue(aeq(result.normal, Vec2::right));
+			Assert::IsTrue(Intersection::distance(a, b) == 0);
+			Polygon c = Matrix3x3::fromRotation(SbToRadians(45)).transformedPolygon(a);
+			Assert::IsTrue(Intersection::get(c, b, PolygonAlgorithm::gjk).empty);
+			Assert::IsFalse(Intersection::test(c, b, PolygonAlgorithm::gjk));
+			Assert::IsTrue(aeq(Intersection::distance(c, b), 1 - sqrtf(0.5f)));
+			a = Matrix3x3::fromRotation(SbToRadians(-45)).transformedPolygon(a);
+			result = Intersection::get(a, b, PolygonAlgorithm::gjk);
+			Assert::IsTrue(!result.empty);
+			a = Matrix3x3::fromTranslation(result.penetration * result.normal * 0.9999f).transformedPolygon(a);
+			result = Intersection::get(a, b, PolygonAlgorithm::gjk);
+			Assert::IsTrue(!result.empty);
+			Assert::IsTrue(aeq(result.penetration, 0));
+
+			//The global setting picks the algorithm of the calls that don't take one
+			Assert::IsTrue(Intersection::polygonAlgorithm() == PolygonAlgorithm::sat);
+			Intersection::setPolygonAlgorithm(PolygonAlgorithm::gjk);
+			Assert::IsTrue(Intersection::get(c, b).empty);
+			Assert::IsTrue(Intersection::test(a, b));
+			Intersection::setPolygonAlgorithm(PolygonAlgorithm::sat);
+		}
+
+		TEST_METHOD(testSupportPoint) {
+			std::mt19937 rng(1357);
+			std::uniform_real_distribution<float> unit(0, 1);
+			for (int i = 0; i < 50; i++) {
+				const auto p = randomHull(rng);
+				for (int j = 0; j < 50; j++) {
+					const auto angle = unit(rng) * 2 * SbPI;
+					const auto direction = Vec2(cosf(angle), sinf(angle));
+					auto best = std::numeric_limits<float>::lowest();
+					for (const auto& pt : p.allPoints())
+						best = std::max(best, dot(pt, direction));
+					Assert::IsTrue(dot(p.supportPoint(direction), direction) == best);
+				}
+			}
+			//Collinear points give the climb no slope
+			Polygon square({ Vec2(0, 0), Vec2(1, 0), Vec2(2, 0), Vec2(2, 2), Vec2(0, 2) });
+			Assert::IsTrue(square.supportPoint(Vec2::down).y == 0);
+			Assert::IsTrue(square.supportPoint(Vec2::up).y == 2);
+			Assert::IsTrue(square.supportPoint(Vec2::right).x == 2);
+			Assert::IsTrue(square.supportPoint(Vec2::left).x == 0);
+		}
+
+		TEST_METHOD(testSATCoherence) {
+			std::mt19937 rng(8080);
+			std::uniform_real_distribution<float> unit(0, 1);
+			for (int i = 0; i < 20; i++) {
+				const auto a = randomHull(rng);
+				auto b = randomHull(rng);
+				const auto rect = Rect(Vec2(unit(rng) * 6, unit(rng) * 6), Vec2(1 + unit(rng), 1 + unit(rng)));
+				const auto rectPolygon = rect.toPolygon();
+				const auto circle = Circle(Vec2(unit(rng) * 6, unit(rng) * 6), 0.5f + unit(rng));
+				//Step b across a so the hints carry over between frames
+				const auto step = Matrix3x3::fromTranslation(Vec2(unit(rng) - 0.5f, unit(rng) - 0.5f) * 0.5f);
+				for (int frame = 0; frame < 40; frame++) {
+					b = step.transformedPolygon(b);
+					const auto sat = Intersection::get(a, b, PolygonAlgorithm::sat);
+					const auto gjk = Intersection::get(a, b, PolygonAlgorithm::gjk);
+					if (Intersection::distance(a, b) > 0.001f)
+						Assert::IsTrue(sat.empty);
+					else if (!sat.empty && sat.penetration > 0.001f) {
+						Assert::IsTrue(fabsf(gjk.penetration - sat.penetration) <= 0.001f);
+						Assert::IsTrue(dot(gjk.normal, sat.normal) >= 0.999f);
+					}
+					const auto withRect = Intersection::get(b, rect);
+					const auto withRectPolygon = Intersection::get(b, rectPolygon, PolygonAlgorithm::gjk);
+					Assert::IsTrue(withRect.empty == withRectPolygon.empty || Intersection::distance(b, rectPolygon) <= 0.001f);
+					if (!withRect.empty && withRect.penetration > 0.001f)
+						Assert::IsTrue(fabsf(withRect.penetration - withRectPolygon.penetration) <= 0.001f);
+					const auto withCircle = Intersection::get(b, circle);
+					const auto separation = (b.closestPointFrom(circle.center()) - circle.center()).length();
+					if (!b.containsPoint(circle.center()) && separation > circle.radius() + 0.001f)
+						Assert::IsTrue(withCircle.empty);
+					else if (separation < circle.radius() - 0.001f)
+						Assert::IsFalse(withCircle.empty);
+				}
+			}
+		}
+
+		TEST_METHOD(testGJKAgreesWithSAT) {
+			std::mt19937 rng(2468);
+			std::uniform_real_distribution<float> unit(0, 1);
+			auto hull = [&]() {
+				return randomHull(rng);
+			};
+			size_t overlapping = 0;
+			size_t separated = 0;
+			for (int i = 0; i < 1000; i++) {
+				const auto a = hull();
+				const auto b = hull();
+				if (!a.isConvex() || !b.isConvex())
+					continue;
+				const auto sat = Intersection::get(a, b, PolygonAlgorithm::sat);
+				const auto gjk = Intersection::get(a, b, PolygonAlgorithm::gjk);
+				const auto distance = Intersection::distance(a, b);
+				if (!sat.empty && sat.penetration > 0.001f) {
+					overlapping++;
+					Assert::IsFalse(gjk.empty);
+					Assert::IsTrue(Intersection::test(a, b, PolygonAlgorithm::gjk));
+					Assert::IsTrue(distance == 0);
+					Assert::IsTrue(fabsf(gjk.penetration - sat.penetration) <= 0.001f);
+					Assert::IsTrue(dot(gjk.normal, sat.normal) >= 0.999f);
+				}
+				else if (sat.empty) {
+					//Compare the distance with the closest vertex to edge pair
+					auto expected = std::numeric_limits<float>::max();
+					for (const auto& pt : a.allPoints())
+						expected = std::min(expected, (b.closestPointFrom(pt) - pt).length());
+					for (const auto& pt : b.allPoints())
+						expected = std::min(expected, (a.closestPointFrom(pt) - pt).length());
+					Assert::IsTrue(fabsf(distance - expected) <= 0.001f);
+					if (expected > 0.001f) {
+						separated++;
+						Assert::IsTrue(gjk.empty);
+						Assert::IsFalse(Intersection::test(a, b, PolygonAlgorithm::gjk));
+					}
+				}
+			}
+			Assert::IsTrue(overlapping > 100);
+			Assert::IsTrue(separated > 100);
+		}
+
 	};
 }
\ No newline at end of file
@@ -7,6 +7,7 @@ You can't use, distribute or modify this code without my permission.
 #include "pch.h"
 #include "CppUnitTest.h"
 #include "Matrix3x3.h"
+#include <random>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace sb;
@@ -50,5 +51,56 @@ namespace SBTest
 			Assert::IsTrue(aeq(r, Matrix3x3::identity), L"Transpose failed.");
 		}
 
+		TEST_METHOD(testTransformPoints) {
+			std::mt19937 rng(31337);
+			std::uniform_real_distribution<float> unit(-10, 10);
+			for (size_t count = 0; count < 40; count++) {
+				auto m = Matrix3x3::fromRotation(unit(rng)) * Matrix3x3::fromScale(unit(rng), unit(rng));
+				m.setTranslation(unit(rng), unit(rng));
+				std::vector<Vec2> in(count);
+				for (auto& v : in)
+					v = Vec2(unit(rng), unit(rng));
+				std::vector<Vec2> out(count);
+				m.transformPoints(in.data(), out.data(), count);
+				for (size_t i = 0; i < count; i++)
+					Assert::IsTrue(out[i] == m.transformedPoint(in[i]), L"Batch transform isn't bit exact.");
+				//In place
+				m.transformPoints(in.data(), in.data(), count);
+				Assert::IsTrue(in == out, L"In place batch transform failed.");
+			}
+		}
+
+		TEST_METHOD(testTransformVertices) {
+			struct Vertex {
+				float x, y;
+				float u, v;
+			};
+			std::mt19937 rng(4242);
+			std::uniform_real_distribution<float> unit(-10, 10);
+			for (size_t count = 0; count < 40; count++) {
+				auto m = Matrix3x3::fromRotation(unit(rng)) * Matrix3x3::fromSkew(unit(rng), unit(rng));
+				m.setTranslation(unit(rng), unit(rng));
+				std::vector<Vertex> vertices(count);
+				for (auto& v : vertices)
+					v = { unit(rng), unit(rng), unit(rng), unit(rng) };
+				auto expected = vertices;
+				for (auto& v : expected) {
+					const auto pt = m.transformedPoint(Vec2(v.x, v.y));
+					v.x = pt.x;
+					v.y = pt.y;
+				}
+				//Strided into a packed array
+				std::vector<Vec2> packed(count);
+				if (count != 0)
+					m.transformPoints(&vertices[0].x, sizeof(Vertex), &packed[0].x, sizeof(Vec2), count);
+				m.transformVertices(vertices.data(), count);
+				for (size_t i = 0; i < count; i++) {
+					Assert::IsTrue(vertices[i].x == expected[i].x && vertices[i].y == expected[i].y, L"Vertex transform isn't bit exact.");
+					Assert::IsTrue(vertices[i].u == expected[i].u && vertices[i].v == expected[i].v, L"Vertex transform changed the texture coordinates.");
+					Assert::IsTrue(packed[i] == Vec2(expected[i].x, expected[i].y), L"Strided transform isn't bit exact.");
+				}
+			}
+		}
+
 	};
 }
\ No newline at end of file
@@ -9,8 +9,15 @@ You can't use, distribute or modify this code without my permission.
 #include "SpatialTree.h"
 #include "Shape.h"
 #include "Rect.h"
+#include "Circle.h"
+#include "Polygon.h"
 #include "Ray.h"
 #include "Matrix3x3.h"
+#include "Intersection.h"
+#include "Option.h"
+#include "StaticBVH.h"
+#include <random>
+#include <thread>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace sb;
@@ -114,5 +121,1482 @@ namespace sb {
 			delete d;
 		}
 
+		TEST_METHOD(testDynamicAABBTree) {
+			Shape* a = Shape::fromRect(Rect(Vec2(1.5f, 1.5f), Vec2::one));
+			Shape* b = Shape::fromRect(Rect(Vec2(-1.5f, 1.5f), Vec2::one));
+			Shape* c = Shape::fromRect(Rect(Vec2(1.5f, -1.5f), Vec2::one));
+			Shape* d = Shape::fromRect(Rect(Vec2(-1.5f, -1.5f), Vec2::one));
+
+			SpatialTree* tree = SpatialTree::create(DynamicStructure::aabbTree);
+			tree->addDynamicNode(a);
+			tree->addDynamicNode(b);
+			tree->addDynamicNode(c);
+			tree->addDynamicNode(d);
+			auto r = tree->rayCast(Ray(Vec2::zero, Vec2::one));
+			Assert::IsTrue(!r.empty);
+			Assert::IsTrue(r.intersected == a);
+			r = tree->rayCast(Ray(Vec2::zero, -Vec2::one));
+			Assert::IsTrue(!r.empty);
+			Assert::IsTrue(r.intersected == d);
+			r = tree->rayCast(Ray(Vec2::zero, Vec2::up));
+			Assert::IsTrue(r.empty);
+
+			RangeQueryResult q;
+			tree->rangeQuery(&q, Rect(1, 1, 2, 6));
+			Assert::IsTrue(q.count == 2);
+			Assert::IsTrue(q.shapes[0] != b && q.shapes[0] != d);
+			Assert::IsTrue(q.shapes[1] != b && q.shapes[1] != d);
+			q.clear();
+
+			tree->pickQuery(&q, Vec2(-1.6f, 1.6f));
+			Assert::IsTrue(q.count == 1);
+			Assert::IsTrue(q.shapes[0] == b);
+
+			//Apply transform
+			auto m = Matrix3x3::fromTranslation(6, 6);
+			tree->transform(a, m);
+			r = tree->rayCast(Ray(Vec2::zero, Vec2::one));
+			Assert::IsTrue(!r.empty);
+			Assert::IsTrue(r.intersected == a);
+			m = Matrix3x3::fromTranslation(6, 0);
+			tree->transform(a, m);
+			r = tree->rayCast(Ray(Vec2::zero, Vec2::one));
+			Assert::IsTrue(r.empty);
+			m = Matrix3x3::fromTranslation(0, 3);
+			tree->transform(c, m);
+			r = tree->rayCast(Ray(Vec2::zero, Vec2::one));
+			Assert::IsTrue(!r.empty);
+			Assert::IsTrue(r.intersected == c);
+			//Test range
+			q.clear();
+			tree->rangeQuery(&q, Rect(1, 1, 2, 6));
+			Assert::IsTrue(q.count == 1);
+			Assert::IsTrue(q.shapes[0] == c);
+
+			delete tree;
+			delete a;
+			delete b;
+			delete c;
+			delete d;
+		}
+
+		TEST_METHOD(testDynamicStructuresAgainstBruteForce) {
+			std::mt19937 rng(1234);
+			std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+			std::uniform_real_distribution<float> size(0.1f, 12.0f);
+			std::uniform_real_distribution<float> step(-2.0f, 2.0f);
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				for (size_t i = 0; i < 200; i++) {
+					auto s = Shape::fromRect(Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng))));
+					shapes.push_back(s);
+					tree->addDynamicNode(s);
+				}
+
+				for (size_t frame = 0; frame < 10; frame++) {
+					for (auto s : shapes)
+						tree->transform(s, Matrix3x3::fromTranslation(step(rng), step(rng)));
+
+					for (size_t k = 0; k < 20; k++) {
+						auto range = Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng)));
+						std::set<Shape*> expected;
+						for (auto s : shapes) {
+							if (Intersection::test(s->bounds(), range))
+								expected.insert(s);
+						}
+						RangeQueryResult q;
+						tree->rangeQuery(&q, range);
+						if (expected.size() < SbMaxCollisions) {
+							Assert::IsTrue(q.count == expected.size());
+							for (size_t i = 0; i < q.count; i++)
+								Assert::IsTrue(expected.count(q.shapes[i]) == 1);
+						}
+						else
+							Assert::IsTrue(q.isFull());
+
+						auto ray = Ray(Vec2(position(rng), position(rng)), Vec2(step(rng), step(rng)));
+						if (ray.direction().isZero(true))
+							continue;
+						Option<float> closest = nullptr;
+						for (auto s : shapes) {
+							auto pt = Intersection::get(ray, s->Rect());
+							if (pt.hasValue() && (!closest.hasValue() || ray.computeT(pt.value()) < closest.value()))
+								closest = ray.computeT(pt.value());
+						}
+						auto r = tree->rayCast(ray);
+						Assert::IsTrue(r.empty == !closest.hasValue());
+						if (!r.empty)
+							Assert::IsTrue(aeq(r.parameter, closest.value()));
+					}
+				}
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testBatchedUpdates) {
+			std::mt19937 rng(4321);
+			std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+			std::uniform_real_distribution<float> size(0.2f, 6.0f);
+			std::uniform_real_distribution<float> step(-1.0f, 1.0f);
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				for (auto parallel : { false, true }) {
+					//the same shapes in two trees: one moved in batches, the other one transform at a time
+					std::vector<Shape*> batched, immediate;
+					SpatialTree* batchedTree = SpatialTree::create(ds);
+					SpatialTree* immediateTree = SpatialTree::create(ds);
+					for (size_t i = 0; i < 3000; i++) {
+						auto r = Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng)));
+						batched.push_back(Shape::fromRect(r));
+						immediate.push_back(Shape::fromRect(r));
+						batchedTree->addDynamicNode(batched.back());
+						immediateTree->addDynamicNode(immediate.back());
+					}
+					auto sameShapes = [&](const std::vector<Shape*>& a, const std::vector<Shape*>& b) {
+						std::set<size_t> ia, ib;
+						for (auto s : a)
+							ia.insert(std::find(batched.begin(), batched.end(), s) - batched.begin());
+						for (auto s : b)
+							ib.insert(std::find(immediate.begin(), immediate.end(), s) - immediate.begin());
+						return ia == ib;
+					};
+
+					for (size_t frame = 0; frame < 4; frame++) {
+						batchedTree->beginUpdate();
+						for (size_t i = 0; i < batched.size(); i++) {
+							auto m = Matrix3x3::fromTranslation(step(rng), step(rng));
+							batchedTree->transform(batched[i], m);
+							immediateTree->transform(immediate[i], m);
+							//some shapes move twice in the same update
+							if (i % 7 == 0) {
+								m = Matrix3x3::fromTranslation(step(rng) * 10, step(rng) * 10);
+								batchedTree->transform(batched[i], m);
+								immediateTree->transform(immediate[i], m);
+							}
+						}
+						//nothing moved yet
+						std::vector<Shape*> before;
+						batchedTree->pickQuery(&before, batched[0]->bounds().center());
+						Assert::IsTrue(std::find(before.begin(), before.end(), batched[0]) != before.end());
+						batchedTree->endUpdate(parallel);
+
+						for (size_t i = 0; i < batched.size(); i++)
+							Assert::IsTrue(batched[i]->bounds() == immediate[i]->bounds());
+						for (size_t k = 0; k < 30; k++) {
+							auto range = Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng)) * 2);
+							std::vector<Shape*> a, b;
+							batchedTree->rangeQuery(&a, range);
+							immediateTree->rangeQuery(&b, range);
+							Assert::IsTrue(sameShapes(a, b));
+						}
+					}
+
+					//a shape removed during an update takes its moves with it
+					batchedTree->beginUpdate();
+					batchedTree->transform(batched[0], Matrix3x3::fromTranslation(1, 1));
+					batchedTree->removeNode(batched[0]);
+					batchedTree->endUpdate(parallel);
+					Assert::IsTrue(batched[0]->bounds() == immediate[0]->bounds());
+
+					delete batchedTree;
+					delete immediateTree;
+					for (auto s : batched)
+						delete s;
+					for (auto s : immediate)
+						delete s;
+				}
+			}
+		}
+
+		TEST_METHOD(testNearestAndRadiusQueries) {
+			std::mt19937 rng(5678);
+			std::uniform_real_distribution<float> position(-60.0f, 60.0f);
+			std::uniform_real_distribution<float> size(0.2f, 8.0f);
+			std::uniform_real_distribution<float> radius(0.0f, 15.0f);
+
+			auto exactDistance = [](Shape* s, const Vec2& pt) {
+				if (s->type() == ShapeType::circle)
+					return std::max(distance(pt, s->circle().center()) - s->circle().radius(), 0.0f);
+				if (s->type() == ShapeType::Rect) {
+					auto r = s->Rect();
+					auto closest = Vec2(std::min(std::max(pt.x, r.left()), r.right()), std::min(std::max(pt.y, r.bottom()), r.top()));
+					return distance(pt, closest);
+				}
+				if (Intersection::test(s->Polygon(), pt))
+					return 0.0f;
+				return distance(pt, s->Polygon().closestPointFrom(pt));
+			};
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				for (size_t i = 0; i < 500; i++) {
+					auto c = Vec2(position(rng), position(rng));
+					auto h = size(rng) / 2;
+					Shape* s;
+					if (i % 3 == 0)
+						s = Shape::fromCircle(Circle(c, h));
+					else if (i % 3 == 1)
+						s = Shape::fromRect(Rect(c, Vec2(h, size(rng) / 2) * 2));
+					else
+						s = Shape::fromPolygon(Polygon({ c + Vec2(-h, -h), c + Vec2(h, -h), c + Vec2(h, h), c + Vec2(-h * 2, h) }));
+					s->setTypeMask((size_t)1 << (i % 2));
+					shapes.push_back(s);
+					if (i % 2 == 0)
+						tree->addStaticNode(s);
+					else
+						tree->addDynamicNode(s);
+				}
+
+				for (size_t k = 0; k < 100; k++) {
+					//some points far outside of the shapes
+					auto pt = Vec2(position(rng), position(rng)) * (k % 10 == 0 ? 5.0f : 1.0f);
+					auto mask = k % 4 == 0 ? (size_t)1 : std::numeric_limits<size_t>::max();
+					std::vector<float> expected;
+					for (auto s : shapes) {
+						if (s->typeMask() & mask)
+							expected.push_back(exactDistance(s, pt));
+					}
+					std::sort(expected.begin(), expected.end());
+
+					std::vector<ShapeDistance> found;
+					tree->nearest(&found, pt, 7, mask);
+					Assert::IsTrue(found.size() == 7);
+					for (size_t i = 0; i < found.size(); i++) {
+						Assert::IsTrue((found[i].shape->typeMask() & mask) != 0);
+						Assert::IsTrue(aeq(found[i].distance, exactDistance(found[i].shape, pt)));
+						Assert::IsTrue(aeq(found[i].distance, expected[i]));
+						if (i != 0)
+							Assert::IsTrue(found[i - 1].distance <= found[i].distance);
+					}
+
+					auto r = radius(rng);
+					found.clear();
+					tree->withinRadius(&found, pt, r, mask);
+					auto inside = std::upper_bound(expected.begin(), expected.end(), r) - expected.begin();
+					Assert::IsTrue(found.size() == (size_t)inside);
+					for (size_t i = 0; i < found.size(); i++) {
+						Assert::IsTrue(found[i].distance <= r);
+						if (i != 0)
+							Assert::IsTrue(found[i - 1].distance <= found[i].distance);
+					}
+				}
+
+				//results are appended after what's already in the buffer
+				std::vector<ShapeDistance> found(1);
+				tree->nearest(&found, Vec2::zero, 3, std::numeric_limits<size_t>::max(), sdmStatic);
+				Assert::IsTrue(found.size() == 4 && found[0].shape == nullptr);
+				for (size_t i = 1; i < found.size(); i++)
+					Assert::IsTrue(!found[i].shape->isDynamic());
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testShapeCast) {
+			std::mt19937 rng(4321);
+			std::uniform_real_distribution<float> position(-40.0f, 40.0f);
+			std::uniform_real_distribution<float> size(0.5f, 5.0f);
+			std::uniform_real_distribution<float> step(-25.0f, 25.0f);
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				SpatialTree* tree = SpatialTree::create(ds);
+				auto wall = Shape::fromRect(Rect(Vec2(6, 0), Vec2(2, 2)));
+				auto ball = Shape::fromCircle(Circle(Vec2(0, 0), 1));
+				auto wedge = Shape::fromPolygon(Polygon({ Vec2(5, 5), Vec2(7, 5), Vec2(7, 7) }));
+				tree->addStaticNode(wall);
+				tree->addDynamicNode(ball);
+				tree->addDynamicNode(wedge);
+
+				auto r = tree->shapeCast(ball, Vec2(10, 0));
+				Assert::IsTrue(!r.empty);
+				Assert::IsTrue(r.intersected == wall);
+				Assert::IsTrue(aeq(r.time, 0.4f));
+				Assert::IsTrue(aeq(r.normal, Vec2(-1, 0)));
+				//a flat side against the wall's corner
+				r = tree->shapeCast(wedge, Vec2(0, -10));
+				Assert::IsTrue(!r.empty);
+				Assert::IsTrue(r.intersected == wall);
+				Assert::IsTrue(aeq(r.time, 0.4f));
+				Assert::IsTrue(aeq(r.normal, Vec2(0, 1)));
+				r = tree->shapeCast(ball, Vec2(10, 0), std::numeric_limits<size_t>::max(), sdmDynamic);
+				Assert::IsTrue(r.empty);
+				//straight into the wedge's corner
+				r = tree->shapeCast(ball, Vec2(6, 6));
+				Assert::IsTrue(!r.empty);
+				Assert::IsTrue(r.intersected == wedge);
+				Assert::IsTrue(aeq(r.time, (5 - sqrtf(0.5f)) / 6));
+				Assert::IsTrue(aeq(r.normal, Vec2(-sqrtf(0.5f), -sqrtf(0.5f))));
+				r = tree->shapeCast(ball, Vec2(-10, 0));
+				Assert::IsTrue(r.empty);
+
+				delete tree;
+				delete wall;
+				delete ball;
+				delete wedge;
+			}
+
+			//every hit checked by moving the shape right before and right after it
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				for (size_t i = 0; i < 150; i++) {
+					auto c = Vec2(position(rng), position(rng));
+					auto h = size(rng) / 2;
+					Shape* s;
+					if (i % 3 == 0)
+						s = Shape::fromCircle(Circle(c, h));
+					else if (i % 3 == 1)
+						s = Shape::fromRect(Rect(c, Vec2(h, size(rng) / 2) * 2));
+					else
+						s = Shape::fromPolygon(Polygon({ c + Vec2(-h, -h), c + Vec2(h, -h), c + Vec2(h, h), c + Vec2(-h * 2, h) }));
+					shapes.push_back(s);
+					if (i % 2 == 0)
+						tree->addStaticNode(s);
+					else
+						tree->addDynamicNode(s);
+				}
+
+				auto touching = [&](Shape* s, Shape* other) {
+					std::vector<ExIntersectionInfo> found;
+					tree->intersectionQuery(&found, s);
+					if (!other)
+						return !found.empty();
+					for (auto& ei : found) {
+						if (ei.bodyB == other)
+							return true;
+					}
+					return false;
+				};
+				for (size_t k = 0; k < 300; k++) {
+					auto s = shapes[(k * 2 + 1) % shapes.size()];
+					auto d = Vec2(step(rng), step(rng));
+					auto r = tree->shapeCast(s, d);
+					if (r.empty) {
+						for (size_t i = 1; i <= 20; i++) {
+							tree->transform(s, Matrix3x3::fromTranslation(d.x / 20, d.y / 20));
+							Assert::IsTrue(!touching(s, nullptr));
+						}
+						tree->transform(s, Matrix3x3::fromTranslation(-d.x, -d.y));
+						continue;
+					}
+					Assert::IsTrue(r.time >= 0 && r.time <= 1);
+					Assert::IsTrue(aeq(r.normal.length(), 1));
+					if (r.time == 0) {
+						Assert::IsTrue(touching(s, r.intersected));
+						continue;
+					}
+					auto margin = 0.01f / d.length();
+					auto before = d * std::max(r.time - margin, 0.0f);
+					auto after = d * (r.time + margin);
+					tree->transform(s, Matrix3x3::fromTranslation(before.x, before.y));
+					if (r.time > margin)
+						Assert::IsTrue(!touching(s, nullptr));
+					tree->transform(s, Matrix3x3::fromTranslation(after.x - before.x, after.y - before.y));
+					Assert::IsTrue(touching(s, r.intersected));
+					//the normal faces the way the shape came from
+					Assert::IsTrue(dot(r.normal, d) <= 0);
+					tree->transform(s, Matrix3x3::fromTranslation(-after.x, -after.y));
+				}
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testAllPairs) {
+			std::mt19937 rng(9753);
+			std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+			std::uniform_real_distribution<float> size(0.5f, 6.0f);
+			std::uniform_real_distribution<float> step(-1.5f, 1.5f);
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes, dynamicShapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				for (size_t i = 0; i < 400; i++) {
+					auto s = i % 3 == 0 ? Shape::fromCircle(Circle(Vec2(position(rng), position(rng)), size(rng) / 2)) :
+						Shape::fromRect(Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng))));
+					//three kinds of shapes, some of which ignore each other
+					s->setTypeMask((size_t)1 << (i % 3));
+					s->setCollisionMask(i % 3 == 2 ? 1 : 3);
+					shapes.push_back(s);
+					if (i % 4 == 0)
+						tree->addStaticNode(s);
+					else {
+						tree->addDynamicNode(s);
+						dynamicShapes.push_back(s);
+					}
+				}
+
+				for (size_t frame = 0; frame < 5; frame++) {
+					for (auto s : dynamicShapes)
+						tree->transform(s, Matrix3x3::fromTranslation(step(rng), step(rng)));
+
+					for (auto filter : { sdmDynamic, sdmStatic, sdmAll }) {
+						//the pairs intersectionQuery finds for each dynamic shape, without the repeated ones
+						std::set<std::pair<Shape*, Shape*>> expected;
+						for (auto s : dynamicShapes) {
+							std::vector<ExIntersectionInfo> infos;
+							tree->intersectionQuery(&infos, s, filter);
+							for (auto& ei : infos)
+								expected.insert(std::make_pair(std::min(ei.bodyA, ei.bodyB), std::max(ei.bodyA, ei.bodyB)));
+						}
+						std::vector<ExIntersectionInfo> pairs;
+						tree->computeAllPairs(&pairs, filter);
+						std::set<std::pair<Shape*, Shape*>> found;
+						for (auto& ei : pairs) {
+							Assert::IsTrue(ei.bodyA->isDynamic());
+							Assert::IsTrue((ei.bodyA->collisionMask() & ei.bodyB->typeMask()) != 0);
+							Assert::IsTrue(found.insert(std::make_pair(std::min(ei.bodyA, ei.bodyB), std::max(ei.bodyA, ei.bodyB))).second);
+						}
+						Assert::IsTrue(found == expected);
+					}
+				}
+
+				size_t visited = 0;
+				tree->visitAllPairs([&](const ExIntersectionInfo& ei) {
+					visited++;
+					return visited < 3;
+				});
+				Assert::IsTrue(visited == 3);
+
+				//removed shapes leave the sweep
+				for (size_t i = 0; i < dynamicShapes.size(); i += 2)
+					tree->removeNode(dynamicShapes[i]);
+				std::vector<ExIntersectionInfo> pairs;
+				tree->computeAllPairs(&pairs);
+				for (auto& ei : pairs)
+					Assert::IsTrue(ei.bodyA->parent() == tree && ei.bodyB->parent() == tree);
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testContactCache) {
+			std::mt19937 rng(8642);
+			std::uniform_real_distribution<float> position(-30.0f, 30.0f);
+			std::uniform_real_distribution<float> size(0.5f, 5.0f);
+			std::uniform_real_distribution<float> step(-1.0f, 1.0f);
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes, dynamicShapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				for (size_t i = 0; i < 300; i++) {
+					auto c = Vec2(position(rng), position(rng));
+					auto h = size(rng) / 2;
+					Shape* s;
+					if (i % 3 == 0)
+						s = Shape::fromCircle(Circle(c, h));
+					else if (i % 3 == 1)
+						s = Shape::fromRect(Rect(c, Vec2(h, size(rng) / 2) * 2));
+					else
+						s = Shape::fromPolygon(Polygon({ c + Vec2(-h, -h), c + Vec2(h, -h), c + Vec2(h, h), c + Vec2(-h * 2, h) }));
+					shapes.push_back(s);
+					if (i % 4 == 0)
+						tree->addStaticNode(s);
+					else {
+						tree->addDynamicNode(s);
+						dynamicShapes.push_back(s);
+					}
+				}
+
+				typedef std::pair<Shape*, Shape*> Pair;
+				//either shape can be bodyA from one call to the next, so contacts go by the unordered pair
+				auto key = [](Shape* a, Shape* b) {
+					return Pair(std::min(a, b), std::max(a, b));
+				};
+				std::set<Pair> touching;
+				for (size_t frame = 0; frame < 12; frame++) {
+					//most shapes rest, a few move
+					for (size_t i = frame % 5; i < dynamicShapes.size(); i += 5)
+						tree->transform(dynamicShapes[i], Matrix3x3::fromTranslation(step(rng), step(rng)));
+					if (frame == 8) {
+						for (size_t i = 0; i < dynamicShapes.size(); i += 7) {
+							auto s = dynamicShapes[i];
+							tree->removeNode(s);
+							for (auto it = touching.begin(); it != touching.end();) {
+								if (it->first == s || it->second == s)
+									it = touching.erase(it);
+								else
+									++it;
+							}
+						}
+						dynamicShapes.erase(std::remove_if(dynamicShapes.begin(), dynamicShapes.end(), [](Shape* s) {
+							return s->parent() == nullptr;
+						}), dynamicShapes.end());
+					}
+
+					std::vector<ExIntersectionInfo> pairs;
+					tree->computeAllPairs(&pairs);
+					std::set<Pair> expected;
+					for (auto& ei : pairs)
+						expected.insert(Pair(ei.bodyA, ei.bodyB));
+
+					std::vector<ContactEvent> events;
+					tree->updateContacts(&events);
+					std::set<Pair> found, current, ended;
+					for (auto& e : events) {
+						auto p = Pair(e.info.bodyA, e.info.bodyB);
+						if (e.state == ContactState::end) {
+							Assert::IsTrue(e.info.empty);
+							Assert::IsTrue(ended.insert(key(p.first, p.second)).second);
+							continue;
+						}
+						Assert::IsTrue(!e.info.empty);
+						Assert::IsTrue(found.insert(p).second);
+						current.insert(key(p.first, p.second));
+						Assert::IsTrue((e.state == ContactState::persist) == (touching.count(key(p.first, p.second)) != 0));
+						auto match = std::find_if(pairs.begin(), pairs.end(), [&](const ExIntersectionInfo& ei) {
+							return ei.bodyA == p.first && ei.bodyB == p.second;
+						});
+						Assert::IsTrue(match != pairs.end());
+						Assert::IsTrue(aeq(match->penetration, e.info.penetration));
+						Assert::IsTrue(aeq(match->normal, e.info.normal));
+					}
+					Assert::IsTrue(found == expected);
+					//every contact of the last call either goes on or ends
+					for (auto& p : touching)
+						Assert::IsTrue((current.count(p) != 0) != (ended.count(p) != 0));
+					for (auto& p : ended)
+						Assert::IsTrue(touching.count(p) != 0);
+					touching = current;
+				}
+
+				//a second call with nothing moved only has persist events
+				std::vector<ContactEvent> events;
+				tree->updateContacts(&events);
+				Assert::IsTrue(events.size() == touching.size());
+				for (auto& e : events)
+					Assert::IsTrue(e.state == ContactState::persist);
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testLayerMasks) {
+			std::mt19937 rng(1122);
+			std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+			std::uniform_real_distribution<float> size(0.5f, 4.0f);
+
+			//nodes only hold the layers below them, through inserts, removals and mask changes
+			std::vector<AABB> boxes;
+			std::vector<size_t> masks;
+			for (size_t i = 0; i < 1000; i++) {
+				auto x = position(rng);
+				auto y = position(rng);
+				boxes.push_back(AABB(x, y, x + size(rng), y + size(rng)));
+				masks.push_back((size_t)1 << (i % 30));
+			}
+			StaticBVH bvh;
+			bvh.build(boxes.data(), masks.data(), boxes.size());
+			for (size_t k = 0; k < 600; k++) {
+				auto p = (uint32_t)(rng() % boxes.size());
+				if (k % 3 == 0) {
+					bvh.remove(p);
+					boxes[p] = boxes.back();
+					boxes.pop_back();
+					masks[p] = masks.back();
+					masks.pop_back();
+				}
+				else if (k % 3 == 1) {
+					masks[p] = (size_t)1 << (rng() % 30);
+					bvh.setMask(p, masks[p]);
+				}
+				else {
+					auto x = position(rng);
+					auto y = position(rng);
+					boxes.push_back(AABB(x, y, x + size(rng), y + size(rng)));
+					masks.push_back((size_t)1 << (rng() % 30));
+					bvh.insert(boxes.back(), masks.back());
+				}
+			}
+			bvh.validate();
+			for (size_t k = 0; k < 60; k++) {
+				auto x = position(rng);
+				auto y = position(rng);
+				auto range = AABB(x, y, x + 30, y + 30);
+				auto mask = (size_t)1 << (k % 30);
+				std::set<uint32_t> expected, found;
+				for (uint32_t i = 0; i < boxes.size(); i++) {
+					Assert::IsTrue(bvh.primitiveMask(i) == masks[i]);
+					if ((masks[i] & mask) && boxes[i].overlaps(range))
+						expected.insert(i);
+				}
+				auto callback = [&](uint32_t p) {
+					if ((masks[p] & mask) && boxes[p].overlaps(range))
+						found.insert(p);
+					return true;
+				};
+				bvh.query(range, callback, mask);
+				Assert::IsTrue(found == expected);
+			}
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				for (size_t i = 0; i < 600; i++) {
+					auto c = Vec2(position(rng), position(rng));
+					auto s = i % 2 == 0 ? Shape::fromCircle(Circle(c, size(rng) / 2)) : Shape::fromRect(Rect(c, Vec2(size(rng), size(rng))));
+					s->setTypeMask((size_t)1 << (i % 30));
+					shapes.push_back(s);
+					if (i % 3 == 0)
+						tree->addStaticNode(s);
+					else
+						tree->addDynamicNode(s);
+				}
+
+				auto check = [&](size_t mask) {
+					auto x = position(rng);
+					auto y = position(rng);
+					auto range = Rect(Vec2(x, y), Vec2(40, 40));
+					std::set<Shape*> expected, found;
+					for (auto s : shapes) {
+						if ((s->typeMask() & mask) && Intersection::test(s->bounds(), range))
+							expected.insert(s);
+					}
+					std::vector<Shape*> result;
+					tree->rangeQuery(&result, range, mask);
+					found.insert(result.begin(), result.end());
+					Assert::IsTrue(found == expected);
+
+					std::vector<ShapeDistance> nearest;
+					tree->nearest(&nearest, Vec2(x, y), 1, mask);
+					auto any = std::any_of(shapes.begin(), shapes.end(), [mask](Shape* s) { return (s->typeMask() & mask) != 0; });
+					Assert::IsTrue(nearest.size() == (any ? 1u : 0u));
+					if (any)
+						Assert::IsTrue((nearest[0].shape->typeMask() & mask) != 0);
+
+					auto r = tree->rayCast(Ray(Vec2(x, y), Vec2(1, 0.5f)), mask);
+					if (!r.empty)
+						Assert::IsTrue((r.intersected->typeMask() & mask) != 0);
+				};
+				for (size_t k = 0; k < 60; k++)
+					check((size_t)1 << (k % 30));
+
+				//shapes moved to another layer are found there, static ones before and after a rebuild
+				std::vector<Shape*> moved;
+				for (size_t i = 0; i < shapes.size(); i += 13) {
+					shapes[i]->setTypeMask((size_t)1 << 30);
+					moved.push_back(shapes[i]);
+				}
+				std::vector<Shape*> result;
+				tree->rangeQuery(&result, Rect(Vec2::zero, Vec2(200, 200)), (size_t)1 << 30);
+				Assert::IsTrue(std::set<Shape*>(result.begin(), result.end()) == std::set<Shape*>(moved.begin(), moved.end()));
+				for (size_t k = 0; k < 30; k++)
+					check((size_t)1 << (k % 31));
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testDynamicRemovalsAndReuse) {
+			std::mt19937 rng(3141);
+			std::uniform_real_distribution<float> position(-60.0f, 60.0f);
+			std::uniform_real_distribution<float> size(0.5f, 6.0f);
+			std::uniform_real_distribution<float> step(-3.0f, 3.0f);
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				auto add = [&]() {
+					auto c = Vec2(position(rng), position(rng));
+					auto s = shapes.size() % 2 == 0 ? Shape::fromCircle(Circle(c, size(rng) / 2)) : Shape::fromRect(Rect(c, Vec2(size(rng), size(rng))));
+					shapes.push_back(s);
+					tree->addDynamicNode(s);
+				};
+				for (size_t i = 0; i < 300; i++)
+					add();
+				//removed shapes leave their slots to the next ones added
+				for (size_t frame = 0; frame < 5; frame++) {
+					for (size_t i = frame; i < shapes.size(); i += 4) {
+						tree->removeNode(shapes[i]);
+						delete shapes[i];
+						shapes[i] = nullptr;
+					}
+					shapes.erase(std::remove(shapes.begin(), shapes.end(), nullptr), shapes.end());
+					while (shapes.size() < 300)
+						add();
+					tree->beginUpdate();
+					for (size_t i = 0; i < shapes.size(); i += 2)
+						tree->transform(shapes[i], Matrix3x3::fromTranslation(step(rng), step(rng)));
+					tree->endUpdate();
+
+					for (size_t k = 0; k < 20; k++) {
+						auto range = Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng)) * 3);
+						std::set<Shape*> expected;
+						for (auto s : shapes) {
+							if (Intersection::test(range, s->bounds()))
+								expected.insert(s);
+						}
+						std::vector<Shape*> buffer;
+						tree->rangeQuery(&buffer, range);
+						Assert::IsTrue(std::set<Shape*>(buffer.begin(), buffer.end()) == expected);
+						Assert::IsTrue(buffer.size() == expected.size());
+
+						auto pt = Vec2(position(rng), position(rng));
+						expected.clear();
+						for (auto s : shapes) {
+							if (s->type() == ShapeType::circle ? Intersection::test(s->circle(), pt) : s->bounds().containsPoint(pt))
+								expected.insert(s);
+						}
+						buffer.clear();
+						tree->pickQuery(&buffer, pt);
+						Assert::IsTrue(std::set<Shape*>(buffer.begin(), buffer.end()) == expected);
+					}
+				}
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testShapePool) {
+			ShapePool pool;
+			std::vector<ShapeHandle> handles;
+			for (size_t i = 0; i < 600; i++) {
+				auto c = Vec2((float)(i % 30) * 4, (float)(i / 30) * 4);
+				if (i % 3 == 0)
+					handles.push_back(pool.createCircle(Circle(c, 1)));
+				else if (i % 3 == 1)
+					handles.push_back(pool.createRect(Rect(c, Vec2(2, 2))));
+				else
+					handles.push_back(pool.createPolygon(Polygon({ c, c + Vec2(1.5f, 0), c + Vec2(0, 1.5f) })));
+			}
+			Assert::IsTrue(pool.size() == handles.size());
+			for (size_t i = 0; i < handles.size(); i++) {
+				auto s = pool.get(handles[i]);
+				Assert::IsTrue(s != nullptr);
+				Assert::IsTrue(s->type() == handles[i].type);
+				Assert::IsTrue(s->parent() == nullptr);
+			}
+			//shapes of a type are laid out one after another
+			Assert::IsTrue(pool.get(handles[3]) > pool.get(handles[0]));
+			Assert::IsTrue(pool.get(handles[4]) > pool.get(handles[1]));
+
+			//pooled shapes go in a tree like any other
+			SpatialTree* tree = SpatialTree::create();
+			for (size_t i = 0; i < handles.size(); i++) {
+				if (i % 2 == 0)
+					tree->addStaticNode(pool.get(handles[i]));
+				else
+					tree->addDynamicNode(pool.get(handles[i]));
+			}
+			std::vector<Shape*> found;
+			tree->rangeQuery(&found, Rect(Vec2(58, 38), Vec2(200, 200)));
+			Assert::IsTrue(found.size() == handles.size());
+
+			//destroyed handles go stale, and their slots are taken by the next shapes of their type
+			for (size_t i = 0; i < handles.size(); i += 2) {
+				tree->removeNode(pool.get(handles[i]));
+				pool.destroy(handles[i]);
+			}
+			Assert::IsTrue(pool.size() == handles.size() / 2);
+			for (size_t i = 0; i < handles.size(); i++)
+				Assert::IsTrue((pool.get(handles[i]) == nullptr) == (i % 2 == 0));
+			auto circle = pool.createCircle(Circle(Vec2(1000, 1000), 1));
+			//the free list hands back the last circle destroyed
+			Assert::IsTrue(circle.index == handles[594].index && circle.generation != handles[594].generation);
+			Assert::IsTrue(pool.get(handles[594]) == nullptr);
+			auto reused = pool.get(circle);
+			Assert::IsTrue(reused->type() == ShapeType::circle);
+			Assert::IsTrue(reused->parent() == nullptr && !reused->isDynamic());
+			Assert::IsTrue(reused->typeMask() == std::numeric_limits<size_t>::max());
+			Assert::IsTrue(aeq(reused->bounds().center(), Vec2(1000, 1000)));
+			auto polygon = pool.createPolygon(Polygon({ Vec2(0, 0), Vec2(3, 0), Vec2(3, 3), Vec2(0, 3) }));
+			Assert::IsTrue(pool.get(polygon)->Polygon().pointCount() == 4);
+			pool.destroy(circle);
+			pool.destroy(polygon);
+			Assert::IsTrue(ShapeHandle().isNull() && pool.get(ShapeHandle()) == nullptr);
+
+			for (size_t i = 1; i < handles.size(); i += 2)
+				tree->removeNode(pool.get(handles[i]));
+			delete tree;
+		}
+
+		TEST_METHOD(testStatistics) {
+			std::mt19937 rng(2718);
+			std::uniform_real_distribution<float> position(-40.0f, 40.0f);
+			std::uniform_real_distribution<float> size(0.5f, 6.0f);
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				for (size_t i = 0; i < 300; i++) {
+					auto s = Shape::fromRect(Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng))));
+					shapes.push_back(s);
+					if (i % 3 == 0)
+						tree->addStaticNode(s);
+					else
+						tree->addDynamicNode(s);
+				}
+				//removed records stay in the table for the next shapes
+				for (size_t i = 1; i < 40; i += 3)
+					tree->removeNode(shapes[i]);
+
+				auto stats = tree->structureStats();
+				Assert::IsTrue(stats.staticShapes == 100);
+				Assert::IsTrue(stats.staticDepth > 0 && stats.staticNodes > 0);
+				size_t inLeaves = 0;
+				for (size_t n = 0; n < stats.staticLeafOccupancy.size(); n++)
+					inLeaves += n * stats.staticLeafOccupancy[n];
+				Assert::IsTrue(inLeaves == 100);
+				Assert::IsTrue(stats.dynamicShapes == 187 && stats.dynamicRecords == 200);
+				Assert::IsTrue(aeq(stats.dynamicTableLoadFactor, 187.0f / 200.0f));
+				if (ds == DynamicStructure::aabbTree) {
+					Assert::IsTrue(stats.dynamicTreeHeight > 0);
+					Assert::IsTrue(stats.occupiedCells == 0 && stats.cellOccupancy.empty());
+				}
+				else {
+					size_t cells = 0, entries = 0;
+					for (size_t n = 0; n < stats.cellOccupancy.size(); n++) {
+						cells += stats.cellOccupancy[n];
+						entries += n * stats.cellOccupancy[n];
+					}
+					Assert::IsTrue(cells == stats.occupiedCells && cells > 0);
+					Assert::IsTrue(aeq(stats.cellsPerShape, (float)entries / 187.0f));
+					Assert::IsTrue(stats.cellsPerShape >= 1);
+					Assert::IsTrue(stats.cellTableLoadFactor > 0 && stats.cellTableLoadFactor < 1);
+				}
+
+				tree->resetQueryStats();
+				std::vector<Shape*> result;
+				tree->rangeQuery(&result, Rect(Vec2::zero, Vec2(30, 30)));
+				auto last = tree->lastQueryStats();
+				//a query run by a visitor is part of the one running it
+				size_t nested = 0;
+				tree->visitRange(Rect(Vec2::zero, Vec2(10, 10)), [&](Shape* s) {
+					std::vector<Shape*> inner;
+					tree->rangeQuery(&inner, s->bounds());
+					nested++;
+					return true;
+				});
+				auto outer = tree->lastQueryStats();
+				auto total = tree->totalQueryStats();
+#ifdef SbSpatialTreeStats
+				Assert::IsTrue(last.queries == 1);
+				Assert::IsTrue(last.nodesVisited > 0);
+				Assert::IsTrue(last.candidates >= result.size());
+				if (ds != DynamicStructure::aabbTree)
+					Assert::IsTrue(last.cellsVisited > 0);
+				Assert::IsTrue(outer.queries == 1);
+				Assert::IsTrue(nested == 0 || outer.candidates > nested);
+				Assert::IsTrue(total.queries == 2);
+				Assert::IsTrue(total.candidates == last.candidates + outer.candidates);
+				RayCastResult rays[600];
+				std::vector<Ray> batch(600, Ray(Vec2(-50, -50), Vec2(1, 1)));
+				tree->rayCastBatch(batch.data(), batch.size(), rays, std::numeric_limits<size_t>::max(), sdmAll, true);
+				Assert::IsTrue(tree->lastQueryStats().narrowphaseTests >= 600);
+				tree->resetQueryStats();
+				Assert::IsTrue(tree->totalQueryStats().queries == 0);
+#else
+				//compiled out
+				Assert::IsTrue(last.queries == 0 && outer.queries == 0 && total.queries == 0);
+				Assert::IsTrue(last.candidates == 0 && total.nodesVisited == 0);
+#endif
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testGridRayCast) {
+			std::mt19937 rng(1357);
+			std::uniform_real_distribution<float> position(-60.0f, 60.0f);
+			std::uniform_real_distribution<float> size(0.1f, 3.0f);
+			std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+
+			std::vector<Shape*> shapes;
+			SpatialTree* tree = SpatialTree::create(DynamicStructure::grid);
+			for (size_t i = 0; i < 300; i++) {
+				auto s = Shape::fromRect(Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng))));
+				shapes.push_back(s);
+				if (i % 10 == 0)
+					tree->addStaticNode(s);
+				else
+					tree->addDynamicNode(s);
+			}
+
+			//rays along the axes and rays coming from far outside the occupied cells
+			std::vector<Ray> rays;
+			for (size_t k = 0; k < 50; k++) {
+				auto pt = Vec2(position(rng), position(rng));
+				rays.push_back(Ray(pt, Vec2(1, 0)));
+				rays.push_back(Ray(pt, Vec2(0, -1)));
+				auto a = angle(rng);
+				auto dir = Vec2(cosf(a), sinf(a));
+				rays.push_back(Ray(pt, dir));
+				rays.push_back(Ray(pt - dir * 150, dir));
+			}
+			for (auto& ray : rays) {
+				Option<float> closest = nullptr;
+				for (auto s : shapes) {
+					auto pt = Intersection::get(ray, s->Rect());
+					if (pt.hasValue() && (!closest.hasValue() || ray.computeT(pt.value()) < closest.value()))
+						closest = ray.computeT(pt.value());
+				}
+				auto r = tree->rayCast(ray);
+				Assert::IsTrue(r.empty == !closest.hasValue());
+				if (!r.empty)
+					Assert::IsTrue(aeq(r.parameter, closest.value()));
+			}
+
+			delete tree;
+			for (auto s : shapes)
+				delete s;
+		}
+
+		TEST_METHOD(testHierarchicalGrid) {
+			std::mt19937 rng(3141);
+			std::uniform_real_distribution<float> position(-200.0f, 200.0f);
+			std::uniform_real_distribution<float> exponent(-4.0f, 8.5f);
+			std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+			std::uniform_real_distribution<float> step(-3.0f, 3.0f);
+
+			//particles of a twentieth of a unit up to shapes of a few hundred units
+			std::vector<Shape*> shapes;
+			SpatialTree* tree = SpatialTree::create(DynamicStructure::hierarchicalGrid);
+			for (size_t i = 0; i < 400; i++) {
+				auto s = Shape::fromRect(Rect(Vec2(position(rng), position(rng)), Vec2(exp2f(exponent(rng)), exp2f(exponent(rng)))));
+				shapes.push_back(s);
+				tree->addDynamicNode(s);
+			}
+
+			for (size_t frame = 0; frame < 6; frame++) {
+				//growing and shrinking moves shapes between levels
+				for (size_t i = 0; i < shapes.size(); i++) {
+					auto c = shapes[i]->bounds().center();
+					auto scale = frame % 2 == 0 ? (i % 3 == 0 ? 4.0f : 1.0f) : (i % 3 == 0 ? 0.25f : 1.0f);
+					auto m = Matrix3x3::fromTranslation(c) * Matrix3x3::fromScale(scale, scale) * Matrix3x3::fromTranslation(-c);
+					tree->transform(shapes[i], Matrix3x3::fromTranslation(step(rng), step(rng)) * m);
+				}
+
+				for (size_t k = 0; k < 30; k++) {
+					auto range = Rect(Vec2(position(rng), position(rng)), Vec2(exp2f(exponent(rng)), exp2f(exponent(rng))));
+					std::set<Shape*> expected;
+					for (auto s : shapes) {
+						if (Intersection::test(s->bounds(), range))
+							expected.insert(s);
+					}
+					std::vector<Shape*> found;
+					tree->rangeQuery(&found, range);
+					Assert::IsTrue(found.size() == expected.size());
+					Assert::IsTrue(std::set<Shape*>(found.begin(), found.end()) == expected);
+
+					auto pt = Vec2(position(rng), position(rng));
+					expected.clear();
+					for (auto s : shapes) {
+						if (Intersection::test(s->bounds(), pt))
+							expected.insert(s);
+					}
+					found.clear();
+					tree->pickQuery(&found, pt);
+					Assert::IsTrue(found.size() == expected.size());
+					Assert::IsTrue(std::set<Shape*>(found.begin(), found.end()) == expected);
+
+					auto a = angle(rng);
+					auto ray = Ray(Vec2(position(rng), position(rng)), Vec2(cosf(a), sinf(a)));
+					Option<float> closest = nullptr;
+					for (auto s : shapes) {
+						auto hit = Intersection::get(ray, s->Rect());
+						if (hit.hasValue() && (!closest.hasValue() || ray.computeT(hit.value()) < closest.value()))
+							closest = ray.computeT(hit.value());
+					}
+					auto r = tree->rayCast(ray);
+					Assert::IsTrue(r.empty == !closest.hasValue());
+					if (!r.empty)
+						Assert::IsTrue(aeq(r.parameter, closest.value()));
+				}
+			}
+
+			for (auto s : shapes)
+				tree->removeNode(s);
+			std::vector<Shape*> found;
+			tree->rangeQuery(&found, Rect(0, 0, 1000, 1000));
+			Assert::IsTrue(found.size() == 0);
+
+			delete tree;
+			for (auto s : shapes)
+				delete s;
+		}
+
+		TEST_METHOD(testRayCastBatch) {
+			std::mt19937 rng(8642);
+			std::uniform_real_distribution<float> position(-80.0f, 80.0f);
+			std::uniform_real_distribution<float> size(0.2f, 4.0f);
+			std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+			std::uniform_real_distribution<float> spread(-0.05f, 0.05f);
+
+			std::vector<Shape*> shapes;
+			SpatialTree* tree = SpatialTree::create(DynamicStructure::grid);
+			for (size_t i = 0; i < 2000; i++) {
+				auto s = i % 5 == 0 ? Shape::fromCircle(Circle(Vec2(position(rng), position(rng)), size(rng) / 2)) :
+					Shape::fromRect(Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng))));
+				s->setTypeMask((size_t)1 << (i % 2));
+				shapes.push_back(s);
+				if (i % 8 == 0)
+					tree->addDynamicNode(s);
+				else
+					tree->addStaticNode(s);
+			}
+
+			//fans of nearly parallel rays, which make full packets, then rays that don't share a packet
+			std::vector<Ray> rays;
+			for (size_t k = 0; k < 1000; k++) {
+				auto pt = Vec2(position(rng), position(rng));
+				auto a = angle(rng);
+				for (size_t j = 0; j < 4; j++)
+					rays.push_back(Ray(pt, Vec2(cosf(a + spread(rng)), sinf(a + spread(rng)))));
+			}
+			for (size_t k = 0; k < 200; k++) {
+				auto pt = Vec2(position(rng), position(rng));
+				auto a = angle(rng);
+				rays.push_back(Ray(pt, Vec2(cosf(a), sinf(a))));
+				rays.push_back(Ray(pt, Vec2(0, 1)));
+				rays.push_back(Ray(pt, Vec2(-1, 0)));
+			}
+
+			for (auto parallel : { false, true }) {
+				for (auto filter : { sdmStatic, sdmDynamic, sdmAll }) {
+					for (size_t mask : { std::numeric_limits<size_t>::max(), (size_t)1 }) {
+						std::vector<RayCastResult> results(rays.size());
+						tree->rayCastBatch(rays.data(), rays.size(), results.data(), mask, filter, parallel);
+						for (size_t i = 0; i < rays.size(); i++) {
+							auto r = tree->rayCast(rays[i], mask, filter);
+							Assert::IsTrue(results[i].empty == r.empty);
+							Assert::IsTrue(results[i].intersected == r.intersected);
+							if (!r.empty)
+								Assert::IsTrue(results[i].parameter == r.parameter);
+						}
+					}
+				}
+			}
+
+			//odd sizes leave part of the last packet unused
+			std::vector<RayCastResult> results(3);
+			tree->rayCastBatch(rays.data() + 1, 3, results.data());
+			for (size_t i = 0; i < 3; i++)
+				Assert::IsTrue(results[i].intersected == tree->rayCast(rays[i + 1]).intersected);
+			tree->rayCastBatch(nullptr, 0, nullptr);
+
+			delete tree;
+			for (auto s : shapes)
+				delete s;
+		}
+
+		TEST_METHOD(testStaticBVH) {
+			std::mt19937 rng(4321);
+			std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+			std::uniform_real_distribution<float> size(0.0f, 10.0f);
+
+			std::vector<AABB> boxes;
+			for (size_t i = 0; i < 10000; i++) {
+				auto x = position(rng);
+				auto y = position(rng);
+				boxes.push_back(AABB(x, y, x + size(rng), y + size(rng)));
+			}
+			//plenty of boxes in the same spot
+			for (size_t i = 0; i < 100; i++)
+				boxes.push_back(AABB(1, 1, 2, 2));
+
+			StaticBVH bvh;
+			bvh.build(boxes.data(), boxes.size());
+			bvh.validate();
+			Assert::IsTrue(bvh.primitiveCount() == boxes.size());
+			Assert::IsTrue(bvh.nodeCount() < 2 * boxes.size());
+			for (auto& n : bvh.nodes()) {
+				if (n.isLeaf())
+					Assert::IsTrue(n.count <= SbBVHMaxLeafSize);
+			}
+			//building on one thread gives the very same tree
+			StaticBVH serial;
+			serial.build(boxes.data(), boxes.size(), false);
+			Assert::IsTrue(serial.nodeCount() == bvh.nodeCount());
+			for (size_t i = 0; i < bvh.nodeCount(); i++)
+				Assert::IsTrue(memcmp(&serial.nodes()[i], &bvh.nodes()[i], sizeof(StaticBVH::Node)) == 0);
+
+			for (size_t k = 0; k < 50; k++) {
+				auto x = position(rng);
+				auto y = position(rng);
+				auto range = AABB(x, y, x + 40, y + 40);
+				std::set<uint32_t> expected, found;
+				for (uint32_t i = 0; i < boxes.size(); i++) {
+					if (boxes[i].overlaps(range))
+						expected.insert(i);
+				}
+				auto callback = [&](uint32_t p) {
+					if (boxes[p].overlaps(range))
+						Assert::IsTrue(found.insert(p).second);
+					return true;
+				};
+				bvh.query(range, callback);
+				Assert::IsTrue(found == expected);
+			}
+
+			bvh.build(nullptr, 0);
+			Assert::IsTrue(bvh.isEmpty());
+		}
+
+		TEST_METHOD(testStaticBVHIncremental) {
+			std::mt19937 rng(2468);
+			std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+			std::uniform_real_distribution<float> size(0.0f, 10.0f);
+			auto randomBox = [&]() {
+				auto x = position(rng);
+				auto y = position(rng);
+				return AABB(x, y, x + size(rng), y + size(rng));
+			};
+
+			std::vector<AABB> boxes;
+			for (size_t i = 0; i < 2000; i++)
+				boxes.push_back(randomBox());
+			StaticBVH bvh;
+			bvh.build(boxes.data(), boxes.size());
+			const auto builtCost = bvh.cost();
+			Assert::IsFalse(bvh.needsRebuild());
+
+			//the boxes mirror the tree: the last one takes the place of a removed one
+			for (size_t k = 0; k < 4000; k++) {
+				if (boxes.size() != 0 && rng() % 2 == 0) {
+					auto p = (uint32_t)(rng() % boxes.size());
+					bvh.remove(p);
+					boxes[p] = boxes.back();
+					boxes.pop_back();
+				}
+				else {
+					boxes.push_back(randomBox());
+					Assert::IsTrue(bvh.insert(boxes.back()) == boxes.size() - 1);
+				}
+				Assert::IsTrue(bvh.primitiveCount() == boxes.size());
+				if (k % 500 == 0)
+					bvh.validate();
+			}
+			bvh.validate();
+			for (uint32_t i = 0; i < boxes.size(); i++)
+				Assert::IsTrue(bvh.primitiveBounds(i) == boxes[i]);
+
+			for (size_t k = 0; k < 50; k++) {
+				auto x = position(rng);
+				auto y = position(rng);
+				auto range = AABB(x, y, x + 40, y + 40);
+				std::set<uint32_t> expected, found;
+				for (uint32_t i = 0; i < boxes.size(); i++) {
+					if (boxes[i].overlaps(range))
+						expected.insert(i);
+				}
+				auto callback = [&](uint32_t p) {
+					if (boxes[p].overlaps(range))
+						Assert::IsTrue(found.insert(p).second);
+					return true;
+				};
+				bvh.query(range, callback);
+				Assert::IsTrue(found == expected);
+			}
+
+			//a fresh build is never worse than the refitted tree
+			StaticBVH fresh;
+			fresh.build(boxes.data(), boxes.size());
+			Assert::IsTrue(fresh.cost() <= bvh.cost());
+			Assert::IsTrue(fresh.cost() <= builtCost * SbBVHRebuildRatio);
+
+			//removing everything leaves an empty tree that still takes inserts
+			while (bvh.primitiveCount() != 0)
+				bvh.remove(0);
+			Assert::IsTrue(bvh.isEmpty());
+			Assert::IsTrue(bvh.insert(AABB(0, 0, 1, 1)) == 0);
+			bvh.validate();
+		}
+
+		TEST_METHOD(testStaticTreeAgainstBruteForce) {
+			std::mt19937 rng(5678);
+			std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+			std::uniform_real_distribution<float> size(0.1f, 8.0f);
+			std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+
+			std::vector<Shape*> shapes;
+			SpatialTree* tree = SpatialTree::create();
+			for (size_t i = 0; i < 1000; i++) {
+				auto s = Shape::fromRect(Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng))));
+				shapes.push_back(s);
+				tree->addStaticNode(s);
+			}
+			tree->buildStatic();
+			//after the build, removing moves the last shape into the hole of both the shape list and the tree
+			for (size_t i = 0; i < 100; i++) {
+				tree->removeNode(shapes[i * 7]);
+				delete shapes[i * 7];
+				shapes[i * 7] = nullptr;
+			}
+			shapes.erase(std::remove(shapes.begin(), shapes.end(), nullptr), shapes.end());
+			//and new shapes are inserted into the built tree
+			for (size_t i = 0; i < 100; i++) {
+				auto s = Shape::fromRect(Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng))));
+				shapes.push_back(s);
+				tree->addStaticNode(s);
+			}
+
+			std::vector<Shape*> buffer;
+			for (size_t k = 0; k < 100; k++) {
+				auto range = Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng)) * 3);
+				std::set<Shape*> expected;
+				for (auto s : shapes) {
+					if (Intersection::test(range, s->bounds()))
+						expected.insert(s);
+				}
+				buffer.clear();
+				tree->rangeQuery(&buffer, range);
+				Assert::IsTrue(std::set<Shape*>(buffer.begin(), buffer.end()) == expected);
+				Assert::IsTrue(buffer.size() == expected.size());
+
+				auto pt = Vec2(position(rng), position(rng));
+				expected.clear();
+				for (auto s : shapes) {
+					if (s->bounds().containsPoint(pt))
+						expected.insert(s);
+				}
+				buffer.clear();
+				tree->pickQuery(&buffer, pt);
+				Assert::IsTrue(std::set<Shape*>(buffer.begin(), buffer.end()) == expected);
+
+				auto ray = Ray(pt, Vec2(direction(rng), direction(rng)));
+				if (ray.direction().isZero(true))
+					continue;
+				Option<float> closest = nullptr;
+				for (auto s : shapes) {
+					auto hit = Intersection::get(ray, s->Rect());
+					if (hit.hasValue() && (!closest.hasValue() || ray.computeT(hit.value()) < closest.value()))
+						closest = ray.computeT(hit.value());
+				}
+				auto r = tree->rayCast(ray);
+				Assert::IsTrue(r.empty == !closest.hasValue());
+				if (!r.empty)
+					Assert::IsTrue(aeq(r.parameter, closest.value()));
+			}
+
+			delete tree;
+			for (auto s : shapes)
+				delete s;
+		}
+
+		TEST_METHOD(testUnboundedQueries) {
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				//more than SbMaxCollisions shapes piled on the same spot
+				for (size_t i = 0; i < 3 * SbMaxCollisions; i++) {
+					auto s = Shape::fromRect(Rect(Vec2(0.1f * i, 0.1f * i), Vec2::one * 2));
+					shapes.push_back(s);
+					if (i % 2 == 0)
+						tree->addDynamicNode(s);
+					else
+						tree->addStaticNode(s);
+				}
+
+				RangeQueryResult q;
+				tree->rangeQuery(&q, Rect(-1, -1, 10, 10));
+				Assert::IsTrue(q.isFull());
+
+				std::vector<Shape*> buffer;
+				tree->rangeQuery(&buffer, Rect(-1, -1, 10, 10));
+				Assert::IsTrue(buffer.size() == shapes.size());
+				Assert::IsTrue(std::set<Shape*>(buffer.begin(), buffer.end()).size() == shapes.size());
+				//reusing the buffer
+				buffer.clear();
+				tree->rangeQuery(&buffer, Rect(-1, -1, 10, 10), std::numeric_limits<size_t>::max(), sdmDynamic);
+				Assert::IsTrue(buffer.size() == shapes.size() / 2);
+
+				buffer.clear();
+				tree->pickQuery(&buffer, Vec2(0.9f, 0.9f));
+				Assert::IsTrue(buffer.size() > SbMaxCollisions);
+
+				size_t visited = 0;
+				tree->visitRange(Rect(-1, -1, 10, 10), [&](Shape* s) {
+					visited++;
+					return true;
+				});
+				Assert::IsTrue(visited == shapes.size());
+				visited = 0;
+				tree->visitPick(Vec2(0.9f, 0.9f), [&](Shape* s) {
+					visited++;
+					return visited < 5;
+				});
+				Assert::IsTrue(visited == 5);
+
+				std::vector<ExIntersectionInfo> intersections;
+				tree->intersectionQuery(&intersections, shapes[0]);
+				size_t intersectionCount = 0;
+				tree->visitIntersections(shapes[0], [&](const ExIntersectionInfo& ei) {
+					Assert::IsTrue(ei.bodyA == shapes[0] && ei.bodyB != shapes[0]);
+					intersectionCount++;
+					return true;
+				});
+				Assert::IsTrue(intersections.size() > SbMaxCollisions);
+				Assert::IsTrue(intersections.size() == intersectionCount);
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+			}
+		}
+
+		TEST_METHOD(testNestedAndConcurrentGridQueries) {
+			std::vector<Shape*> shapes;
+			SpatialTree* tree = SpatialTree::create(DynamicStructure::grid);
+			//big shapes, so each one is in many cells
+			for (size_t i = 0; i < 100; i++) {
+				auto s = Shape::fromRect(Rect(Vec2((float)(i % 10) * 3, (float)(i / 10) * 3), Vec2::one * 10));
+				shapes.push_back(s);
+				tree->addDynamicNode(s);
+			}
+			const auto range = Rect(-100, -100, 300, 300);
+
+			//a query started from a visitor must not disturb the one that called it
+			size_t outer = 0, inner = 0;
+			tree->visitRange(range, [&](Shape* s) {
+				outer++;
+				if (outer % 10 == 0) {
+					std::vector<Shape*> buffer;
+					tree->rangeQuery(&buffer, range);
+					Assert::IsTrue(buffer.size() == shapes.size());
+					inner++;
+				}
+				return true;
+			});
+			Assert::IsTrue(outer == shapes.size());
+			Assert::IsTrue(inner == shapes.size() / 10);
+
+			//queries on other threads, while nothing modifies the tree
+			std::vector<size_t> counts(4, 0);
+			std::vector<std::thread> threads;
+			for (size_t t = 0; t < counts.size(); t++) {
+				threads.push_back(std::thread([&, t]() {
+					for (size_t k = 0; k < 100; k++) {
+						std::vector<Shape*> buffer;
+						tree->rangeQuery(&buffer, range, std::numeric_limits<size_t>::max(), sdmDynamic);
+						if (buffer.size() == shapes.size())
+							counts[t]++;
+					}
+				}));
+			}
+			for (auto& t : threads)
+				t.join();
+			for (auto c : counts)
+				Assert::IsTrue(c == 100);
+
+			delete tree;
+			for (auto s : shapes)
+				delete s;
+		}
+
+		TEST_METHOD(testConcurrentReaders) {
+			std::mt19937 rng(2468);
+			std::uniform_real_distribution<float> position(-60.0f, 60.0f);
+			std::uniform_real_distribution<float> size(0.5f, 5.0f);
+			std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+
+			for (auto ds : { DynamicStructure::grid, DynamicStructure::aabbTree, DynamicStructure::hierarchicalGrid }) {
+				std::vector<Shape*> shapes;
+				SpatialTree* tree = SpatialTree::create(ds);
+				for (size_t i = 0; i < 600; i++) {
+					auto c = Vec2(position(rng), position(rng));
+					auto h = size(rng) / 2;
+					Shape* s;
+					if (i % 3 == 0)
+						s = Shape::fromCircle(Circle(c, h));
+					else if (i % 3 == 1)
+						s = Shape::fromRect(Rect(c, Vec2(h, h) * 2));
+					else {
+						//range queries read the bounds polygons work out lazily; rays leave them out
+						s = Shape::fromPolygon(Polygon({ c + Vec2(-h, -h), c + Vec2(h, -h), c + Vec2(0, h) }));
+						s->setTypeMask(2);
+					}
+					shapes.push_back(s);
+					if (i % 2 == 0)
+						tree->addStaticNode(s);
+					else
+						tree->addDynamicNode(s);
+				}
+
+				std::vector<Rect> ranges;
+				std::vector<Ray> rays;
+				for (size_t k = 0; k < 100; k++) {
+					ranges.push_back(Rect(Vec2(position(rng), position(rng)), Vec2(size(rng), size(rng)) * 3));
+					auto a = angle(rng);
+					rays.push_back(Ray(Vec2(position(rng), position(rng)), Vec2(cosf(a), sinf(a))));
+				}
+				std::vector<std::vector<Shape*>> expectedRanges(ranges.size());
+				std::vector<RayCastResult> expectedRays;
+				for (size_t k = 0; k < ranges.size(); k++) {
+					tree->rangeQuery(&expectedRanges[k], ranges[k]);
+					std::sort(expectedRanges[k].begin(), expectedRanges[k].end());
+					expectedRays.push_back(tree->rayCast(rays[k], 1));
+				}
+
+				//the first queries find a snapshot to publish while a writer keeps adding far away static shapes
+				std::vector<Shape*> farShapes;
+				for (size_t i = 0; i < 200; i++)
+					farShapes.push_back(Shape::fromRect(Rect(Vec2(1000.0f + position(rng), position(rng)), Vec2::one)));
+				tree->addStaticNode(farShapes[0]);
+				std::vector<size_t> mismatches(4, 0);
+				std::vector<std::thread> threads;
+				for (size_t t = 0; t < mismatches.size(); t++) {
+					threads.push_back(std::thread([&, t]() {
+						for (size_t pass = 0; pass < 5; pass++) {
+							for (size_t k = 0; k < ranges.size(); k++) {
+								std::vector<Shape*> buffer;
+								tree->rangeQuery(&buffer, ranges[k]);
+								std::sort(buffer.begin(), buffer.end());
+								if (buffer != expectedRanges[k])
+									mismatches[t]++;
+								//rays that missed everything may now reach the far shapes
+								auto r = tree->rayCast(rays[k], 1);
+								if (!expectedRays[k].empty && r.intersected != expectedRays[k].intersected)
+									mismatches[t]++;
+								if (expectedRays[k].empty && !r.empty && r.intersected->bounds().center().x < 900)
+									mismatches[t]++;
+							}
+						}
+					}));
+				}
+				threads.push_back(std::thread([&]() {
+					for (size_t i = 1; i < farShapes.size(); i++) {
+						tree->addStaticNode(farShapes[i]);
+						if (i % 2 == 0)
+							tree->removeNode(farShapes[i - 1]);
+					}
+				}));
+				for (auto& t : threads)
+					t.join();
+				for (auto m : mismatches)
+					Assert::IsTrue(m == 0);
+
+				//the writer's changes are all visible once it's done
+				std::vector<Shape*> far;
+				tree->rangeQuery(&far, Rect(1000, 0, 300, 300));
+				Assert::IsTrue(far.size() == farShapes.size() / 2 + 1);
+
+				delete tree;
+				for (auto s : shapes)
+					delete s;
+				for (auto s : farShapes)
+					delete s;
+			}
+		}
+
 	};
 }
@@ -0,0 +1,224 @@
+/**
+Copyright (C) 2014 Danilo Carvalho - All Rights Reserved
+
+You can't use, distribute or modify this code without my permission.
+*/
+
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "Triangulator.h"
+#include "Polygon.h"
+#include "Rect.h"
+#include "BezierCurve.h"
+#include "Utils.h"
+#include <random>
+#include <chrono>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace sb;
+
+namespace SBTest
+{
+	//Points of the outline followed by the points of the holes, as the triangulator indexes them
+	static std::vector<Vec2> allPoints(const Polygon& outline, const std::vector<Polygon>& holes) {
+		auto points = outline.allPoints();
+		for (const auto& h : holes)
+			points.insert(points.end(), h.allPoints().begin(), h.allPoints().end());
+		return points;
+	}
+
+	static float triangleArea(const Vec2& a, const Vec2& b, const Vec2& c) {
+		return ((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x)) / 2;
+	}
+
+	//Checks the triangle count, the winding and that the triangles cover the area of the polygon
+	static bool checkTriangulation(const Polygon& outline, const std::vector<Polygon>& holes, const std::vector<uint32_t>& indices) {
+		const auto points = allPoints(outline, holes);
+		if (indices.size() != 3 * Triangulator::triangleCount(points.size(), holes.size()))
+			return false;
+		double area = 0, expected = outline.area();
+		for (const auto& h : holes)
+			expected -= h.area();
+		for (size_t i = 0; i < indices.size(); i += 3) {
+			if (indices[i] >= points.size() || indices[i + 1] >= points.size() || indices[i + 2] >= points.size())
+				return false;
+			const auto a = triangleArea(points[indices[i]], points[indices[i + 1]], points[indices[i + 2]]);
+			if (a < 0)
+				return false;
+			area += a;
+		}
+		return fabs(area - expected) <= 0.0001 * expected;
+	}
+
+	//Star shaped polygon around the origin, counter-clockwise
+	static Polygon randomStar(std::mt19937& rng, size_t count, float minRadius, float maxRadius) {
+		std::uniform_real_distribution<float> radius(minRadius, maxRadius);
+		std::vector<Vec2> points;
+		for (size_t i = 0; i < count; i++) {
+			const auto angle = 2 * SbPI * i / count;
+			const auto r = radius(rng);
+			points.push_back(Vec2(cosf(angle) * r, sinf(angle) * r));
+		}
+		return Polygon(points);
+	}
+
+	static Polygon reversed(const Polygon& p) {
+		auto points = p.allPoints();
+		std::reverse(points.begin(), points.end());
+		return Polygon(points);
+	}
+
+	//Reference ear clipper, O(n^2), for simple polygons wound counter-clockwise
+	static void earClip(const Polygon& p, std::vector<uint32_t>* indices) {
+		const auto& points = p.allPoints();
+		const auto n = (uint32_t)points.size();
+		std::vector<uint32_t> next(n), prev(n);
+		std::vector<bool> reflex(n);
+		const auto orient = [&](uint32_t a, uint32_t b, uint32_t c) {
+			return triangleArea(points[a], points[b], points[c]);
+		};
+		for (uint32_t i = 0; i < n; i++) {
+			next[i] = (i + 1) % n;
+			prev[i] = (i + n - 1) % n;
+		}
+		for (uint32_t i = 0; i < n; i++)
+			reflex[i] = orient(prev[i], i, next[i]) <= 0;
+		const auto isEar = [&](uint32_t v) {
+			const auto a = prev[v], c = next[v];
+			if (reflex[v])
+				return false;
+			for (auto w = next[c]; w != a; w = next[w]) {
+				if (reflex[w] && orient(a, v, w) >= 0 && orient(v, c, w) >= 0 && orient(c, a, w) >= 0)
+					return false;
+			}
+			return true;
+		};
+		uint32_t v = 0, left = n, tries = 0;
+		while (left > 3 && tries < left) {
+			if (isEar(v)) {
+				const auto a = prev[v], c = next[v];
+				indices->push_back(a);
+				indices->push_back(v);
+				indices->push_back(c);
+				next[a] = c;
+				prev[c] = a;
+				reflex[a] = orient(prev[a], a, c) <= 0;
+				reflex[c] = orient(a, c, next[c]) <= 0;
+				left--;
+				tries = 0;
+				v = a;
+			}
+			else {
+				v = next[v];
+				tries++;
+			}
+		}
+		indices->push_back(prev[v]);
+		indices->push_back(v);
+		indices->push_back(next[v]);
+	}
+
+	TEST_CLASS(TriangulatorTests) {
+
+		TEST_METHOD(testConvexAndConcave) {
+			const auto square = Polygon({ Vec2(0, 0), Vec2(1, 0), Vec2(1, 1), Vec2(0, 1) });
+			std::vector<uint32_t> indices;
+			Triangulator::triangulate(square, &indices);
+			Assert::IsTrue(checkTriangulation(square, {}, indices), L"Square failed.");
+			//Comb with teeth up and down, full of split and merge vertices
+			std::vector<Vec2> comb;
+			for (int i = 0; i < 10; i++) {
+				comb.push_back(Vec2((float)(2 * i), 0));
+				comb.push_back(Vec2((float)(2 * i + 1), -3));
+			}
+			comb.push_back(Vec2(20, 0));
+			comb.push_back(Vec2(20, 1));
+			for (int i = 10; i > 0; i--) {
+				comb.push_back(Vec2((float)(2 * i - 1), 4));
+				comb.push_back(Vec2((float)(2 * i - 2), 1));
+			}
+			indices.clear();
+			Triangulator::triangulate(Polygon(comb), &indices);
+			Assert::IsTrue(checkTriangulation(Polygon(comb), {}, indices), L"Comb failed.");
+			indices.clear();
+			Triangulator::triangulate(reversed(Polygon(comb)), &indices);
+			Assert::IsTrue(checkTriangulation(reversed(Polygon(comb)), {}, indices), L"Clockwise comb failed.");
+		}
+
+		TEST_METHOD(testHoles) {
+			const auto outline = Polygon({ Vec2(0, 0), Vec2(10, 0), Vec2(10, 10), Vec2(0, 10) });
+			const std::vector<Polygon> holes = {
+				Polygon({ Vec2(1, 1), Vec2(1, 4), Vec2(4, 4), Vec2(4, 1) }),
+				Polygon({ Vec2(6, 6), Vec2(9, 6), Vec2(7.5f, 9) }),
+				Polygon({ Vec2(5, 1), Vec2(9, 1), Vec2(9, 2), Vec2(6, 2), Vec2(6, 4), Vec2(5, 4) })
+			};
+			std::vector<uint32_t> indices;
+			Triangulator::triangulate(outline, holes, &indices);
+			Assert::IsTrue(checkTriangulation(outline, holes, indices), L"Triangulation with holes failed.");
+			const auto points = allPoints(outline, holes);
+			for (size_t i = 0; i < indices.size(); i += 3) {
+				const auto c = (points[indices[i]] + points[indices[i + 1]] + points[indices[i + 2]]) / 3;
+				for (const auto& h : holes)
+					Assert::IsFalse(h.containsPoint(c), L"A triangle covers a hole.");
+			}
+		}
+
+		TEST_METHOD(testRandomPolygons) {
+			std::mt19937 rng(7);
+			for (int i = 0; i < 100; i++) {
+				const auto outline = randomStar(rng, 3 + i * 5, 4, 10);
+				std::vector<Polygon> holes;
+				holes.push_back(randomStar(rng, 3 + i, 1, 3));
+				std::vector<uint32_t> indices;
+				Triangulator::triangulate(outline, holes, &indices);
+				Assert::IsTrue(checkTriangulation(outline, holes, indices), L"Random polygon failed.");
+			}
+		}
+
+		TEST_METHOD(testBezierOutline) {
+			const std::vector<BezierCurve> curves = {
+				BezierCurve(Vec2(0, 0), Vec2(4, -2), Vec2(8, 2), Vec2(10, 0)),
+				BezierCurve(Vec2(10, 0), Vec2(14, 6), Vec2(6, 6), Vec2(10, 10)),
+				BezierCurve(Vec2(10, 10), Vec2(6, 14), Vec2(2, 6), Vec2(0, 10)),
+				BezierCurve(Vec2(0, 10), Vec2(-4, 6), Vec2(4, 4), Vec2(0, 0))
+			};
+			const auto outline = BezierCurve::toPolygon(curves);
+			Assert::IsTrue(outline.isClosed() && outline.pointCount() > 20);
+			std::vector<uint32_t> indices;
+			Triangulator::triangulate(outline, &indices);
+			Assert::IsTrue(checkTriangulation(outline, {}, indices), L"Bezier outline failed.");
+		}
+
+		TEST_METHOD(testMesh) {
+			const auto outline = Polygon({ Vec2(0, 0), Vec2(4, 0), Vec2(4, 2), Vec2(0, 2) });
+			const std::vector<Polygon> holes = { Polygon({ Vec2(1, 0.5f), Vec2(3, 0.5f), Vec2(2, 1.5f) }) };
+			BasicMesh mesh;
+			Triangulator::triangulate(outline, Rect(2, 1, 4, 2), &mesh);
+			Triangulator::triangulate(outline, holes, Rect(2, 1, 4, 2), &mesh);
+			Assert::IsTrue(mesh.VBCount() == 11 && mesh.IBCount() == 3 * (2 + 7));
+			for (size_t i = 6; i < mesh.IBCount(); i++)
+				Assert::IsTrue(mesh.IB()[i] >= 4 && mesh.IB()[i] < 11, L"Indices should point past the first polygon.");
+			Assert::IsTrue(aeq(mesh.VB()[0].texture(), Vec2(0, 1)), L"Bottom left uv failed.");
+			Assert::IsTrue(aeq(mesh.VB()[2].texture(), Vec2(1, 0)), L"Top right uv failed.");
+			Assert::IsTrue(aeq(mesh.VB()[8].texture(), Vec2(0.25f, 0.75f)), L"Hole uv failed.");
+			Assert::IsTrue(mesh.VB()[9].position() == Vec2(3, 0.5f));
+		}
+
+		TEST_METHOD(testBenchmarkAgainstEarClipping) {
+			std::mt19937 rng(11);
+			const auto outline = randomStar(rng, 10000, 50, 100);
+			std::vector<uint32_t> sweep, ears;
+			const auto t0 = std::chrono::high_resolution_clock::now();
+			Triangulator::triangulate(outline, &sweep);
+			const auto t1 = std::chrono::high_resolution_clock::now();
+			earClip(outline, &ears);
+			const auto t2 = std::chrono::high_resolution_clock::now();
+			Assert::IsTrue(checkTriangulation(outline, {}, sweep), L"Sweep triangulation failed.");
+			Assert::IsTrue(checkTriangulation(outline, {}, ears), L"Ear clipping failed.");
+			const auto ms = [](std::chrono::high_resolution_clock::duration d) {
+				return std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0);
+			};
+			Logger::WriteMessage(("10000 points, monotone sweep: " + ms(t1 - t0) + "ms, ear clipping: " + ms(t2 - t1) + "ms\n").c_str());
+		}
+	};
+}
\ No newline at end of file